@@ -41,7 +41,7 @@ extern "C" {
          *  yajl_gen_string was called */
         yajl_gen_keys_must_be_strings,
         /** YAJL's maximum generation depth was exceeded.  see
-         *  YAJL_MAX_DEPTH */
+         *  yajl_gen_max_depth */
         yajl_max_depth_exceeded,
         /** A generator function (yajl_gen_XXX) was called while in an error
          *  state */
@@ -88,6 +88,10 @@ extern "C" {
          *
          * example:
          *   yajl_gen_config(g, yajl_gen_print_callback, myFunc, myVoidPtr);
+         *
+         * The generator collects its output and calls the function with
+         * pieces of up to 16 KiB, and whenever a complete JSON value has
+         * been generated.  See yajl_gen_flush() for anything in between.
          */
         yajl_gen_print_callback = 0x04,
         /**
@@ -102,7 +106,26 @@ extern "C" {
          * iterest of saving bytes.  Setting this flag will cause YAJL to
          * always escape '/' in generated JSON strings.
          */
-        yajl_gen_escape_solidus = 0x10
+        yajl_gen_escape_solidus = 0x10,
+        /**
+         * Format numbers passed to yajl_gen_integer() and yajl_gen_double()
+         * with YAJL's own locale independent routines instead of sprintf.
+         * Doubles are written with the shortest digit string that reads
+         * back as the same value (i.e. 0.1 instead of
+         * 0.10000000000000000555), which is also noticeably faster.
+         */
+        yajl_gen_fast_numbers = 0x20,
+        /**
+         * Set the deepest nesting of maps and arrays the generator
+         * accepts, as an unsigned int of at least 1.  Opening a container
+         * below it fails with yajl_max_depth_exceeded.  The default is
+         * YAJL_MAX_DEPTH; the nesting state grows as needed, so a larger
+         * limit costs nothing until the output is that deep.
+         *
+         * example:
+         *   yajl_gen_config(g, yajl_gen_max_depth, 100000u);
+         */
+        yajl_gen_max_depth = 0x40
     } yajl_gen_option;
 
     /** allow the modification of generator options subsequent to handle
@@ -154,6 +177,36 @@ extern "C" {
      *  intended to enable incremental JSON outputing. */
     YAJL_API void yajl_gen_clear(yajl_gen hand);
 
+    /** pass the output collected so far to the print callback (or buffer)
+     *  now instead of once more has been generated. */
+    YAJL_API void yajl_gen_flush(yajl_gen hand);
+
+    /** Reset the generator state.  Allows a client to generate multiple
+     *  json entities in a stream. The "sep" string will be inserted to
+     *  separate the previously generated entity from the current,
+     *  NULL means *no separation* of entites (clients beware, generating
+     *  multiple JSON numbers without a separator, for instance, will result in ambiguous output)
+     *
+     *  Note: this call will not clear yajl's output buffer.  This
+     *  may be accomplished explicitly by calling yajl_gen_clear() */
+    YAJL_API void yajl_gen_reset(yajl_gen hand, const char * sep);
+
+    /** Make hand continue from the position of another generator, so that
+     *  what it generates next can be spliced into the output of from at
+     *  that point.  Options, indent string and nesting are copied, the
+     *  output (buffer or print callback) is not.  With sibling set, hand
+     *  continues as if one more value had been generated in the innermost
+     *  container of from, which is where any but the first member or
+     *  element of that container starts.  This lets the children of a
+     *  container be generated separately, e.g. on several threads. */
+    YAJL_API void yajl_gen_continue(yajl_gen hand, yajl_gen from,
+                                    int sibling);
+
+    /** Pass already generated text, such as the buffer of a generator set
+     *  up with yajl_gen_continue, straight to the output of hand.  The
+     *  generator state is left alone. */
+    YAJL_API void yajl_gen_raw(yajl_gen hand, const char * text, size_t len);
+
 #ifdef __cplusplus
 }
 #endif    
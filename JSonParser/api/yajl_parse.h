@@ -54,9 +54,22 @@
 #define BJSN_CTE_TRUE_RLE		(22)
 #define BJSN_CTE_FALSE_RLE		(23)
 
+// Deepest nesting the parsers accept unless yajl_max_depth says otherwise,
+// the same as the generator's default.
+#define BJSN_MAX_DEPTH			(YAJL_MAX_DEPTH)
+
+// Returned by yajl_start_map or yajl_start_array to have the contents of the
+// container skipped, see yajl_callbacks.
+#define YAJL_SKIP_CONTAINER		(2)
+
 #ifdef __cplusplus
 extern "C" {
 #endif
+    /** length of a binary JSON record with opcode op, not counting the
+     *  string of BJSN_STRING_DIRECT and BJSN_MEMBER_DIRECT, or 0 if op
+     *  isn't one of the BJSN_* opcodes */
+    YAJL_API size_t bjson_record_size(unsigned char op);
+
     /** error codes returned from this interface */
     typedef enum {
         /** no error was encountered */
@@ -85,6 +98,13 @@ extern "C" {
      *  continue.  If zero, the parse will be canceled and
      *  yajl_status_client_canceled will be returned from the parse.
      *
+     *  yajl_start_map and yajl_start_array may return YAJL_SKIP_CONTAINER
+     *  when the client has no use for the container.  The binary JSON and
+     *  MessagePack parsers then step over its contents by their lengths
+     *  and counts, without passing them on, and call the end callback
+     *  right away.  The JSON text parser goes on as for any non-zero
+     *  value, so the client must still be ready to drop the contents.
+     *
      *  \attention {
      *    A note about the handling of numbers:
      *
@@ -121,6 +141,15 @@ extern "C" {
 
         int (* yajl_start_array)(void * ctx, unsigned int size);
         int (* yajl_end_array)(void * ctx);
+
+        /** Optional.  count (more than one) equal values in a row, from
+         *  the run-length encoded records of binary JSON and MessagePack.
+         *  When NULL the run is passed as count separate yajl_integer or
+         *  yajl_boolean calls instead. */
+        int (* yajl_integer_run)(void * ctx, long long integerVal,
+                                 unsigned int count);
+        int (* yajl_boolean_run)(void * ctx, int boolVal,
+                                 unsigned int count);
     } yajl_callbacks;
 
     /** allocate a parser handle
@@ -184,9 +213,63 @@ extern "C" {
          * yajl will enter an error state (premature EOF).  Setting this
          * flag suppresses that check and the corresponding error.
          */
-        yajl_allow_partial_values = 0x10
+        yajl_allow_partial_values = 0x10,
+        /**
+         * Promise that every buffer passed to yajl_parse() stays valid and
+         * unchanged until the handle is freed, e.g. because the whole
+         * document is in memory.  The binary JSON parser then points
+         * constant pool strings into the input instead of copying them.
+         */
+        yajl_persistent_input = 0x20,
+        /**
+         * Check that strings in binary JSON and MessagePack input are valid
+         * UTF8, which they otherwise aren't.  A binary JSON constant pool
+         * entry is checked once, as the pool is read, however many times
+         * the document refers to it.
+         */
+        yajl_validate_binary_strings = 0x40,
+        /**
+         * Set the deepest nesting of maps and arrays accepted in any input
+         * format, as an unsigned int of at least 1.  Deeper input is a
+         * parse error.  The default is BJSN_MAX_DEPTH.
+         *
+         * example:
+         *   yajl_config(h, yajl_max_depth, 100000u);
+         */
+        yajl_max_depth = 0x80,
+        /**
+         * Set the input format, as a yajl_input_format.  The default,
+         * yajl_input_auto, picks it from the first byte of the input.
+         *
+         * example:
+         *   yajl_config(h, yajl_input, yajl_input_msgpack);
+         */
+        yajl_input = 0x100
     } yajl_option;
 
+    /** input formats for the yajl_input option */
+    typedef enum {
+        /** binary JSON when the input starts with 0xFF, the MessagePack
+         *  dialect when it starts with an array16/32 or map16/32 header,
+         *  JSON text otherwise */
+        yajl_input_auto = 0,
+        /** JSON text */
+        yajl_input_json,
+        /** KLab binary JSON */
+        yajl_input_bjson,
+        /** MessagePack as specified: any root value, str8, bin and ext.
+         *  Map keys must be strings, binary or integers, which become
+         *  their decimal text.  bin is passed on as a base64 string, ext
+         *  as an array of its type and its data in base64.  Anything after
+         *  the root value is an error unless yajl_allow_trailing_garbage
+         *  is set. */
+        yajl_input_msgpack,
+        /** The MessagePack dialect of yajl_input_auto: an array or map
+         *  root, 0xC1 as a run-length prefix and the other reserved bytes
+         *  (which the specification uses for str8, bin and ext) ignored */
+        yajl_input_msgpack_ext
+    } yajl_input_format;
+
     /** allow the modification of parser options subsequent to handle
      *  allocation (via yajl_alloc)
      *  \returns zero in case of errors, non-zero otherwise
@@ -196,6 +279,11 @@ extern "C" {
     /** free a parser handle */
     YAJL_API void yajl_free(yajl_handle handle);
 
+    /** return a parser handle to the state it had right after yajl_alloc(),
+     *  so it can parse another document without being reallocated.  The
+     *  callbacks, context and options set with yajl_config() are kept. */
+    YAJL_API void yajl_reset(yajl_handle handle);
+
     /** Parse some json!
      *  \param hand - a handle to the json parser allocated with yajl_alloc
      *  \param jsonText - a pointer to the UTF8 json text to be parsed
@@ -257,6 +345,10 @@ extern "C" {
 								int				cte_pool,
 								int				cacheID);
 
+	/** Non-zero if [s, s + len) is valid UTF8, as checked when parsing
+	 *  and by yajl_gen_validate_utf8 */
+	int yajl_string_validate_utf8(const unsigned char * s, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
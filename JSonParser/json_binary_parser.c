@@ -1,19 +1,43 @@
 #include "api/yajl_parse.h"
 #include "yajl_parser.h"
+#include "yajl_alloc.h"
+#include "yajl_encode.h"
 
 #include <stdio.h>
+#include <string.h>
+
+#include "yajl_assert.h"
 
 #define BJSON_NO_ERROR		(yajl_status_ok)
 #define BJSON_CANCEL		(yajl_status_client_canceled)
 #define BJSON_ERROR			(yajl_status_error)
+// The record does not fit in the bytes available, *need says how many it
+// takes (or at least how many are needed to tell).
+#define BJSON_MORE			(-1)
+// Pool entries allocated before any has been read.
+#define BJSON_POOL_INITIAL	(1024)
 
 #define CHCK_PARSER(x)		if (!(x)) { \
-								error = BJSON_CANCEL; parse = endStream; \
+								return bjson_error(hand, BJSON_CANCEL, "client cancelled parse via callback return value"); \
 							}
 
-#define CHCK_PARSER_LOOP(x)	if (!(x)) { \
-								error = BJSON_CANCEL; parse = endStream; break; \
-							}
+// Declares that the current record is n bytes long so far.
+#define NEED(n)				*need = (size_t)(n); \
+							if (len < *need) { return BJSON_MORE; }
+
+#define RD16(p)				bjson_rd16(p)
+#define RD32(p)				bjson_rd32(p)
+#define RD64(p)				bjson_rd64(p)
+
+// Length of each record by opcode, not counting the string of the direct
+// ones, so that one check per record covers all of its fixed fields.
+static const unsigned char bjson_record_sizes[BJSN_CTE_FALSE_RLE + 1] = {
+	1, 5, 9, 1, 1, 5, 5, 5, 5, 9, 9, 5, 3, 2, 5, 1, 1, 1, 4, 5, 7, 11, 3, 3
+};
+
+size_t bjson_record_size(unsigned char op) {
+	return (op <= BJSN_CTE_FALSE_RLE) ? bjson_record_sizes[op] : 0;
+}
 
 
 int bjson_getCPCacheID(		yajl_handle		hand,
@@ -37,289 +61,636 @@ void bjson_setCPCacheID(	yajl_handle		hand,
 	}
 }
 
-int bjson_parse(	yajl_handle		hand,
-					const unsigned char*	jsonText,
-					int						jsonTextLength
-				)
-{
-	bjson_handle*	bjsn= &hand->bj;
+static int bjson_error(	yajl_handle		hand,
+						int				error,
+						const char*		message) {
+	yajl_bs_set(hand->stateStack, yajl_state_parse_error);
+	hand->parseError = message;
+	return error;
+}
 
-	int error			= BJSON_NO_ERROR;
-	const yajl_callbacks * callbacks = hand->callbacks;
-	cp_entry*	cp		= 0;
-	void*		ctx		= bjsn->ctx;
+static void bjson_release_pool(bjson_handle* bjsn, yajl_alloc_funcs* afs) {
+	if (bjsn->cp) {
+		YA_FREE(afs, bjsn->cp);
+		bjsn->cp = NULL;
+	}
 
-	const unsigned char* endStream	= &jsonText[jsonTextLength];
-	const unsigned char* parse		= jsonText;
+	if (bjsn->strs) {
+		YA_FREE(afs, bjsn->strs);
+		bjsn->strs = NULL;
+	}
 
-	// Parse header
-	if ((parse[0] != 0xFF) || (parse[1] != 0xFF)) {
-		error	= BJSON_ERROR;
-		parse	= endStream;
-	} else {
-		parse += 2;
+	bjsn->cp_count	= 0;
+	bjsn->cp_size	= 0;
+	bjsn->strs_len	= 0;
+	bjsn->strs_size	= 0;
+}
+
+void bjson_free(	yajl_handle		hand) {
+	bjson_release_pool(&hand->bj, &hand->alloc);
+	bjson_release_pool(&hand->msgpack, &hand->alloc);
+
+	if (hand->bj.partial)		yajl_buf_free(hand->bj.partial);
+	if (hand->msgpack.partial)	yajl_buf_free(hand->msgpack.partial);
+	if (hand->bj.stack)			YA_FREE(&(hand->alloc), hand->bj.stack);
+	if (hand->msgpack.stack)	YA_FREE(&(hand->alloc), hand->msgpack.stack);
+
+	hand->bj.partial		= NULL;
+	hand->msgpack.partial	= NULL;
+	hand->bj.stack			= NULL;
+	hand->msgpack.stack		= NULL;
+}
+
+// Back to the state of a fresh handle, keeping the string and record buffers.
+static void bjson_reset_one(bjson_handle* bjsn, yajl_alloc_funcs* afs) {
+	if (bjsn->cp) {
+		YA_FREE(afs, bjsn->cp);
+		bjsn->cp = NULL;
 	}
+	if (bjsn->partial) yajl_buf_clear(bjsn->partial);
 
-	// Parse Pre-CP
-	{
-		int strSize;
-		int cnt = (parse[0] << 24) | (parse[1] << 16) | (parse[2] << 8) | parse[3];
-		parse += 4;
-		strSize = (parse[0] << 24) | (parse[1] << 16) | (parse[2] << 8) | parse[3];
-		parse += 4;
-
-		if (cnt) {
-			bjsn->cp_count = cnt;
-			bjsn->cp	= (cp_entry*)hand->alloc.malloc(hand->alloc.ctx , cnt * sizeof(cp_entry));
-			cp			= bjsn->cp;
-			bjsn->strs	= NULL; // (unsigned char*)hand->alloc.malloc(hand->alloc.ctx, strSize);
-			if (bjsn->cp /*&& bjsn->strs*/) {
-				int n;
-//				unsigned char* wPtr = bjsn->strs;
-				for (n=0; n < cnt; n++) {
-					// Size
-					int len = (parse[0] << 24) | (parse[1] << 16) | (parse[2] << 8) | parse[3];
-					parse += 4;
-
-					// String
-					// memcpy(wPtr, parse, len);
-					cp[n].string		= parse;
-
-					// Read Ptr
-					parse	+= len;
-					// Write Ptr
-					// wPtr	+= len;
-
-					// Cache
-					cp[n].stringlen		= len;
-					cp[n].memberCache	= -1;
+	bjsn->used			= 0;
+	bjsn->cp_count		= 0;
+	bjsn->cp_size		= 0;
+	bjsn->cp_read		= 0;
+	bjsn->strs_len		= 0;
+	bjsn->depth			= 0;
+	bjsn->skipDepth		= 0;
+	bjsn->state			= bjson_state_header;
+	bjsn->parseError	= NULL;
+}
+
+void bjson_reset(	yajl_handle		hand) {
+	bjson_reset_one(&hand->bj, &hand->alloc);
+	bjson_reset_one(&hand->msgpack, &hand->alloc);
+}
+
+int bjson_integer_run(	const yajl_callbacks*	callbacks,
+						void*					ctx,
+						long long int			value,
+						unsigned int			count) {
+	unsigned int n;
+
+	if (count == 0) {
+		return 1;
+	}
+	if (callbacks->yajl_integer_run && (count > 1)) {
+		return callbacks->yajl_integer_run(ctx, value, count);
+	}
+
+	for (n = 0; n < count; n++) {
+		if (!callbacks->yajl_integer(ctx, value)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int bjson_boolean_run(	const yajl_callbacks*	callbacks,
+						void*					ctx,
+						int						value,
+						unsigned int			count) {
+	unsigned int n;
+
+	if (count == 0) {
+		return 1;
+	}
+	if (callbacks->yajl_boolean_run && (count > 1)) {
+		return callbacks->yajl_boolean_run(ctx, value, count);
+	}
+
+	for (n = 0; n < count; n++) {
+		if (!callbacks->yajl_boolean(ctx, value)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int bjson_skip_value(void* ctx) { (void)ctx; return 1; }
+static int bjson_skip_boolean(void* ctx, int v) { (void)ctx; (void)v; return 1; }
+static int bjson_skip_integer(void* ctx, long long v) { (void)ctx; (void)v; return 1; }
+static int bjson_skip_double(void* ctx, double v) { (void)ctx; (void)v; return 1; }
+static int bjson_skip_string(void* ctx, const unsigned char* s, size_t len, int cte_pool) { (void)ctx; (void)s; (void)len; (void)cte_pool; return 1; }
+static int bjson_skip_open(void* ctx, unsigned int size) { (void)ctx; (void)size; return 1; }
+static int bjson_skip_integer_run(void* ctx, long long v, unsigned int count) { (void)ctx; (void)v; (void)count; return 1; }
+static int bjson_skip_boolean_run(void* ctx, int v, unsigned int count) { (void)ctx; (void)v; (void)count; return 1; }
+
+const yajl_callbacks bjson_skip_callbacks = {
+	bjson_skip_value,
+	bjson_skip_boolean,
+	bjson_skip_integer,
+	bjson_skip_double,
+	NULL,
+	bjson_skip_string,
+	bjson_skip_open,
+	bjson_skip_string,
+	bjson_skip_value,
+	bjson_skip_open,
+	bjson_skip_value,
+	bjson_skip_integer_run,
+	bjson_skip_boolean_run
+};
+
+// Copies a pool string that can't be referenced in place into strs.
+static const unsigned char* bjson_store_string(	yajl_handle				hand,
+												const unsigned char*	str,
+												size_t					len) {
+	bjson_handle*	bjsn	= &hand->bj;
+
+	// An empty first string still needs somewhere to point.
+	if ((bjsn->strs == NULL) || (len > bjsn->strs_size - bjsn->strs_len)) {
+		unsigned char*	old		= bjsn->strs;
+		size_t			size	= bjsn->strs_size ? bjsn->strs_size : 4096;
+		int				n;
+
+		while (size - bjsn->strs_len < len) {
+			if (size > ((size_t)-1) / 2) return NULL;
+			size *= 2;
+		}
+
+		bjsn->strs = (unsigned char*)YA_REALLOC(&(hand->alloc), old, size);
+		if (bjsn->strs == NULL) {
+			bjsn->strs = old;
+			return NULL;
+		}
+		bjsn->strs_size = size;
+
+		// Entries copied earlier moved along with the buffer.
+		if (old && (old != bjsn->strs)) {
+			for (n = 0; n < bjsn->cp_read; n++) {
+				if ((size_t)(bjsn->cp[n].string - old) < bjsn->strs_len) {
+					bjsn->cp[n].string = bjsn->strs + (bjsn->cp[n].string - old);
 				}
-			} else {
-				error	= BJSON_ERROR;
-				parse	= endStream;
 			}
 		}
 	}
-	
-	// Parse Inner stream
-	while (parse < endStream) {
-		// printf("Comm %4i %i %i\n",commandID++, *parse, error);
 
-		switch (*parse++) {
-		case BJSN_END:
-			parse = endStream;
-			break;
-		case BJSN_OPEN_OBJ:
-			{
-				int size = (parse[0] << 24) | (parse[1] << 16) | (parse[2] << 8) | parse[3];
-				parse += 4;
-				CHCK_PARSER(callbacks->yajl_start_map(ctx,size));
-			}
-			break;
-		case BJSN_OPEN_ARR:
-			{
-				int size = (parse[0] << 24) | (parse[1] << 16) | (parse[2] << 8) | parse[3];
-				parse += 8; // Skip type mask
-				CHCK_PARSER(callbacks->yajl_start_array(ctx, size));
-			}
-			break;
-		case BJSN_CLOSE_OBJ:
-			CHCK_PARSER(callbacks->yajl_end_map(ctx));
-			break;
-		case BJSN_CLOSE_ARR:
-			CHCK_PARSER(callbacks->yajl_end_array(ctx));
-			break;
-		case BJSN_STRING:
-			{
-				int idx = (parse[0] << 24) | (parse[1] << 16) | (parse[2] << 8) | parse[3];
-				parse += 4; 
-				CHCK_PARSER(callbacks->yajl_string(ctx, cp[idx].string, cp[idx].stringlen, idx));
+	memcpy(bjsn->strs + bjsn->strs_len, str, len);
+	bjsn->strs_len += len;
+	return bjsn->strs + bjsn->strs_len - len;
+}
+
+// Keeps track of the open containers for a record with opcode op, and checks
+// that it fits where it is: keys only in objects, each followed by exactly
+// one value, and closes matching their opens.
+static int bjson_structure(	yajl_handle		hand,
+							unsigned char	op) {
+	bjson_handle*	bjsn	= &hand->bj;
+	msgpack_frame*	top		= bjsn->depth ? &bjsn->stack[bjsn->depth - 1] : NULL;
+
+	switch (op) {
+	case BJSN_END:
+		return BJSON_NO_ERROR;
+	case BJSN_MEMBER:
+	case BJSN_MEMBER_DIRECT:
+		if ((top == NULL) || !top->isMap) {
+			return bjson_error(hand, BJSON_ERROR, "binary JSON key outside an object");
+		}
+		if (top->remaining) {
+			return bjson_error(hand, BJSON_ERROR, "binary JSON key without a value");
+		}
+		top->remaining = 1;
+		return BJSON_NO_ERROR;
+	case BJSN_CLOSE_OBJ:
+	case BJSN_CLOSE_ARR:
+		if (top == NULL) {
+			return bjson_error(hand, BJSON_ERROR, (op == BJSN_CLOSE_OBJ) ? "unbalanced binary JSON object close" : "unbalanced binary JSON array close");
+		}
+		if (top->isMap != (op == BJSN_CLOSE_OBJ)) {
+			return bjson_error(hand, BJSON_ERROR, "mismatched binary JSON close");
+		}
+		if (top->remaining) {
+			return bjson_error(hand, BJSON_ERROR, "binary JSON key without a value");
+		}
+		bjsn->depth--;
+		return BJSON_NO_ERROR;
+	default:
+		break;
+	}
+
+	// A value, which in an object takes the place after a key. Runs are
+	// several values, so they only belong in arrays.
+	if ((top != NULL) && top->isMap) {
+		if (!top->remaining) {
+			return bjson_error(hand, BJSON_ERROR, "binary JSON value without a key");
+		}
+		if (op >= BJSN_NUMBER_I8_RLE) {
+			return bjson_error(hand, BJSON_ERROR, "binary JSON run inside an object");
+		}
+		top->remaining = 0;
+	}
+
+	if ((op == BJSN_OPEN_OBJ) || (op == BJSN_OPEN_ARR)) {
+		if (bjsn->depth >= hand->maxDepth) {
+			return bjson_error(hand, BJSON_ERROR, "binary JSON nesting too deep");
+		}
+
+		if (bjsn->depth == bjsn->stack_size) {
+			size_t			size	= bjsn->stack_size ? bjsn->stack_size * 2 : 32;
+			msgpack_frame*	stack	= (msgpack_frame*)YA_REALLOC(&(hand->alloc), bjsn->stack, size * sizeof(msgpack_frame));
+
+			if (stack == NULL) {
+				return bjson_error(hand, BJSON_ERROR, "out of memory");
 			}
-			break;
-		case BJSN_STRING_DIRECT:
-			{
-				int len = (parse[0] << 24) | (parse[1] << 16) | (parse[2] << 8) | parse[3];
-				parse += 4;
-				CHCK_PARSER(callbacks->yajl_string(ctx, parse, len, -1));
-				parse += len;
+
+			bjsn->stack			= stack;
+			bjsn->stack_size	= size;
+		}
+
+		bjsn->stack[bjsn->depth].remaining	= 0;
+		bjsn->stack[bjsn->depth].isMap		= (op == BJSN_OPEN_OBJ);
+		bjsn->depth++;
+	}
+
+	return BJSON_NO_ERROR;
+}
+
+// Decodes the record at the beginning of [p, p + len) and sets *need to its
+// size.  inPlace tells whether p stays valid after the call returns.
+static int bjson_record(	yajl_handle				hand,
+							const unsigned char*	p,
+							size_t					len,
+							int						inPlace,
+							size_t*					need)
+{
+	bjson_handle*	bjsn= &hand->bj;
+	const yajl_callbacks * callbacks = hand->callbacks;
+	cp_entry*	cp		= bjsn->cp;
+	void*		ctx		= bjsn->ctx;
+	int			error;
+
+	switch (bjsn->state) {
+	case bjson_state_header:
+		// Header and Pre-CP sizes
+		{
+			unsigned int cnt;
+
+			NEED(10);
+			if ((p[0] != 0xFF) || (p[1] != 0xFF)) {
+				return bjson_error(hand, BJSON_ERROR, "invalid binary JSON header");
 			}
-			break;
-		case BJSN_MEMBER:
-			{
-				int idx = (parse[0] << 24) | (parse[1] << 16) | (parse[2] << 8) | parse[3];
-				parse += 4;
-				CHCK_PARSER(callbacks->yajl_map_key(ctx, cp[idx].string, cp[idx].stringlen, idx));
+
+			cnt				= RD32(p + 2);
+			// strSize (p + 6) is only a hint for copying the strings.
+			bjsn->strs_len	= 0;
+			bjsn->strs_size	= 0;
+			bjsn->cp_read	= 0;
+			bjsn->state		= bjson_state_stream;
+
+			if (cnt) {
+				if (cnt > 0x7FFFFFFF) {
+					return bjson_error(hand, BJSON_ERROR, "binary JSON constant pool too large");
+				}
+
+				// The count isn't trusted: cp grows as entries actually arrive.
+				bjsn->cp_size	= (cnt < BJSON_POOL_INITIAL) ? (int)cnt : BJSON_POOL_INITIAL;
+				bjsn->cp = (cp_entry*)hand->alloc.malloc(hand->alloc.ctx , bjsn->cp_size * sizeof(cp_entry));
+				if (bjsn->cp == NULL) {
+					return bjson_error(hand, BJSON_ERROR, "out of memory");
+				}
+
+				bjsn->cp_count	= (int)cnt;
+				bjsn->state		= bjson_state_pool;
 			}
-			break;
-		case BJSN_MEMBER_DIRECT:
-			{
-				int len = (parse[0] << 24) | (parse[1] << 16) | (parse[2] << 8) | parse[3];
-				parse += 4;
-				CHCK_PARSER(callbacks->yajl_map_key(ctx, parse, len, -1));
-				parse += len;
+		}
+		return BJSON_NO_ERROR;
+	case bjson_state_pool:
+		{
+			cp_entry*		entry;
+			unsigned int	strLen;
+
+			NEED(4);
+			strLen = RD32(p);
+			if (strLen > 0x7FFFFFFF) {
+				return bjson_error(hand, BJSON_ERROR, "binary JSON string too long");
 			}
-			break;
-		case BJSN_NUMBER_I64:
-			{
-				// MSB 32/64
-				int idx  = (parse[0] << 24) | (parse[1] << 16) | (parse[2] << 8) | parse[3];
-				unsigned int idx2 = (parse[4] << 24) | (parse[5] << 16) | (parse[6] << 8) | parse[7];
-				long long int l64 = (((long long int)idx)<<32) | idx2;
-				parse += 8;
-				CHCK_PARSER(callbacks->yajl_integer(ctx, l64));
+			NEED((size_t)strLen + 4);
+
+			if ((hand->flags & yajl_validate_binary_strings) && !yajl_string_validate_utf8(p + 4, strLen)) {
+				return bjson_error(hand, BJSON_ERROR, "invalid UTF-8 in binary JSON string");
 			}
-			break;
-		case BJSN_NUMBER_DBL:
-			{
-				unsigned int idx  = (parse[0] << 24) | (parse[1] << 16) | (parse[2] << 8) | parse[3];
-				unsigned int idx2 = (parse[4] << 24) | (parse[5] << 16) | (parse[6] << 8) | parse[7];
-				unsigned long long int l64 = (((unsigned long long int)idx)<<32) | idx2;
-				parse += 8;
-				CHCK_PARSER(callbacks->yajl_double(ctx, (*((double*)&l64))));
+
+			if (bjsn->cp_read == bjsn->cp_size) {
+				int			size	= (bjsn->cp_size > bjsn->cp_count / 2) ? bjsn->cp_count : bjsn->cp_size * 2;
+				cp_entry*	grown	= (cp_entry*)hand->alloc.realloc(hand->alloc.ctx, bjsn->cp, size * sizeof(cp_entry));
+				if (grown == NULL) {
+					return bjson_error(hand, BJSON_ERROR, "out of memory");
+				}
+				bjsn->cp		= grown;
+				bjsn->cp_size	= size;
 			}
-			break;
-		case BJSN_NUMBER_I32:
-			{
-				int idx  = (parse[0] << 24) | (parse[1] << 16) | (parse[2] << 8) | parse[3];
-				parse += 4;
-				CHCK_PARSER(callbacks->yajl_integer(ctx, idx));
+			entry = &bjsn->cp[bjsn->cp_read];
+
+			// String
+			if (inPlace) {
+				entry->string	= p + 4;
+			} else {
+				entry->string	= bjson_store_string(hand, p + 4, strLen);
+				if (entry->string == NULL) {
+					return bjson_error(hand, BJSON_ERROR, "out of memory");
+				}
 			}
-			break;
-		case BJSN_NUMBER_I16:
-			{
-				int idx  = (short)((parse[0] << 8) | parse[1]);
-				idx <<= 16;
-				idx >>= 16;
-				parse += 2;
-				CHCK_PARSER(callbacks->yajl_integer(ctx, idx));
+
+			// Cache
+			entry->stringlen	= (int)strLen;
+			entry->memberCache	= -1;
+
+			if (++bjsn->cp_read == bjsn->cp_count) {
+				bjsn->state = bjson_state_stream;
 			}
-			break;
-		case BJSN_NUMBER_I8:
-			{
-				int c = *parse++;
-				c <<= 24;
-				c >>= 24;
-				CHCK_PARSER(callbacks->yajl_integer(ctx, c));
+		}
+		return BJSON_NO_ERROR;
+	case bjson_state_done:
+		// Anything after BJSN_END is ignored.
+		*need = len;
+		return BJSON_NO_ERROR;
+	default:
+		break;
+	}
+
+	// Parse Inner stream
+	NEED(1);
+	if (p[0] > BJSN_CTE_FALSE_RLE) {
+		return bjson_error(hand, BJSON_ERROR, "invalid binary JSON opcode");
+	}
+	NEED(bjson_record_sizes[p[0]]);
+
+	// The whole record must be there before the structure changes.
+	if ((p[0] == BJSN_STRING_DIRECT) || (p[0] == BJSN_MEMBER_DIRECT)) {
+		if (RD32(p + 1) > 0x7FFFFFFF) {
+			return bjson_error(hand, BJSON_ERROR, "binary JSON string too long");
+		}
+		NEED((size_t)RD32(p + 1) + 5);
+	}
+
+	error = bjson_structure(hand, p[0]);
+	if (error != BJSON_NO_ERROR) {
+		return error;
+	}
+
+	// Inside a skipped container only the structure and the string lengths
+	// matter.
+	if (bjsn->skipDepth) {
+		switch (p[0]) {
+		case BJSN_CLOSE_OBJ:
+		case BJSN_CLOSE_ARR:
+			if (bjsn->depth >= bjsn->skipDepth) {
+				return BJSON_NO_ERROR;
 			}
+			bjsn->skipDepth = 0;
 			break;
-		case BJSN_NUMBER_FLT:
-			{
-				int idx  = (parse[0] << 24) | (parse[1] << 16) | (parse[2] << 8) | parse[3];
-				parse += 4;
-				// int --trick--> float -> double
-				CHCK_PARSER(callbacks->yajl_double(ctx, (double)(*((float*)&idx))));
+		case BJSN_STRING:
+		case BJSN_MEMBER:
+			if (RD32(p + 1) >= (unsigned int)bjsn->cp_count) {
+				return bjson_error(hand, BJSON_ERROR, "invalid binary JSON constant pool index");
 			}
-			break;
-		case BJSN_CTE_TRUE:
-			{
-				CHCK_PARSER(callbacks->yajl_boolean(ctx, 1));
+			return BJSON_NO_ERROR;
+		case BJSN_END:
+			// Still inside containers, which bjson_complete reports.
+			bjsn->state = bjson_state_done;
+			bjson_release_pool(bjsn, &hand->alloc);
+			return BJSON_NO_ERROR;
+		default:
+			return BJSON_NO_ERROR;
+		}
+
+		// The skipped container ends.
+		if (p[0] == BJSN_CLOSE_OBJ) {
+			CHCK_PARSER(callbacks->yajl_end_map(ctx));
+		} else {
+			CHCK_PARSER(callbacks->yajl_end_array(ctx));
+		}
+		return BJSON_NO_ERROR;
+	}
+
+	switch (p[0]) {
+	case BJSN_END:
+		bjsn->state = bjson_state_done;
+		// Free all allocated mem.
+		bjson_release_pool(bjsn, &hand->alloc);
+		break;
+	case BJSN_OPEN_OBJ:
+		{
+			int result = callbacks->yajl_start_map(ctx, RD32(p + 1));
+			CHCK_PARSER(result);
+			if (result == YAJL_SKIP_CONTAINER) {
+				bjsn->skipDepth = bjsn->depth;
 			}
-			break;
-		case BJSN_CTE_FALSE:
-			{
-				CHCK_PARSER(callbacks->yajl_boolean(ctx, 0));
+		}
+		break;
+	case BJSN_OPEN_ARR:
+		// The type mask is skipped.
+		{
+			int result = callbacks->yajl_start_array(ctx, RD32(p + 1));
+			CHCK_PARSER(result);
+			if (result == YAJL_SKIP_CONTAINER) {
+				bjsn->skipDepth = bjsn->depth;
 			}
-			break;
-		case BJSN_CTE_NULL:
-			{
-				CHCK_PARSER(callbacks->yajl_null(ctx));
+		}
+		break;
+	case BJSN_CLOSE_OBJ:
+		CHCK_PARSER(callbacks->yajl_end_map(ctx));
+		break;
+	case BJSN_CLOSE_ARR:
+		CHCK_PARSER(callbacks->yajl_end_array(ctx));
+		break;
+	case BJSN_STRING:
+		{
+			unsigned int idx = RD32(p + 1);
+			if (idx >= (unsigned int)bjsn->cp_count) {
+				return bjson_error(hand, BJSON_ERROR, "invalid binary JSON constant pool index");
 			}
-			break;
-		case BJSN_NUMBER_I8_RLE:
-			{
-				int idx  = (char)(*parse++);
-				int count = parse[0]<<8 | parse[1];
-				int n;
-				parse += 2;
-				for (n=0; n < count; n++) {
-					CHCK_PARSER_LOOP(callbacks->yajl_integer(ctx, idx));
-				}
+			CHCK_PARSER(callbacks->yajl_string(ctx, cp[idx].string, cp[idx].stringlen, (int)idx));
+		}
+		break;
+	case BJSN_STRING_DIRECT:
+		{
+			unsigned int strLen = RD32(p + 1);
+			if ((hand->flags & yajl_validate_binary_strings) && !yajl_string_validate_utf8(p + 5, strLen)) {
+				return bjson_error(hand, BJSON_ERROR, "invalid UTF-8 in binary JSON string");
 			}
-			break;
-		case BJSN_NUMBER_I16_RLE:
-			{
-				int count;
-				int n;
-				int idx  = (short)((parse[0] << 8) | parse[1]);
-				parse += 2;
-				count = parse[0]<<8 | parse[1];
-				parse += 2;
-				for (n=0; n < count; n++) {
-					CHCK_PARSER_LOOP(callbacks->yajl_integer(ctx, idx));
-				}
+			CHCK_PARSER(callbacks->yajl_string(ctx, p + 5, strLen, -1));
+		}
+		break;
+	case BJSN_MEMBER:
+		{
+			unsigned int idx = RD32(p + 1);
+			if (idx >= (unsigned int)bjsn->cp_count) {
+				return bjson_error(hand, BJSON_ERROR, "invalid binary JSON constant pool index");
 			}
-			break;
-		case BJSN_NUMBER_I32_RLE:
-			{
-				int n;
-				int count;
-				int idx  = (parse[0] << 24) | (parse[1] << 16) | (parse[2] << 8) | parse[3];
-				parse += 4;
-				count = parse[0]<<8 | parse[1];
-				parse += 2;
-				for (n=0; n < count; n++) {
-					CHCK_PARSER_LOOP(callbacks->yajl_integer(ctx, idx));
-				}
+			CHCK_PARSER(callbacks->yajl_map_key(ctx, cp[idx].string, cp[idx].stringlen, (int)idx));
+		}
+		break;
+	case BJSN_MEMBER_DIRECT:
+		{
+			unsigned int strLen = RD32(p + 1);
+			if ((hand->flags & yajl_validate_binary_strings) && !yajl_string_validate_utf8(p + 5, strLen)) {
+				return bjson_error(hand, BJSON_ERROR, "invalid UTF-8 in binary JSON string");
 			}
-			break;
-		case BJSN_NUMBER_I64_RLE:
-			{
-				int count;
-				int n;
-				// MSB 32/64
-				int idx  = (parse[0] << 24) | (parse[1] << 16) | (parse[2] << 8) | parse[3];
-				unsigned int idx2 = (parse[4] << 24) | (parse[5] << 16) | (parse[6] << 8) | parse[7];
-				long long int l64 = (((long long int)idx)<<32) | idx2;
-				parse += 8;
-				count = parse[0]<<8 | parse[1];
-				parse += 2;
-				for (n=0; n < count; n++) {
-					CHCK_PARSER_LOOP(callbacks->yajl_integer(ctx, l64));
-				}
+			CHCK_PARSER(callbacks->yajl_map_key(ctx, p + 5, strLen, -1));
+		}
+		break;
+	case BJSN_NUMBER_I64:
+		{
+			// MSB 32/64
+			long long int l64;
+			l64 = (long long int)RD64(p + 1);
+			CHCK_PARSER(callbacks->yajl_integer(ctx, l64));
+		}
+		break;
+	case BJSN_NUMBER_DBL:
+		{
+			unsigned long long int l64;
+			double dbl;
+			l64 = RD64(p + 1);
+			memcpy(&dbl, &l64, sizeof(dbl));
+			CHCK_PARSER(callbacks->yajl_double(ctx, dbl));
+		}
+		break;
+	case BJSN_NUMBER_I32:
+		CHCK_PARSER(callbacks->yajl_integer(ctx, (int)RD32(p + 1)));
+		break;
+	case BJSN_NUMBER_I16:
+		CHCK_PARSER(callbacks->yajl_integer(ctx, (short)RD16(p + 1)));
+		break;
+	case BJSN_NUMBER_I8:
+		CHCK_PARSER(callbacks->yajl_integer(ctx, (signed char)p[1]));
+		break;
+	case BJSN_NUMBER_FLT:
+		{
+			unsigned int idx;
+			float flt;
+			idx = RD32(p + 1);
+			// int --trick--> float -> double
+			memcpy(&flt, &idx, sizeof(flt));
+			CHCK_PARSER(callbacks->yajl_double(ctx, (double)flt));
+		}
+		break;
+	case BJSN_CTE_TRUE:
+		CHCK_PARSER(callbacks->yajl_boolean(ctx, 1));
+		break;
+	case BJSN_CTE_FALSE:
+		CHCK_PARSER(callbacks->yajl_boolean(ctx, 0));
+		break;
+	case BJSN_CTE_NULL:
+		CHCK_PARSER(callbacks->yajl_null(ctx));
+		break;
+	case BJSN_NUMBER_I8_RLE:
+		{
+			CHCK_PARSER(bjson_integer_run(callbacks, ctx, (signed char)p[1], RD16(p + 2)));
+		}
+		break;
+	case BJSN_NUMBER_I16_RLE:
+		{
+			CHCK_PARSER(bjson_integer_run(callbacks, ctx, (short)RD16(p + 1), RD16(p + 3)));
+		}
+		break;
+	case BJSN_NUMBER_I32_RLE:
+		{
+			CHCK_PARSER(bjson_integer_run(callbacks, ctx, (int)RD32(p + 1), RD16(p + 5)));
+		}
+		break;
+	case BJSN_NUMBER_I64_RLE:
+		{
+			// MSB 32/64
+			CHCK_PARSER(bjson_integer_run(callbacks, ctx, (long long int)RD64(p + 1), RD16(p + 9)));
+		}
+		break;
+	case BJSN_CTE_TRUE_RLE:
+		{
+			CHCK_PARSER(bjson_boolean_run(callbacks, ctx, 1, RD16(p + 1)));
+		}
+		break;
+	case BJSN_CTE_FALSE_RLE:
+		{
+			CHCK_PARSER(bjson_boolean_run(callbacks, ctx, 0, RD16(p + 1)));
+		}
+		break;
+	default:
+		return bjson_error(hand, BJSON_ERROR, "invalid binary JSON opcode");
+	}
+
+	return BJSON_NO_ERROR;
+}
+
+int bjson_parse(	yajl_handle		hand,
+					const unsigned char*	jsonText,
+					size_t					jsonTextLength
+				)
+{
+	bjson_handle*	bjsn= &hand->bj;
+
+	int error			= BJSON_NO_ERROR;
+	int inPlace			= (hand->flags & yajl_persistent_input) != 0;
+	size_t need			= 0;
+
+	const unsigned char* endStream	= &jsonText[jsonTextLength];
+	const unsigned char* parse		= jsonText;
+
+	if (bjsn->partial == NULL) {
+		bjsn->partial = yajl_buf_alloc(&(hand->alloc));
+	}
+
+	// Complete the record the previous chunk ended in
+	if (yajl_buf_len(bjsn->partial)) {
+		for (;;) {
+			size_t have = yajl_buf_len(bjsn->partial);
+			size_t take;
+
+			error = bjson_record(hand, yajl_buf_data(bjsn->partial), have, 0, &need);
+			if (error != BJSON_MORE) {
+				break;
 			}
-			break;
-		case BJSN_CTE_TRUE_RLE:
-			{
-				int n;
-				int count = parse[0]<<8 | parse[1];
-				parse += 2;
-				for (n=0; n < count; n++) {
-					CHCK_PARSER_LOOP(callbacks->yajl_boolean(ctx, 1));
-				}
+
+			take = need - have;
+			if (take > (size_t)(endStream - parse)) {
+				take = endStream - parse;
 			}
-			break;
-		case BJSN_CTE_FALSE_RLE:
-			{
-				int n;
-				int count = parse[0]<<8 | parse[1];
-				parse += 2;
-				for (n=0; n < count; n++) {
-					CHCK_PARSER_LOOP(callbacks->yajl_boolean(ctx, 0));
-				}
+			if (take == 0) {
+				hand->bytesConsumed = jsonTextLength;
+				return BJSON_NO_ERROR;
 			}
-			break;
-		default:
-			error = BJSON_ERROR;
-			goto exit;
+
+			yajl_buf_append(bjsn->partial, parse, take);
+			parse += take;
 		}
+
+		yajl_buf_clear(bjsn->partial);
 	}
 
-exit:
-	//
-	// Free all allocated mem.
-	//
-	if (bjsn->cp_count) {
-		if (bjsn->cp) {
-			hand->alloc.free(hand->alloc.ctx, bjsn->cp);
-			bjsn->cp = NULL;
+	// Records entirely inside this chunk
+	while ((error == BJSON_NO_ERROR) && (parse < endStream)) {
+		error = bjson_record(hand, parse, endStream - parse, inPlace, &need);
+		if (error == BJSON_NO_ERROR) {
+			parse += need;
 		}
+	}
 
-		if (bjsn->strs) {
-			hand->alloc.free(hand->alloc.ctx, bjsn->strs);
-			bjsn->strs = NULL;
-		}
+	if (error == BJSON_MORE) {
+		yajl_buf_append(bjsn->partial, parse, endStream - parse);
+		parse = endStream;
+		error = BJSON_NO_ERROR;
 	}
 
-	// Parse Post-CP
+	hand->bytesConsumed = parse - jsonText;
 	return error;
 }
+
+int bjson_complete(	yajl_handle		hand)
+{
+	bjson_handle*	bjsn= &hand->bj;
+
+	if (yajl_bs_current(hand->stateStack) == yajl_state_parse_error) {
+		return BJSON_ERROR;
+	}
+
+	// A stream may end without BJSN_END, but not inside a record or value.
+	if ((bjsn->state == bjson_state_header) || (bjsn->state == bjson_state_pool) ||
+		(bjsn->partial && yajl_buf_len(bjsn->partial)) || bjsn->depth) {
+		return bjson_error(hand, BJSON_ERROR, "premature EOF");
+	}
+
+	bjson_release_pool(bjsn, &hand->alloc);
+	return BJSON_NO_ERROR;
+}
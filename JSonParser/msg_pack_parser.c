@@ -1,10 +1,18 @@
 #include "api/yajl_parse.h"
 #include "yajl_parser.h"
+#include "yajl_alloc.h"
+#include "yajl_encode.h"
+
+#include <string.h>
+
+#include "yajl_assert.h"
 
 
 #define MSGPACK_NO_ERROR		(yajl_status_ok)
 #define MSGPACK_CANCEL			(yajl_status_client_canceled)
 #define MSGPACK_ERROR			(yajl_status_error)
+// The token does not fit in the bytes available, see BJSON_MORE.
+#define MSGPACK_MORE			(-1)
 
 #define MSG_PACK_nil				0xc0
 #define MSG_PACK_reservedA 			0xc1
@@ -39,322 +47,762 @@
 #define MSG_PACK_map_16 			0xde
 #define MSG_PACK_map_32 			0xdf
 
+// The same bytes as specified, where the dialect has them reserved.
+#define MSG_PACK_bin_8 				0xc4
+#define MSG_PACK_bin_16 			0xc5
+#define MSG_PACK_bin_32 			0xc6
+#define MSG_PACK_ext_8 				0xc7
+#define MSG_PACK_ext_16 			0xc8
+#define MSG_PACK_ext_32 			0xc9
+#define MSG_PACK_fixext_1 			0xd4
+#define MSG_PACK_fixext_16 			0xd8
+#define MSG_PACK_str_8 				0xd9
+
 #define CHCK_PARSER(x)		if (!(x)) { \
-								error = MSGPACK_CANCEL; ptr = endPtr; \
+								return msgpack_error(hand, MSGPACK_CANCEL, "client cancelled parse via callback return value"); \
 							}
 
-#define CHCK_PARSER_LOOP(x)	if (!(x)) { \
-								error = MSGPACK_CANCEL; ptr = endPtr; break; \
-							}
+#define CHCK_PARSER_LOOP(x)	CHCK_PARSER(x)
+
+// The callbacks for the next token: none inside a skipped container.
+#define MSGPACK_CALLBACKS(hand)	((hand)->msgpack.skipDepth ? &bjson_skip_callbacks : (hand)->callbacks)
+
+// Declares that the current token is n bytes long so far.
+#define NEED(n)				*need = (size_t)(n); \
+							if (len < *need) { return MSGPACK_MORE; }
+
+#define RD16(p)				bjson_rd16(p)
+#define RD32(p)				bjson_rd32(p)
+#define RD64(p)				bjson_rd64(p)
+
+static int msgpack_error(	yajl_handle		hand,
+							int				error,
+							const char*		message) {
+	yajl_bs_set(hand->stateStack, yajl_state_parse_error);
+	hand->parseError = message;
+	return error;
+}
+
+// Accounts for count values just emitted and closes every container they
+// completed.
+static int msgpack_value_done(	yajl_handle			hand,
+								unsigned long long	count) {
+	bjson_handle*	bjsn= &hand->msgpack;
+	const yajl_callbacks * callbacks = MSGPACK_CALLBACKS(hand);
+	void*		ctx		= bjsn->ctx;
+
+	if (count == 0) {
+		return MSGPACK_NO_ERROR;
+	}
+
+	while (bjsn->depth > 0) {
+		msgpack_frame* top = &bjsn->stack[bjsn->depth - 1];
+
+		top->remaining -= count;
+		if (top->remaining) {
+			return MSGPACK_NO_ERROR;
+		}
+
+		bjsn->depth--;
+		if (bjsn->depth < bjsn->skipDepth) {
+			// The skipped container ends.
+			bjsn->skipDepth	= 0;
+			callbacks		= hand->callbacks;
+		}
+		if (top->isMap) {
+			CHCK_PARSER(callbacks->yajl_end_map(ctx));
+		} else {
+			CHCK_PARSER(callbacks->yajl_end_array(ctx));
+		}
+
+		// The container itself is one value of its parent.
+		count = 1;
+	}
+
+	bjsn->state = bjson_state_done;
+	return MSGPACK_NO_ERROR;
+}
+
+static int msgpack_open(	yajl_handle		hand,
+							int				isMap,
+							unsigned int	count) {
+	bjson_handle*	bjsn= &hand->msgpack;
+	const yajl_callbacks * callbacks = MSGPACK_CALLBACKS(hand);
+	void*		ctx		= bjsn->ctx;
+	int			result;
+
+	if (bjsn->depth >= hand->maxDepth) {
+		return msgpack_error(hand, MSGPACK_ERROR, "MessagePack nesting too deep");
+	}
+
+	if (bjsn->depth == bjsn->stack_size) {
+		size_t			size	= bjsn->stack_size ? bjsn->stack_size * 2 : 32;
+		msgpack_frame*	stack	= (msgpack_frame*)YA_REALLOC(&(hand->alloc), bjsn->stack, size * sizeof(msgpack_frame));
+
+		if (stack == NULL) {
+			return msgpack_error(hand, MSGPACK_ERROR, "out of memory");
+		}
+
+		bjsn->stack			= stack;
+		bjsn->stack_size	= size;
+	}
+
+	result = isMap ? callbacks->yajl_start_map(ctx, count) : callbacks->yajl_start_array(ctx, count);
+	CHCK_PARSER(result);
+
+	if (count == 0) {
+		if (isMap) {
+			CHCK_PARSER(callbacks->yajl_end_map(ctx));
+		} else {
+			CHCK_PARSER(callbacks->yajl_end_array(ctx));
+		}
+		return msgpack_value_done(hand, 1);
+	}
+
+	bjsn->stack[bjsn->depth].remaining	= isMap ? (unsigned long long)count * 2 : count;
+	bjsn->stack[bjsn->depth].isMap		= isMap;
+	bjsn->depth++;
+	if (result == YAJL_SKIP_CONTAINER) {
+		bjsn->skipDepth = bjsn->depth;
+	}
+	return MSGPACK_NO_ERROR;
+}
 
-// ReserveA : Constant Pool
+// ReserveA : RLE prefix, the next value repeats (16 bit count) times.
 // ReserveB : Ref Constant Pool 8
 // ReserveC : Ref Constant Pool 16
 // ReserveD : PatternCount 16
+//
+// Decodes the token at the beginning of [p, p + len) and sets *need to its
+// size.
+static int msgpack_record(	yajl_handle				hand,
+							const unsigned char*	p,
+							size_t					len,
+							size_t*					need)
+{
+	bjson_handle*	bjsn= &hand->msgpack;
+	const yajl_callbacks * callbacks = MSGPACK_CALLBACKS(hand);
+	void*		ctx		= bjsn->ctx;
+
+	unsigned int	rle	= 1;
+	size_t			h	= 0;
+	unsigned int	count;
+	unsigned int	n;
+	long long int	longValue;
+	double			dblValue;
+	int				isKey;
+	unsigned char	c;
+
+	if (bjsn->state == bjson_state_done) {
+		// Anything after the root value is ignored.
+		*need = len;
+		return MSGPACK_NO_ERROR;
+	}
+
+	NEED(1);
+	c = p[0];
+	if (c == MSG_PACK_reservedA) {
+		NEED(4);
+		rle	= RD16(p + 1);
+		h	= 3;
+		c	= p[3];
+	}
+
+	isKey = (bjsn->depth > 0) && bjsn->stack[bjsn->depth - 1].isMap &&
+			!(bjsn->stack[bjsn->depth - 1].remaining & 1);
+
+	switch (c) {
+	default:
+		NEED(h + 1);
+		if (c < 0x80) {
+			// 0x00..7F		: Positive Num
+			longValue = c;
+		} else if (c >= 0xE0) {
+			// 0xe0 - 0xff 	: Negative Num
+			longValue = (signed char)c;
+		} else if (c <= 0x8F) {
+			// Fix Map 80-8F
+			count = c - 0x80;
+			goto openMap;
+		} else if (c <= 0x9F) {
+			// Fix Array 90-9F
+			count = c - 0x90;
+			goto openArray;
+		} else {
+			// Fix Raw A0-BF
+			count = c - 0xA0;
+			NEED(h + 1 + count);
+			p += h + 1;
+			goto performStringCall;
+		}
+		goto performIntCall;
+	case MSG_PACK_nil:
+		NEED(h + 1);
+		if (isKey) goto badKey;
+		for (n = 0; n < rle; n++) {
+			CHCK_PARSER_LOOP(callbacks->yajl_null(ctx));
+		}
+		goto valueDone;
+	case MSG_PACK_false 	: 
+	case MSG_PACK_true 		: 
+		NEED(h + 1);
+		if (isKey) goto badKey;
+		CHCK_PARSER(bjson_boolean_run(callbacks, ctx, c == MSG_PACK_true, rle));
+		goto valueDone;
+	case MSG_PACK_reservedA	:
+	case MSG_PACK_reservedB	: 
+	case MSG_PACK_reservedC	: 
+	case MSG_PACK_reservedD	: 
+	case MSG_PACK_reservedE	: 
+	case MSG_PACK_reservedF	: 
+	case MSG_PACK_reservedG	: 
+	case MSG_PACK_reservedH	: 
+	case MSG_PACK_reservedI	: 
+	case MSG_PACK_reservedJ	: 
+	case MSG_PACK_reservedK	: 
+	case MSG_PACK_reservedL	: 
+	case MSG_PACK_reservedM	: 
+		// Unused extensions, skipped without counting as a value.
+		NEED(h + 1);
+		return MSGPACK_NO_ERROR;
+	case MSG_PACK_float 	: 
+		{
+			unsigned int	raw;
+			float			flt;
+			NEED(h + 5);
+			raw = RD32(p + h + 1);
+			memcpy(&flt, &raw, sizeof(flt));	// Int -> Float raw memory -> Double.
+			dblValue = flt;
+		}
+		goto performDoubleCall;
+	case MSG_PACK_double 	: 
+		{
+			unsigned long long int raw;
+			NEED(h + 9);
+			raw = RD64(p + h + 1);
+			memcpy(&dblValue, &raw, sizeof(dblValue));	// Int64 -> Double raw memory
+		}
+		goto performDoubleCall;
+	case MSG_PACK_uint_8 	: 
+		NEED(h + 2);
+		longValue = p[h + 1];
+		goto performIntCall;
+	case MSG_PACK_uint_16 	: 
+		NEED(h + 3);
+		longValue = RD16(p + h + 1);
+		goto performIntCall;
+	case MSG_PACK_uint_32 	: 
+		NEED(h + 5);
+		longValue = RD32(p + h + 1);
+		goto performIntCall;
+	case MSG_PACK_uint_64 	: 
+	case MSG_PACK_int_64 	: 
+		NEED(h + 9);
+		longValue = (long long int)RD64(p + h + 1);
+		goto performIntCall;
+	case MSG_PACK_int_8 	: 
+		NEED(h + 2);
+		longValue = (signed char)p[h + 1];
+		goto performIntCall;
+	case MSG_PACK_int_16 	: 
+		NEED(h + 3);
+		longValue = (short)RD16(p + h + 1);
+		goto performIntCall;
+	case MSG_PACK_int_32 	: 
+		NEED(h + 5);
+		longValue = (int)RD32(p + h + 1);
+		goto performIntCall;
+	case MSG_PACK_raw_16 	: 
+		NEED(h + 3);
+		count = RD16(p + h + 1);
+		NEED(h + 3 + count);
+		p += h + 3;
+		goto performStringCall;
+	case MSG_PACK_raw_32 	: 
+		NEED(h + 5);
+		count = RD32(p + h + 1);
+		if (count > 0x7FFFFFFF) {
+			return msgpack_error(hand, MSGPACK_ERROR, "MessagePack string too long");
+		}
+		NEED(h + 5 + (size_t)count);
+		p += h + 5;
+		goto performStringCall;
+	case MSG_PACK_array_16 	: 
+		NEED(h + 3);
+		count = RD16(p + h + 1);
+		goto openArray;
+	case MSG_PACK_array_32 	: 
+		NEED(h + 5);
+		count = RD32(p + h + 1);
+		goto openArray;
+	case MSG_PACK_map_16 	: 
+		NEED(h + 3);
+		count = RD16(p + h + 1);
+		goto openMap;
+	case MSG_PACK_map_32 	: 
+		NEED(h + 5);
+		count = RD32(p + h + 1);
+		goto openMap;
+	}
+
+performIntCall:
+	if (isKey) goto badKey;
+	CHCK_PARSER(bjson_integer_run(callbacks, ctx, longValue, rle));
+	goto valueDone;
+
+performDoubleCall:
+	if (isKey) goto badKey;
+	for (n = 0; n < rle; n++) {
+		CHCK_PARSER_LOOP(callbacks->yajl_double(ctx, dblValue));
+	}
+	goto valueDone;
+
+valueDone:
+	if ((bjsn->depth > 0) && (rle > bjsn->stack[bjsn->depth - 1].remaining)) {
+		return msgpack_error(hand, MSGPACK_ERROR, "MessagePack run is longer than its container");
+	}
+	return msgpack_value_done(hand, rle);
+
+performStringCall:
+	if ((hand->flags & yajl_validate_binary_strings) && !bjsn->skipDepth && !yajl_string_validate_utf8(p, count)) {
+		return msgpack_error(hand, MSGPACK_ERROR, "invalid UTF-8 in MessagePack string");
+	}
+	// RLE is not applied to strings.
+	if (isKey) {
+		// Key.
+		CHCK_PARSER(callbacks->yajl_map_key(ctx, p, count, -1));
+	} else {
+		// String.
+		CHCK_PARSER(callbacks->yajl_string(ctx, p, count, -1));
+	}
+	return msgpack_value_done(hand, 1);
+
+openArray:
+	if (isKey) goto badKey;
+	return msgpack_open(hand, 0, count);
+
+openMap:
+	if (isKey) goto badKey;
+	return msgpack_open(hand, 1, count);
+
+badKey:
+	return msgpack_error(hand, MSGPACK_ERROR, "MessagePack map keys must be strings");
+}
+
+// Base64 of [p, p + len) into the handle's decode buffer, for bin and ext
+// data.
+static void msgpack_base64(	yajl_handle				hand,
+							const unsigned char*	p,
+							size_t					len) {
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	unsigned char	out[256];
+	size_t			used = 0;
+	size_t			i;
+
+	yajl_buf_clear(hand->decodeBuf);
+	for (i = 0; i + 3 <= len; i += 3) {
+		unsigned long v = ((unsigned long)p[i] << 16) | ((unsigned long)p[i + 1] << 8) | p[i + 2];
+		out[used++] = digits[(v >> 18) & 63];
+		out[used++] = digits[(v >> 12) & 63];
+		out[used++] = digits[(v >> 6) & 63];
+		out[used++] = digits[v & 63];
+		if (used == sizeof(out)) {
+			yajl_buf_append(hand->decodeBuf, out, used);
+			used = 0;
+		}
+	}
+
+	if (i < len) {
+		unsigned long v = (unsigned long)p[i] << 16;
+		if (i + 1 < len) {
+			v |= (unsigned long)p[i + 1] << 8;
+		}
+		out[used++] = digits[(v >> 18) & 63];
+		out[used++] = digits[(v >> 12) & 63];
+		out[used++] = (i + 1 < len) ? digits[(v >> 6) & 63] : '=';
+		out[used++] = '=';
+	}
+
+	yajl_buf_append(hand->decodeBuf, out, used);
+}
+
+// Decodes the token at the beginning of [p, p + len) as specified, without
+// the dialect's extensions, and sets *need to its size. Strings are passed
+// on where they are in the input.
+static int msgpack_std_record(	yajl_handle				hand,
+								const unsigned char*	p,
+								size_t					len,
+								size_t*					need)
+{
+	bjson_handle*	bjsn= &hand->msgpack;
+	const yajl_callbacks * callbacks = MSGPACK_CALLBACKS(hand);
+	void*		ctx		= bjsn->ctx;
+
+	size_t				count;
+	long long int		longValue;
+	double				dblValue;
+	int					extType;
+	int					isKey;
+	unsigned char		c;
+
+	if (bjsn->state == bjson_state_done) {
+		if (hand->flags & yajl_allow_trailing_garbage) {
+			*need = len;
+			return MSGPACK_NO_ERROR;
+		}
+		return msgpack_error(hand, MSGPACK_ERROR, "trailing garbage after the MessagePack value");
+	}
+
+	NEED(1);
+	c = p[0];
+	isKey = (bjsn->depth > 0) && bjsn->stack[bjsn->depth - 1].isMap &&
+			!(bjsn->stack[bjsn->depth - 1].remaining & 1);
+
+	// The fix types, which most tokens are, come first.
+	if (c < 0x80) {
+		longValue = c;
+		goto performIntCall;
+	} else if (c >= 0xE0) {
+		longValue = (signed char)c;
+		goto performIntCall;
+	} else if (c <= 0x8F) {
+		count = c - 0x80;
+		goto openMap;
+	} else if (c <= 0x9F) {
+		count = c - 0x90;
+		goto openArray;
+	} else if (c <= 0xBF) {
+		count = c - 0xA0;
+		NEED(1 + count);
+		p += 1;
+		goto performStringCall;
+	}
+
+	switch (c) {
+	case MSG_PACK_nil:
+		NEED(1);
+		if (isKey) goto badKey;
+		CHCK_PARSER(callbacks->yajl_null(ctx));
+		goto valueDone;
+	case MSG_PACK_false:
+	case MSG_PACK_true:
+		NEED(1);
+		if (isKey) goto badKey;
+		CHCK_PARSER(callbacks->yajl_boolean(ctx, c == MSG_PACK_true));
+		goto valueDone;
+	case MSG_PACK_bin_8:
+		NEED(2);
+		count = p[1];
+		NEED(2 + count);
+		p += 2;
+		goto performBinCall;
+	case MSG_PACK_bin_16:
+		NEED(3);
+		count = RD16(p + 1);
+		NEED(3 + count);
+		p += 3;
+		goto performBinCall;
+	case MSG_PACK_bin_32:
+		NEED(5);
+		count = RD32(p + 1);
+		if (count > 0x7FFFFFFF) {
+			return msgpack_error(hand, MSGPACK_ERROR, "MessagePack binary too long");
+		}
+		NEED(5 + count);
+		p += 5;
+		goto performBinCall;
+	case MSG_PACK_ext_8:
+		NEED(3);
+		count = p[1];
+		extType = (signed char)p[2];
+		NEED(3 + count);
+		p += 3;
+		goto performExtCall;
+	case MSG_PACK_ext_16:
+		NEED(4);
+		count = RD16(p + 1);
+		extType = (signed char)p[3];
+		NEED(4 + count);
+		p += 4;
+		goto performExtCall;
+	case MSG_PACK_ext_32:
+		NEED(6);
+		count = RD32(p + 1);
+		if (count > 0x7FFFFFFF) {
+			return msgpack_error(hand, MSGPACK_ERROR, "MessagePack extension too long");
+		}
+		extType = (signed char)p[5];
+		NEED(6 + count);
+		p += 6;
+		goto performExtCall;
+	case MSG_PACK_fixext_1:
+	case MSG_PACK_fixext_1 + 1:
+	case MSG_PACK_fixext_1 + 2:
+	case MSG_PACK_fixext_1 + 3:
+	case MSG_PACK_fixext_16:
+		count = (size_t)1 << (c - MSG_PACK_fixext_1);
+		NEED(2 + count);
+		extType = (signed char)p[1];
+		p += 2;
+		goto performExtCall;
+	case MSG_PACK_float:
+		{
+			unsigned int	raw;
+			float			flt;
+			NEED(5);
+			raw = RD32(p + 1);
+			memcpy(&flt, &raw, sizeof(flt));
+			dblValue = flt;
+		}
+		goto performDoubleCall;
+	case MSG_PACK_double:
+		{
+			unsigned long long int raw;
+			NEED(9);
+			raw = RD64(p + 1);
+			memcpy(&dblValue, &raw, sizeof(dblValue));
+		}
+		goto performDoubleCall;
+	case MSG_PACK_uint_8:
+		NEED(2);
+		longValue = p[1];
+		goto performIntCall;
+	case MSG_PACK_uint_16:
+		NEED(3);
+		longValue = RD16(p + 1);
+		goto performIntCall;
+	case MSG_PACK_uint_32:
+		NEED(5);
+		longValue = RD32(p + 1);
+		goto performIntCall;
+	case MSG_PACK_uint_64:
+		{
+			unsigned long long int raw;
+			NEED(9);
+			raw = RD64(p + 1);
+			if (raw > 0x7FFFFFFFFFFFFFFFULL) {
+				// Too large for the integer callback.
+				if (isKey) goto badKey;
+				dblValue = (double)raw;
+				goto performDoubleCall;
+			}
+			longValue = (long long int)raw;
+		}
+		goto performIntCall;
+	case MSG_PACK_int_8:
+		NEED(2);
+		longValue = (signed char)p[1];
+		goto performIntCall;
+	case MSG_PACK_int_16:
+		NEED(3);
+		longValue = (short)RD16(p + 1);
+		goto performIntCall;
+	case MSG_PACK_int_32:
+		NEED(5);
+		longValue = (int)RD32(p + 1);
+		goto performIntCall;
+	case MSG_PACK_int_64:
+		NEED(9);
+		longValue = (long long int)RD64(p + 1);
+		goto performIntCall;
+	case MSG_PACK_str_8:
+		NEED(2);
+		count = p[1];
+		NEED(2 + count);
+		p += 2;
+		goto performStringCall;
+	case MSG_PACK_raw_16:
+		NEED(3);
+		count = RD16(p + 1);
+		NEED(3 + count);
+		p += 3;
+		goto performStringCall;
+	case MSG_PACK_raw_32:
+		NEED(5);
+		count = RD32(p + 1);
+		if (count > 0x7FFFFFFF) {
+			return msgpack_error(hand, MSGPACK_ERROR, "MessagePack string too long");
+		}
+		NEED(5 + count);
+		p += 5;
+		goto performStringCall;
+	case MSG_PACK_array_16:
+		NEED(3);
+		count = RD16(p + 1);
+		goto openArray;
+	case MSG_PACK_array_32:
+		NEED(5);
+		count = RD32(p + 1);
+		goto openArray;
+	case MSG_PACK_map_16:
+		NEED(3);
+		count = RD16(p + 1);
+		goto openMap;
+	case MSG_PACK_map_32:
+		NEED(5);
+		count = RD32(p + 1);
+		goto openMap;
+	default:
+		// 0xC1, which the specification never uses.
+		NEED(1);
+		return msgpack_error(hand, MSGPACK_ERROR, "invalid MessagePack type");
+	}
+
+performIntCall:
+	if (isKey) {
+		// Integer keys become their decimal text.
+		char			digits[24];
+		char*			end	= digits + sizeof(digits);
+		char*			q	= end;
+		unsigned long long int v = longValue < 0 ? 0ULL - (unsigned long long int)longValue : (unsigned long long int)longValue;
+
+		do {
+			*--q = (char)('0' + v % 10);
+			v /= 10;
+		} while (v);
+		if (longValue < 0) {
+			*--q = '-';
+		}
+		CHCK_PARSER(callbacks->yajl_map_key(ctx, (const unsigned char*)q, end - q, -1));
+		goto valueDone;
+	}
+	CHCK_PARSER(callbacks->yajl_integer(ctx, longValue));
+	goto valueDone;
+
+performDoubleCall:
+	if (isKey) goto badKey;
+	CHCK_PARSER(callbacks->yajl_double(ctx, dblValue));
+	goto valueDone;
+
+performStringCall:
+	if ((hand->flags & yajl_validate_binary_strings) && !bjsn->skipDepth && !yajl_string_validate_utf8(p, count)) {
+		return msgpack_error(hand, MSGPACK_ERROR, "invalid UTF-8 in MessagePack string");
+	}
+	if (isKey) {
+		CHCK_PARSER(callbacks->yajl_map_key(ctx, p, count, -1));
+	} else {
+		CHCK_PARSER(callbacks->yajl_string(ctx, p, count, -1));
+	}
+	goto valueDone;
+
+performBinCall:
+	if (bjsn->skipDepth) goto valueDone;
+	msgpack_base64(hand, p, count);
+	if (isKey) {
+		CHCK_PARSER(callbacks->yajl_map_key(ctx, yajl_buf_data(hand->decodeBuf), yajl_buf_len(hand->decodeBuf), -1));
+	} else {
+		CHCK_PARSER(callbacks->yajl_string(ctx, yajl_buf_data(hand->decodeBuf), yajl_buf_len(hand->decodeBuf), -1));
+	}
+	goto valueDone;
+
+performExtCall:
+	if (isKey) goto badKey;
+	if (bjsn->skipDepth) goto valueDone;
+	msgpack_base64(hand, p, count);
+	CHCK_PARSER(callbacks->yajl_start_array(ctx, 2));
+	CHCK_PARSER(callbacks->yajl_integer(ctx, extType));
+	CHCK_PARSER(callbacks->yajl_string(ctx, yajl_buf_data(hand->decodeBuf), yajl_buf_len(hand->decodeBuf), -1));
+	CHCK_PARSER(callbacks->yajl_end_array(ctx));
+	goto valueDone;
+
+valueDone:
+	// Most values leave their container open.
+	if ((bjsn->depth > 0) && (bjsn->stack[bjsn->depth - 1].remaining > 1)) {
+		bjsn->stack[bjsn->depth - 1].remaining--;
+		return MSGPACK_NO_ERROR;
+	}
+	return msgpack_value_done(hand, 1);
+
+openArray:
+	if (isKey) goto badKey;
+	return msgpack_open(hand, 0, (unsigned int)count);
+
+openMap:
+	if (isKey) goto badKey;
+	return msgpack_open(hand, 1, (unsigned int)count);
+
+badKey:
+	return msgpack_error(hand, MSGPACK_ERROR, "MessagePack map keys must be strings, binary or integers");
+}
+
+// Decodes one token in either format.
+#define MSGPACK_RECORD(hand, p, len, need) \
+	(bjsn->standard ? msgpack_std_record(hand, p, len, need) : msgpack_record(hand, p, len, need))
+
 int msgpack_parse(	yajl_handle		hand,
 					const unsigned char*	jsonText,
-					int						jsonTextLength
+					size_t					jsonTextLength
 				)
 {
 	bjson_handle*	bjsn= &hand->msgpack;
 
 	int error			= MSGPACK_NO_ERROR;
-	const yajl_callbacks * callbacks = hand->callbacks;
-	// cp_entry*	cp		= 0;
-	void*		ctx		= bjsn->ctx;
+	size_t need			= 0;
 
-	int	type;
-	int currBlockType;
-	int count;
-	long long int longValue;
-	int rle;
-	unsigned char	c;
-	unsigned int	stackCount	[100];
-	unsigned char	stackType	[100];
-	unsigned char	stackDepth	= 0;
 	const unsigned char*	ptr			= jsonText;
 	const unsigned char*	endPtr		= &jsonText[jsonTextLength];
 
-	while (ptr != endPtr) {
-	
-	shortCut:
-		c = *ptr++;
-		
-		if (c == MSG_PACK_reservedA) {
-			rle	  = ((ptr[0]<<8) | (ptr[1]));
-			ptr		+= 2;
-			c = *ptr++;
-		} else {
-			rle	  = 1;
-		}
-		
-		switch (c) {
-		default:
-			if (c < 0x80) {
-				// 0x00..7F		: Positive Num
-				count = c;
-			} else {
-				// 0xe0 - 0xff 	: Negative Num
-				count = ((char)c);
+	if (bjsn->partial == NULL) {
+		bjsn->partial = yajl_buf_alloc(&(hand->alloc));
+	}
+
+	// Complete the token the previous chunk ended in
+	if (yajl_buf_len(bjsn->partial)) {
+		for (;;) {
+			size_t have = yajl_buf_len(bjsn->partial);
+			size_t take;
+
+			error = MSGPACK_RECORD(hand, yajl_buf_data(bjsn->partial), have, &need);
+			if (error != MSGPACK_MORE) {
+				break;
 			}
-		performIntCall:
-			do {
-				CHCK_PARSER_LOOP(callbacks->yajl_integer(ctx, count));
-			} while (--rle);
-			
-			type = currBlockType;
-
-			break;
-		//
-		// Fix Map 80-8F
-		//
-		case 0x80:
-		case 0x81:
-		case 0x82:
-		case 0x83:
-		case 0x84:
-		case 0x85:
-		case 0x86:
-		case 0x87:
-		case 0x88:
-		case 0x89:
-		case 0x8A:
-		case 0x8B:
-		case 0x8C:
-		case 0x8D:
-		case 0x8E:
-		case 0x8F:
-			count = c - 0x80;
-			
-			goto shortCut;
-			
-		//
-		// Fix Array 90-9F
-		//
-		case 0x90:
-		case 0x91:
-		case 0x92:
-		case 0x93:
-		case 0x94:
-		case 0x95:
-		case 0x96:
-		case 0x97:
-		case 0x98:
-		case 0x99:
-		case 0x9A:
-		case 0x9B:
-		case 0x9C:
-		case 0x9D:
-		case 0x9E:
-		case 0x9F:		
-			count = c - 0x90;
-			goto shortCut;
-			
-		//
-		// Fix Raw A0-BF
-		//
-		case 0xA0:
-		case 0xA1:
-		case 0xA2:
-		case 0xA3:
-		case 0xA4:
-		case 0xA5:
-		case 0xA6:
-		case 0xA7:
-		case 0xA8:
-		case 0xA9:
-		case 0xAA:
-		case 0xAB:
-		case 0xAC:
-		case 0xAD:
-		case 0xAE:
-		case 0xAF:
-		case 0xB0:
-		case 0xB1:
-		case 0xB2:
-		case 0xB3:
-		case 0xB4:
-		case 0xB5:
-		case 0xB6:
-		case 0xB7:
-		case 0xB8:
-		case 0xB9:
-		case 0xBA:
-		case 0xBB:
-		case 0xBC:
-		case 0xBD:
-		case 0xBE:
-		case 0xBF:
-			count = c - 0xA0;
-			break;
-		case MSG_PACK_nil:
-			do {
-				CHCK_PARSER_LOOP(callbacks->yajl_null(ctx));
-			} while (--rle);
-			type = currBlockType;
-			break;
-		case MSG_PACK_reservedA	: // RLE Encoding
-			// Do nothing here.
-			break;
-		case MSG_PACK_false 	: 
-			do {
-				CHCK_PARSER_LOOP(callbacks->yajl_boolean(ctx,0));	// False
-			} while (--rle);
-			type = currBlockType;
-			break;
-		case MSG_PACK_true 		: 
-			do {
-				CHCK_PARSER_LOOP(callbacks->yajl_boolean(ctx,1));	// True
-			} while (--rle);
-			type = currBlockType;
-			break;
-		case MSG_PACK_reservedB	: 
-			break;
-		case MSG_PACK_reservedC	: 
-			break;
-		case MSG_PACK_reservedD	: 
-			break;
-		case MSG_PACK_reservedE	: 
-			break;
-		case MSG_PACK_reservedF	: 
-			break;
-		case MSG_PACK_reservedG	: 
-			break;
-		case MSG_PACK_float 	: 
-			count = (int)((ptr[0]<<24) | (ptr[1]<<16) | (ptr[2]<<8) | ptr[3]); ptr+=4;
-			do {
-				CHCK_PARSER_LOOP(callbacks->yajl_double(ctx,(double)(*((float*)(&count)))));	// Int -> Float raw memory -> Double.
-			} while (--rle);
-			type = currBlockType;
-			break;
-		case MSG_PACK_double 	: 
-			count		= (int)((ptr[0]<<24) | (ptr[1]<<16) | (ptr[2]<<8) | ptr[3]); ptr+=4;
-			longValue	= count;
-			longValue  <<= 32;
-			count		= (int)((ptr[0]<<24) | (ptr[1]<<16) | (ptr[2]<<8) | ptr[3]); ptr+=4;
-			longValue	|= count;
-
-			do {
-				CHCK_PARSER_LOOP(callbacks->yajl_double(ctx,(*((double*)(&longValue)))));	// Int64 -> Double raw memory
-			} while (--rle);
-			type = currBlockType;
-			break;
-			
-		case MSG_PACK_uint_8 	: 
-			count = *ptr++;
-			goto performIntCall;
-			
-		case MSG_PACK_uint_16 	: 
-			count = (ptr[0]<<8) | ptr[1]; ptr+=2;
-			goto performIntCall;
-			
-		case MSG_PACK_uint_32 	: 
-			count		= (int)((ptr[0]<<24) | (ptr[1]<<16) | (ptr[2]<<8) | ptr[3]); ptr+=4;
-			longValue	= (unsigned int)count;
-
-			do {
-				CHCK_PARSER_LOOP(callbacks->yajl_integer(ctx,longValue));
-			} while (--rle);
-			type = currBlockType;
-			break;
-			
-		case MSG_PACK_uint_64 	: 
-		case MSG_PACK_int_64 	: 
-			count		= (int)((ptr[0]<<24) | (ptr[1]<<16) | (ptr[2]<<8) | ptr[3]); ptr+=4;
-			longValue	= count;
-			longValue  <<= 32;
-			count		= (int)((ptr[0]<<24) | (ptr[1]<<16) | (ptr[2]<<8) | ptr[3]); ptr+=4;
-			longValue	|= count;
-
-			do {
-				CHCK_PARSER_LOOP(callbacks->yajl_integer(ctx,longValue));
-			} while (--rle);
-			type = currBlockType;
-			break;
-			
-		case MSG_PACK_int_8 	: 
-			count = (char)*ptr++;
-			goto performIntCall;
-			
-		case MSG_PACK_int_16 	: 
-			count = (short)((ptr[0]<<8) | ptr[1]); ptr+=2;
-			goto performIntCall;
-			
-		case MSG_PACK_int_32 	: 
-			count = (int)((ptr[0]<<24) | (ptr[1]<<16) | (ptr[2]<<8) | ptr[3]); ptr+=4;
-			goto performIntCall;
-			
-		case MSG_PACK_reservedH	: 
-		case MSG_PACK_reservedI	: 
-		case MSG_PACK_reservedJ	: 
-		case MSG_PACK_reservedK	: 
-		case MSG_PACK_reservedL	: 
-		case MSG_PACK_reservedM	: 
-			break;
-			
-		case MSG_PACK_raw_16 	: 
-			count = (short)((ptr[0]<<8) | ptr[1]); ptr+=2;
-			if (type == 1) {
-				// Key.
-				CHCK_PARSER(callbacks->yajl_map_key(ctx,ptr,count,-1));
-			} else {
-				// String.
-				CHCK_PARSER(callbacks->yajl_string(ctx,ptr,count,-1));
-				type = currBlockType;
+
+			take = need - have;
+			if (take > (size_t)(endPtr - ptr)) {
+				take = endPtr - ptr;
 			}
-			break;
-		case MSG_PACK_raw_32 	: 
-			count = (int)((ptr[0]<<24) | (ptr[1]<<16) | (ptr[2]<<8) | ptr[3]); ptr+=4;
-			if (type == 1) {
-				// Key.
-				CHCK_PARSER(callbacks->yajl_map_key(ctx,ptr,count,-1));
-			} else {
-				// String.
-				CHCK_PARSER(callbacks->yajl_string(ctx,ptr,count,-1));
-				type = currBlockType;
+			if (take == 0) {
+				hand->bytesConsumed = jsonTextLength;
+				return MSGPACK_NO_ERROR;
 			}
-			break;
-		case MSG_PACK_array_16 	: 
-			count = (unsigned short)((ptr[0]<<8) | ptr[1]); ptr+=2;
-			stackCount	[++stackDepth]	= count;
-			stackType	[stackDepth]	= 1;
-			CHCK_PARSER(callbacks->yajl_start_array(ctx, count));
-			currBlockType = 1;
-			goto shortCut;
-		case MSG_PACK_array_32 	: 
-			count = (int)((ptr[0]<<24) | (ptr[1]<<16) | (ptr[2]<<8) | ptr[3]); ptr+=4;
-			stackCount[++stackDepth]	= (unsigned int)count;
-			stackType	[stackDepth]	= 1;
-			CHCK_PARSER(callbacks->yajl_start_array(ctx, (unsigned int)count));
-			currBlockType = 1;
-			goto shortCut;
-		case MSG_PACK_map_16 	: 
-			count = (unsigned short)((ptr[0]<<8) | ptr[1]); ptr+=2;
-			stackCount[++stackDepth]	= (unsigned int)count;
-			stackType	[stackDepth]	= 0;
-			CHCK_PARSER(callbacks->yajl_start_map(ctx, count));
-			currBlockType = 0;
-			goto shortCut;
-		case MSG_PACK_map_32 	: 
-			count = (int)((ptr[0]<<24) | (ptr[1]<<16) | (ptr[2]<<8) | ptr[3]); ptr+=4;
-			stackCount[++stackDepth]	= (unsigned int)count;
-			stackType	[stackDepth]	= 0;
-			CHCK_PARSER(callbacks->yajl_start_map(ctx, (unsigned int)count));
-			currBlockType = 0;
-			goto shortCut;
+
+			yajl_buf_append(bjsn->partial, ptr, take);
+			ptr += take;
 		}
-		
-		if ((stackDepth > 0) && ((--stackCount[stackDepth]) == 0)) {
-			if (stackType[stackDepth] == 0) {
-				CHCK_PARSER(callbacks->yajl_end_array(ctx));
-			} else {
-				CHCK_PARSER(callbacks->yajl_end_map(ctx));
-			}
-			stackDepth--;
-			currBlockType = stackType[stackDepth];
-			type = currBlockType;
+
+		yajl_buf_clear(bjsn->partial);
+	}
+
+	// Tokens entirely inside this chunk
+	while ((error == MSGPACK_NO_ERROR) && (ptr < endPtr)) {
+		error = MSGPACK_RECORD(hand, ptr, endPtr - ptr, &need);
+		if (error == MSGPACK_NO_ERROR) {
+			ptr += need;
 		}
 	}
 
+	if (error == MSGPACK_MORE) {
+		yajl_buf_append(bjsn->partial, ptr, endPtr - ptr);
+		ptr = endPtr;
+		error = MSGPACK_NO_ERROR;
+	}
+
+	hand->bytesConsumed = ptr - jsonText;
 	return error;
 }
+
+int msgpack_complete(	yajl_handle		hand)
+{
+	bjson_handle*	bjsn= &hand->msgpack;
+
+	if (yajl_bs_current(hand->stateStack) == yajl_state_parse_error) {
+		return MSGPACK_ERROR;
+	}
+
+	if ((bjsn->state != bjson_state_done) || (bjsn->partial && yajl_buf_len(bjsn->partial))) {
+		return msgpack_error(hand, MSGPACK_ERROR, "premature EOF");
+	}
+
+	return MSGPACK_NO_ERROR;
+}
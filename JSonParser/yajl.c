@@ -42,108 +42,99 @@ yajl_status_to_string(yajl_status stat)
     return statStr;
 }
 
-#include <stdio.h>
-int debugCommandCount = 0;
-
 // Use this macro only when tracking Binary JSon or Message Pack.
 // #define INTERNAL_DEBUG_JSON_PARSER
 
-yajl_callbacks debug_route = {
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL
-};
+#ifdef INTERNAL_DEBUG_JSON_PARSER
+#include <stdio.h>
 
-/* bunch of forward declarations */
-int log_null(void * ctx);
-int log_boolean(void * ctx, int boolVal);
-int log_integer(void * ctx, long long integerVal);
-int log_double(void * ctx, double doubleVal);
-int log_string(void * ctx, const unsigned char * stringVal,
-               size_t stringLen, int cte_pool);
-int log_startmap(void * ctx, unsigned int size);
-int log_endarray(void * ctx);
-int log_mapkey(void * ctx, const unsigned char * key,
-               size_t stringLen, int cte_pool);
-int log_endmap(void * ctx);
-int log_startarray(void * ctx, unsigned int size);
-
-int log_null(void * ctx) {
-	printf("Command %8i Null\n",debugCommandCount);
-	debugCommandCount++;
-	return debug_route.yajl_null(ctx);
+// Stands in as the context of a handle so every event is printed before it
+// reaches the real callbacks. One per handle, so handles used from different
+// threads don't share anything.
+typedef struct {
+	const yajl_callbacks*	route;
+	void*					ctx;
+	int						commandCount;
+} debug_state;
+
+static int log_null(void * ctx) {
+	debug_state* dbg = (debug_state*)ctx;
+	printf("Command %8i Null\n",dbg->commandCount);
+	dbg->commandCount++;
+	return dbg->route->yajl_null(dbg->ctx);
 }
 
-int log_boolean(void * ctx, int boolVal) {
-	printf("Command %8i Boolean %i\n",debugCommandCount, boolVal);
-	debugCommandCount++;
-	return debug_route.yajl_boolean(ctx,boolVal);
+static int log_boolean(void * ctx, int boolVal) {
+	debug_state* dbg = (debug_state*)ctx;
+	printf("Command %8i Boolean %i\n",dbg->commandCount, boolVal);
+	dbg->commandCount++;
+	return dbg->route->yajl_boolean(dbg->ctx,boolVal);
 }
 
-int log_integer(void * ctx, long long integerVal) {
-	printf("Command %8i Integer %lli\n",debugCommandCount, integerVal);
-	debugCommandCount++;
-	return debug_route.yajl_integer(ctx, integerVal);
+static int log_integer(void * ctx, long long integerVal) {
+	debug_state* dbg = (debug_state*)ctx;
+	printf("Command %8i Integer %lli\n",dbg->commandCount, integerVal);
+	dbg->commandCount++;
+	return dbg->route->yajl_integer(dbg->ctx, integerVal);
 }
 
-int log_double(void * ctx, double doubleVal) {
-	printf("Command %8i Double %f\n",debugCommandCount, doubleVal);
-	debugCommandCount++;
-	return debug_route.yajl_double(ctx, doubleVal);
+static int log_double(void * ctx, double doubleVal) {
+	debug_state* dbg = (debug_state*)ctx;
+	printf("Command %8i Double %f\n",dbg->commandCount, doubleVal);
+	dbg->commandCount++;
+	return dbg->route->yajl_double(dbg->ctx, doubleVal);
 }
 
-int log_string(void * ctx, const unsigned char * stringVal,
+static int log_string(void * ctx, const unsigned char * stringVal,
                     size_t stringLen, int cte_pool) {
+	debug_state* dbg = (debug_state*)ctx;
 	unsigned int n;
-	printf("Command %8i String[%i] '",debugCommandCount, (int)stringLen);
+	printf("Command %8i String[%i] '",dbg->commandCount, (int)stringLen);
 	for (n=0; n<stringLen; n++) {
 		printf("%c",stringVal[n]);
 	}
 	printf("'\n");
-	debugCommandCount++;
-	return debug_route.yajl_string(ctx, stringVal, stringLen, cte_pool);
+	dbg->commandCount++;
+	return dbg->route->yajl_string(dbg->ctx, stringVal, stringLen, cte_pool);
 }
 
-int log_startmap(void * ctx, unsigned int size) {
-	printf("Command %8i StartMap\n",debugCommandCount);
-	debugCommandCount++;
-	return debug_route.yajl_start_map(ctx, size);
+static int log_startmap(void * ctx, unsigned int size) {
+	debug_state* dbg = (debug_state*)ctx;
+	printf("Command %8i StartMap\n",dbg->commandCount);
+	dbg->commandCount++;
+	return dbg->route->yajl_start_map(dbg->ctx, size);
 }
 
-int log_mapkey(void * ctx, const unsigned char * key,
-                        size_t stringLen, int cte_pool) {
-	printf("Command %8i MapKey\n",debugCommandCount);
-	debugCommandCount++;
-	return debug_route.yajl_map_key(ctx, key, stringLen, cte_pool);
+static int log_mapkey(void * ctx, const unsigned char * key,
+                    size_t stringLen, int cte_pool) {
+	debug_state* dbg = (debug_state*)ctx;
+	printf("Command %8i MapKey\n",dbg->commandCount);
+	dbg->commandCount++;
+	return dbg->route->yajl_map_key(dbg->ctx, key, stringLen, cte_pool);
 }
 
-int log_endmap(void * ctx) {
-	printf("Command %8i EndMap\n",debugCommandCount);
-	debugCommandCount++;
-	return debug_route.yajl_end_map(ctx);
+static int log_endmap(void * ctx) {
+	debug_state* dbg = (debug_state*)ctx;
+	printf("Command %8i EndMap\n",dbg->commandCount);
+	dbg->commandCount++;
+	return dbg->route->yajl_end_map(dbg->ctx);
 }
 
-int log_startarray(void * ctx, unsigned int size) {
-	printf("Command %8i StartArray\n",debugCommandCount);
-	debugCommandCount++;
-	return debug_route.yajl_start_array(ctx, size);
+static int log_startarray(void * ctx, unsigned int size) {
+	debug_state* dbg = (debug_state*)ctx;
+	printf("Command %8i StartArray\n",dbg->commandCount);
+	dbg->commandCount++;
+	return dbg->route->yajl_start_array(dbg->ctx, size);
 }
 
-int log_endarray(void * ctx) {
-	printf("Command %8i EndArray\n",debugCommandCount);
-	debugCommandCount++;
-	return debug_route.yajl_end_array(ctx);
+static int log_endarray(void * ctx) {
+	debug_state* dbg = (debug_state*)ctx;
+	printf("Command %8i EndArray\n",dbg->commandCount);
+	dbg->commandCount++;
+	return dbg->route->yajl_end_array(dbg->ctx);
 }
 
-yajl_callbacks debugcallbacks = {
+static const yajl_callbacks debugcallbacks = {
 	log_null,
 	log_boolean,
 	log_integer,
@@ -155,7 +146,9 @@ yajl_callbacks debugcallbacks = {
 	log_endmap,
 	log_startarray,
 	log_endarray
+	// No run callbacks, so runs are logged value by value.
 };
+#endif
 
 yajl_handle
 yajl_alloc(const yajl_callbacks * callbacks,
@@ -181,31 +174,35 @@ yajl_alloc(const yajl_callbacks * callbacks,
     /* copy in pointers to allocation routines */
     memcpy((void *) &(hand->alloc), (void *) afs, sizeof(yajl_alloc_funcs));
 
-#ifndef INTERNAL_DEBUG_JSON_PARSER
+#ifdef INTERNAL_DEBUG_JSON_PARSER
+	{
+		debug_state* dbg = (debug_state*) YA_MALLOC(afs, sizeof(debug_state));
+		dbg->route			= callbacks;
+		dbg->ctx			= ctx;
+		dbg->commandCount	= 0;
+		callbacks			= &debugcallbacks;
+		ctx					= dbg;
+	}
+#endif
 	hand->callbacks = callbacks;
 	hand->ctx = ctx;
-#else
-	hand->callbacks		= &debugcallbacks;
-	debug_route			= *callbacks;
-	hand->ctx			= ctx;
-	debugCommandCount	= 0;
-#endif
     hand->lexer = NULL; 
     hand->bytesConsumed = 0;
     hand->decodeBuf = yajl_buf_alloc(&(hand->alloc));
     hand->flags	    = 0;
+    hand->maxDepth  = BJSN_MAX_DEPTH;
+    hand->inputFormat = yajl_input_auto;
     yajl_bs_init(hand->stateStack, &(hand->alloc));
     yajl_bs_push(hand->stateStack, yajl_state_start);
 
 	//
 	// Binary JSon Parser
 	//
-	hand->bj.afs		= afs;
+	memset(&hand->bj, 0, sizeof(bjson_handle));
+	hand->bj.afs		= &(hand->alloc);
 	hand->bj.callbacks	= callbacks;
-	hand->bj.cp			= NULL;
 	hand->bj.ctx		= ctx;
-	hand->bj.strs		= NULL;
-	hand->bj.used		= 0;
+	hand->msgpack		= hand->bj;
 
     return hand;
 }
@@ -214,7 +211,7 @@ int
 yajl_config(yajl_handle h, yajl_option opt, ...)
 {
 	int rv = 1;
-	if (h->bj.used == 0) {
+	if (h->bj.used == 0 && h->msgpack.used == 0) {
 		va_list ap;
 		va_start(ap, opt);
 
@@ -224,9 +221,23 @@ yajl_config(yajl_handle h, yajl_option opt, ...)
 			case yajl_allow_trailing_garbage:
 			case yajl_allow_multiple_values:
 			case yajl_allow_partial_values:
+			case yajl_persistent_input:
+			case yajl_validate_binary_strings:
 				if (va_arg(ap, int)) h->flags |= opt;
 				else h->flags &= ~opt;
 				break;
+			case yajl_input: {
+				int format = va_arg(ap, int);
+				if (format < yajl_input_auto || format > yajl_input_msgpack_ext) rv = 0;
+				else h->inputFormat = format;
+				break;
+			}
+			case yajl_max_depth: {
+				unsigned int depth = va_arg(ap, unsigned int);
+				if (depth == 0) rv = 0;
+				else h->maxDepth = depth;
+				break;
+			}
 			default:
 				rv = 0;
 		}
@@ -242,8 +253,11 @@ yajl_free(yajl_handle handle)
 	//
 	// Binary JSon
 	//
-	if (handle->bj.cp)		YA_FREE(&(handle->alloc), handle->bj.cp);
-	if (handle->bj.strs)	YA_FREE(&(handle->alloc), handle->bj.strs);
+	bjson_free(handle);
+
+#ifdef INTERNAL_DEBUG_JSON_PARSER
+	YA_FREE(&(handle->alloc), handle->ctx);
+#endif
 
     yajl_bs_free(handle->stateStack);
     yajl_buf_free(handle->decodeBuf);
@@ -254,22 +268,65 @@ yajl_free(yajl_handle handle)
     YA_FREE(&(handle->alloc), handle);
 }
 
+void
+yajl_reset(yajl_handle hand)
+{
+    if (hand->lexer) {
+        yajl_lex_free(hand->lexer);
+        hand->lexer = NULL;
+    }
+    hand->parseError = NULL;
+    hand->bytesConsumed = 0;
+    yajl_buf_clear(hand->decodeBuf);
+    hand->stateStack.used = 0;
+    yajl_bs_push(hand->stateStack, yajl_state_start);
+
+	bjson_reset(hand);
+
+#ifdef INTERNAL_DEBUG_JSON_PARSER
+	((debug_state*)hand->ctx)->commandCount = 0;
+#endif
+}
+
 yajl_status
 yajl_parse(yajl_handle hand, const unsigned char * jsonText,
            size_t jsonTextLen)
 {
     yajl_status status;
 
-	if (jsonTextLen >= 2) {
-		if (jsonText[0] == 0xFF && jsonText[1] == 0xFF) {
-			hand->bj.used = 1;
-			return (yajl_status)bjson_parse(hand,jsonText,(int)jsonTextLen);
-		} else if ((jsonText[0] >= 0xDC) && (jsonText[0] <= 0xDF)) {
-			hand->msgpack.used = 1;
-			return (yajl_status)msgpack_parse(hand,jsonText,(int)jsonTextLen);
+	/* unless set with yajl_input, the format is picked from the first byte
+	 * of the first chunk, neither can start a JSON text */
+	if (hand->lexer == NULL && !hand->bj.used && !hand->msgpack.used &&
+		jsonTextLen > 0) {
+		switch (hand->inputFormat) {
+			case yajl_input_auto:
+				if (jsonText[0] == 0xFF) {
+					hand->bj.used = 1;
+				} else if ((jsonText[0] >= 0xDC) && (jsonText[0] <= 0xDF)) {
+					hand->msgpack.used = 1;
+					hand->msgpack.standard = 0;
+				}
+				break;
+			case yajl_input_bjson:
+				hand->bj.used = 1;
+				break;
+			case yajl_input_msgpack:
+			case yajl_input_msgpack_ext:
+				hand->msgpack.used = 1;
+				hand->msgpack.standard =
+					hand->inputFormat == yajl_input_msgpack;
+				break;
+			default:
+				break;
 		}
 	}
 
+	if (hand->bj.used) {
+		return (yajl_status)bjson_parse(hand,jsonText,jsonTextLen);
+	} else if (hand->msgpack.used) {
+		return (yajl_status)msgpack_parse(hand,jsonText,jsonTextLen);
+	}
+
     /* lazy allocation of the lexer */
     if (hand->lexer == NULL) {
         hand->lexer = yajl_lex_alloc(&(hand->alloc),
@@ -286,7 +343,9 @@ yajl_status
 yajl_complete_parse(yajl_handle hand)
 {
 	if (hand->bj.used) {
-		return yajl_status_ok;
+		return (yajl_status)bjson_complete(hand);
+	} else if (hand->msgpack.used) {
+		return (yajl_status)msgpack_complete(hand);
 	}
 
     /* The lexer is lazy allocated in the first call to parse.  if parse is
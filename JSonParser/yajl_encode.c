@@ -20,6 +20,7 @@
 
 
 #include "yajl_encode.h"
+#include "yajl_scan.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -49,6 +50,9 @@ yajl_string_encode(const yajl_print_t print,
 
     while (end < len) {
         const char * escaped = NULL;
+        end += yajl_scan_plain(str + end, len - end,
+                               escape_solidus ? YAJL_SCAN_STOP_SOLIDUS : 0);
+        if (end == len) break;
         switch (str[end]) {
             case '\r': escaped = "\\r"; break;
             case '\n': escaped = "\\n"; break;
@@ -191,13 +195,16 @@ int yajl_string_validate_utf8(const unsigned char * s, size_t len)
     if (!len) return 1;
     if (!s) return 0;
     
-    while (len--) {
-        /* single byte */
-        if (*s <= 0x7f) {
-            /* noop */
-        }
+    for (;;) {
+        /* runs of ASCII are skipped a vector at a time */
+        size_t ascii = yajl_scan_ascii(s, len);
+        s += ascii;
+        len -= ascii;
+        if (!len) break;
+        len--;
+
         /* two byte */ 
-        else if ((*s >> 5) == 0x6) {
+        if ((*s >> 5) == 0x6) {
             ADV_PTR;
             if (!((*s >> 6) == 0x2)) return 0;
         }
@@ -17,6 +17,7 @@
 #include "api/yajl_gen.h"
 #include "yajl_buf.h"
 #include "yajl_encode.h"
+#include "yajl_number.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -24,6 +25,10 @@
 #include <math.h>
 #include <stdarg.h>
 
+/* output is collected in the generator and passed on to the buffer or print
+ * callback in pieces of up to this size */
+#define YAJL_GEN_OUT_SIZE 16384
+
 typedef enum {
     yajl_gen_start,
     yajl_gen_map_start,
@@ -40,13 +45,118 @@ struct yajl_gen_t
     unsigned int flags;
     unsigned int depth;
     const char * indentString;
-    yajl_gen_state state[YAJL_MAX_DEPTH];
+    /* ",\n" followed by stateSize copies of indentString, so that a
+     * separator, newline and indentation take a single print */
+    char * whitespace;
+    size_t indentLen;
+    /* one state per open container plus the top level, grown as needed */
+    yajl_gen_state * state;
+    unsigned int stateSize;
+    unsigned int maxDepth;
     yajl_print_t print;
     void * ctx; /* yajl_buf */
     /* memory allocation routines */
     yajl_alloc_funcs alloc;
+    size_t outUsed;
+    unsigned char out[YAJL_GEN_OUT_SIZE];
 };
 
+/* passes the collected output on */
+static void
+yajl_gen_flush_out(yajl_gen g)
+{
+    if (g->outUsed == 0) return;
+    if (g->print == (yajl_print_t)&yajl_buf_append)
+        yajl_buf_append((yajl_buf)g->ctx, g->out, g->outUsed);
+    else
+        g->print(g->ctx, (const char *) g->out, g->outUsed);
+    g->outUsed = 0;
+}
+
+/* the slow path of GEN_PRINT, for output that doesn't fit in out */
+static void
+yajl_gen_write(yajl_gen g, const char * str, size_t len)
+{
+    yajl_gen_flush_out(g);
+    if (len < YAJL_GEN_OUT_SIZE) {
+        memcpy(g->out, str, len);
+        g->outUsed = len;
+    } else if (g->print == (yajl_print_t)&yajl_buf_append) {
+        yajl_buf_append((yajl_buf)g->ctx, str, len);
+    } else {
+        g->print(g->ctx, str, len);
+    }
+}
+
+#define GEN_PRINT(str, len)                                     \
+    do {                                                        \
+        size_t l_ = (len);                                      \
+        if (l_ <= YAJL_GEN_OUT_SIZE - g->outUsed) {             \
+            memcpy(g->out + g->outUsed, (str), l_);             \
+            g->outUsed += l_;                                   \
+        } else {                                                \
+            yajl_gen_write(g, (str), l_);                       \
+        }                                                       \
+    } while (0)
+
+#define GEN_PUTC(c)                                             \
+    do {                                                        \
+        if (g->outUsed == YAJL_GEN_OUT_SIZE) yajl_gen_flush_out(g); \
+        g->out[g->outUsed++] = (c);                             \
+    } while (0)
+
+/* makes room for a formatted number in out */
+#define GEN_RESERVE(len)                                        \
+    if (YAJL_GEN_OUT_SIZE - g->outUsed < (len)) yajl_gen_flush_out(g);
+
+/* print callback for yajl_string_encode */
+static void
+yajl_gen_print_out(void * ctx, const char * str, size_t len)
+{
+    yajl_gen g = (yajl_gen) ctx;
+    GEN_PRINT(str, len);
+}
+
+static int
+yajl_gen_set_indent(yajl_gen g, const char * indent)
+{
+    size_t len = strlen(indent), i;
+    char * whitespace =
+        (char *) YA_MALLOC(&(g->alloc), 2 + g->stateSize * len);
+    if (!whitespace) return 0;
+
+    whitespace[0] = ',';
+    whitespace[1] = '\n';
+    for (i = 0; i < g->stateSize; i++)
+        memcpy(whitespace + 2 + i * len, indent, len);
+
+    if (g->whitespace) YA_FREE(&(g->alloc), g->whitespace);
+    g->whitespace = whitespace;
+    g->indentString = indent;
+    g->indentLen = len;
+    return 1;
+}
+
+/* makes room for at least size states, and the indentation that goes with
+ * them */
+static int
+yajl_gen_grow(yajl_gen g, unsigned int size)
+{
+    unsigned int newSize = g->stateSize;
+    yajl_gen_state * state;
+
+    if (size <= g->stateSize) return 1;
+    while (newSize < size)
+        newSize = newSize > (unsigned int) -1 / 2 ? size : newSize * 2;
+
+    state = (yajl_gen_state *) YA_REALLOC(&(g->alloc), g->state,
+                                          newSize * sizeof(yajl_gen_state));
+    if (!state) return 0;
+    g->state = state;
+    g->stateSize = newSize;
+    return yajl_gen_set_indent(g, g->indentString);
+}
+
 int
 yajl_gen_config(yajl_gen g, yajl_gen_option opt, ...)
 {
@@ -57,28 +167,35 @@ yajl_gen_config(yajl_gen g, yajl_gen_option opt, ...)
     switch(opt) {
         case yajl_gen_beautify:
         case yajl_gen_validate_utf8:
+        case yajl_gen_fast_numbers:
             if (va_arg(ap, int)) g->flags |= opt;
             else g->flags &= ~opt;
             break;
         case yajl_gen_indent_string: {
-            const char *indent = va_arg(ap, const char *);
-            g->indentString = indent;
-            for (; *indent; indent++) {
-                if (*indent != '\n'
-                    && *indent != '\v'
-                    && *indent != '\f'
-                    && *indent != '\t'
-                    && *indent != '\r'
-                    && *indent != ' ')
+            const char *indent = va_arg(ap, const char *), *c;
+            for (c = indent; *c; c++) {
+                if (*c != '\n'
+                    && *c != '\v'
+                    && *c != '\f'
+                    && *c != '\t'
+                    && *c != '\r'
+                    && *c != ' ')
                 {
-                    g->indentString = NULL;
                     rv = 0;
                 }
             }
+            if (rv) rv = yajl_gen_set_indent(g, indent);
+            break;
+        }
+        case yajl_gen_max_depth: {
+            unsigned int depth = va_arg(ap, unsigned int);
+            if (depth == 0) rv = 0;
+            else g->maxDepth = depth;
             break;
         }
         case yajl_gen_print_callback:
-            yajl_buf_free(g->ctx);
+            yajl_gen_flush_out(g);
+            if (g->print == (yajl_print_t)&yajl_buf_append) yajl_buf_free(g->ctx);
             g->print = va_arg(ap, const yajl_print_t);
             g->ctx = va_arg(ap, void *);
             break;
@@ -119,7 +236,14 @@ yajl_gen_alloc(const yajl_alloc_funcs * afs)
 
     g->print = (yajl_print_t)&yajl_buf_append;
     g->ctx = yajl_buf_alloc(&(g->alloc));
-    g->indentString = "    ";
+    g->maxDepth = YAJL_MAX_DEPTH;
+    g->stateSize = YAJL_MAX_DEPTH + 1;
+    g->state = (yajl_gen_state *) YA_MALLOC(&(g->alloc),
+                                            g->stateSize * sizeof(yajl_gen_state));
+    if (!g->state || !yajl_gen_set_indent(g, "    ")) {
+        yajl_gen_free(g);
+        return NULL;
+    }
 
     return g;
 }
@@ -128,30 +252,47 @@ void
 yajl_gen_free(yajl_gen g)
 {
     if (g->print == (yajl_print_t)&yajl_buf_append) yajl_buf_free((yajl_buf)g->ctx);
+    if (g->whitespace) YA_FREE(&(g->alloc), g->whitespace);
+    if (g->state) YA_FREE(&(g->alloc), g->state);
     YA_FREE(&(g->alloc), g);
 }
 
+/* separator plus, when beautifying, newline and indentation for the next
+ * value, in at most one print.  Compact output only ever needs one byte. */
 #define INSERT_SEP \
-    if (g->state[g->depth] == yajl_gen_map_key ||               \
-        g->state[g->depth] == yajl_gen_in_array) {              \
-        g->print(g->ctx, ",", 1);                               \
-        if ((g->flags & yajl_gen_beautify)) g->print(g->ctx, "\n", 1);               \
-    } else if (g->state[g->depth] == yajl_gen_map_val) {        \
-        g->print(g->ctx, ":", 1);                               \
-        if ((g->flags & yajl_gen_beautify)) g->print(g->ctx, " ", 1);                \
-   } 
-
-#define INSERT_WHITESPACE                                               \
-    if ((g->flags & yajl_gen_beautify)) {                                                    \
-        if (g->state[g->depth] != yajl_gen_map_val) {                   \
-            unsigned int _i;                                            \
-            for (_i=0;_i<g->depth;_i++)                                 \
-                g->print(g->ctx,                                        \
-                         g->indentString,                               \
-                         (unsigned int)strlen(g->indentString));        \
+    if (!(g->flags & yajl_gen_beautify)) {                              \
+        switch (g->state[g->depth]) {                                   \
+            case yajl_gen_map_key:                                      \
+            case yajl_gen_in_array:                                     \
+                GEN_PUTC(',');                                          \
+                break;                                                  \
+            case yajl_gen_map_val:                                      \
+                GEN_PUTC(':');                                          \
+                break;                                                  \
+            default:                                                    \
+                break;                                                  \
+        }                                                               \
+    } else {                                                            \
+        switch (g->state[g->depth]) {                                   \
+            case yajl_gen_map_key:                                      \
+            case yajl_gen_in_array:                                     \
+                GEN_PRINT(g->whitespace, 2 + g->depth * g->indentLen);  \
+                break;                                                  \
+            case yajl_gen_map_val:                                      \
+                GEN_PRINT(": ", 2);                                     \
+                break;                                                  \
+            default:                                                    \
+                if (g->depth > 0)                                       \
+                    GEN_PRINT(g->whitespace + 2, g->depth * g->indentLen); \
+                break;                                                  \
         }                                                               \
     }
 
+/* newline and indentation before a closing bracket */
+#define INSERT_CLOSE_WHITESPACE \
+    if ((g->flags & yajl_gen_beautify))                                 \
+        GEN_PRINT(g->whitespace + 1, 1 + g->depth * g->indentLen);
+
 #define ENSURE_NOT_KEY \
     if (g->state[g->depth] == yajl_gen_map_key ||       \
         g->state[g->depth] == yajl_gen_map_start)  {    \
@@ -167,11 +308,16 @@ yajl_gen_free(yajl_gen g)
         return yajl_gen_generation_complete;                \
     }
 
+/* leaves depth alone on failure, so that it keeps indexing the state array */
 #define INCREMENT_DEPTH \
-    if (++(g->depth) >= YAJL_MAX_DEPTH) return yajl_max_depth_exceeded;
+    if (g->depth >= g->maxDepth) return yajl_max_depth_exceeded; \
+    if (g->depth + 1 >= g->stateSize && !yajl_gen_grow(g, g->depth + 2)) \
+        return yajl_max_depth_exceeded; \
+    g->depth++;
 
 #define DECREMENT_DEPTH \
-  if (--(g->depth) >= YAJL_MAX_DEPTH) return (yajl_gen_status)yajl_gen_error;
+  if (g->depth == 0) return (yajl_gen_status)yajl_gen_error; \
+  g->depth--;
 
 #define APPENDED_ATOM \
     switch (g->state[g->depth]) {                   \
@@ -192,17 +338,25 @@ yajl_gen_free(yajl_gen g)
             break;                                  \
     }                                               \
 
+/* a complete value is passed on right away */
 #define FINAL_NEWLINE                                        \
-    if ((g->flags & yajl_gen_beautify) && g->state[g->depth] == yajl_gen_complete) \
-        g->print(g->ctx, "\n", 1);
+    if (g->state[g->depth] == yajl_gen_complete) {           \
+        if (g->flags & yajl_gen_beautify) GEN_PUTC('\n');    \
+        yajl_gen_flush_out(g);                               \
+    }
 
 yajl_gen_status
 yajl_gen_integer(yajl_gen g, long long int number)
 {
-    char i[32];
-    ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP; INSERT_WHITESPACE;
-    sprintf(i, "%lld", number);
-    g->print(g->ctx, i, (unsigned int)strlen(i));
+    char i[YAJL_NUMBER_BUFSIZE];
+    ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP;
+    if (g->flags & yajl_gen_fast_numbers) {
+        GEN_RESERVE(YAJL_NUMBER_BUFSIZE);
+        g->outUsed += yajl_format_integer((char *) g->out + g->outUsed, number);
+    } else {
+        sprintf(i, "%lld", number);
+        GEN_PRINT(i, strlen(i));
+    }
     APPENDED_ATOM;
     FINAL_NEWLINE;
     return yajl_gen_status_ok;
@@ -217,12 +371,17 @@ yajl_gen_integer(yajl_gen g, long long int number)
 yajl_gen_status
 yajl_gen_double(yajl_gen g, double number)
 {
-    char i[32];
+    char i[YAJL_NUMBER_BUFSIZE];
     ENSURE_VALID_STATE; ENSURE_NOT_KEY; 
     if (isnan(number) || isinf(number)) return yajl_gen_invalid_number;
-    INSERT_SEP; INSERT_WHITESPACE;
-    sprintf(i, "%.20g", number);
-    g->print(g->ctx, i, (unsigned int)strlen(i));
+    INSERT_SEP;
+    if (g->flags & yajl_gen_fast_numbers) {
+        GEN_RESERVE(YAJL_NUMBER_BUFSIZE);
+        g->outUsed += yajl_format_double((char *) g->out + g->outUsed, number);
+    } else {
+        sprintf(i, "%.20g", number);
+        GEN_PRINT(i, strlen(i));
+    }
     APPENDED_ATOM;
     FINAL_NEWLINE;
     return yajl_gen_status_ok;
@@ -231,8 +390,8 @@ yajl_gen_double(yajl_gen g, double number)
 yajl_gen_status
 yajl_gen_number(yajl_gen g, const char * s, size_t l)
 {
-    ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP; INSERT_WHITESPACE;
-    g->print(g->ctx, s, l);
+    ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP;
+    GEN_PRINT(s, l);
     APPENDED_ATOM;
     FINAL_NEWLINE;
     return yajl_gen_status_ok;
@@ -250,10 +409,10 @@ yajl_gen_string(yajl_gen g, const unsigned char * str,
             return yajl_gen_invalid_string;
         }
     }
-    ENSURE_VALID_STATE; INSERT_SEP; INSERT_WHITESPACE;
-    g->print(g->ctx, "\"", 1);
-    yajl_string_encode(g->print, g->ctx, str, len, g->flags & yajl_gen_escape_solidus);
-    g->print(g->ctx, "\"", 1);
+    ENSURE_VALID_STATE; INSERT_SEP;
+    GEN_PUTC('"');
+    yajl_string_encode(&yajl_gen_print_out, g, str, len, g->flags & yajl_gen_escape_solidus);
+    GEN_PUTC('"');
     APPENDED_ATOM;
     FINAL_NEWLINE;
     return yajl_gen_status_ok;
@@ -262,8 +421,8 @@ yajl_gen_string(yajl_gen g, const unsigned char * str,
 yajl_gen_status
 yajl_gen_null(yajl_gen g)
 {
-    ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP; INSERT_WHITESPACE;
-    g->print(g->ctx, "null", strlen("null"));
+    ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP;
+    GEN_PRINT("null", 4);
     APPENDED_ATOM;
     FINAL_NEWLINE;
     return yajl_gen_status_ok;
@@ -274,8 +433,8 @@ yajl_gen_bool(yajl_gen g, int boolean)
 {
     const char * val = boolean ? "true" : "false";
 
-	ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP; INSERT_WHITESPACE;
-    g->print(g->ctx, val, (unsigned int)strlen(val));
+	ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP;
+    GEN_PRINT(val, boolean ? 4 : 5);
     APPENDED_ATOM;
     FINAL_NEWLINE;
     return yajl_gen_status_ok;
@@ -284,12 +443,12 @@ yajl_gen_bool(yajl_gen g, int boolean)
 yajl_gen_status
 yajl_gen_map_open(yajl_gen g)
 {
-    ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP; INSERT_WHITESPACE;
+    ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP;
     INCREMENT_DEPTH; 
     
     g->state[g->depth] = yajl_gen_map_start;
-    g->print(g->ctx, "{", 1);
-    if ((g->flags & yajl_gen_beautify)) g->print(g->ctx, "\n", 1);
+    if (g->flags & yajl_gen_beautify) GEN_PRINT("{\n", 2);
+    else GEN_PUTC('{');
     FINAL_NEWLINE;
     return yajl_gen_status_ok;
 }
@@ -300,10 +459,9 @@ yajl_gen_map_close(yajl_gen g)
     ENSURE_VALID_STATE; 
     DECREMENT_DEPTH;
     
-    if ((g->flags & yajl_gen_beautify)) g->print(g->ctx, "\n", 1);
     APPENDED_ATOM;
-    INSERT_WHITESPACE;
-    g->print(g->ctx, "}", 1);
+    INSERT_CLOSE_WHITESPACE;
+    GEN_PUTC('}');
     FINAL_NEWLINE;
     return yajl_gen_status_ok;
 }
@@ -311,11 +469,11 @@ yajl_gen_map_close(yajl_gen g)
 yajl_gen_status
 yajl_gen_array_open(yajl_gen g)
 {
-    ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP; INSERT_WHITESPACE;
+    ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP;
     INCREMENT_DEPTH; 
     g->state[g->depth] = yajl_gen_array_start;
-    g->print(g->ctx, "[", 1);
-    if ((g->flags & yajl_gen_beautify)) g->print(g->ctx, "\n", 1);
+    if (g->flags & yajl_gen_beautify) GEN_PRINT("[\n", 2);
+    else GEN_PUTC('[');
     FINAL_NEWLINE;
     return yajl_gen_status_ok;
 }
@@ -325,10 +483,9 @@ yajl_gen_array_close(yajl_gen g)
 {
     ENSURE_VALID_STATE;
     DECREMENT_DEPTH;
-    if ((g->flags & yajl_gen_beautify)) g->print(g->ctx, "\n", 1);
     APPENDED_ATOM;
-    INSERT_WHITESPACE;
-    g->print(g->ctx, "]", 1);
+    INSERT_CLOSE_WHITESPACE;
+    GEN_PUTC(']');
     FINAL_NEWLINE;
     return yajl_gen_status_ok;
 }
@@ -338,6 +495,7 @@ yajl_gen_get_buf(yajl_gen g, const unsigned char ** buf,
                  size_t * len)
 {
     if (g->print != (yajl_print_t)&yajl_buf_append) return yajl_gen_no_buf;
+    yajl_gen_flush_out(g);
     *buf = yajl_buf_data((yajl_buf)g->ctx);
     *len = yajl_buf_len((yajl_buf)g->ctx);
     return yajl_gen_status_ok;
@@ -346,5 +504,59 @@ yajl_gen_get_buf(yajl_gen g, const unsigned char ** buf,
 void
 yajl_gen_clear(yajl_gen g)
 {
-    if (g->print == (yajl_print_t)&yajl_buf_append) yajl_buf_clear((yajl_buf)g->ctx);
+    if (g->print == (yajl_print_t)&yajl_buf_append) {
+        g->outUsed = 0;
+        yajl_buf_clear((yajl_buf)g->ctx);
+    }
+}
+
+void
+yajl_gen_flush(yajl_gen g)
+{
+    yajl_gen_flush_out(g);
+}
+
+void
+yajl_gen_reset(yajl_gen g, const char * sep)
+{
+    g->depth = 0;
+    g->state[0] = yajl_gen_start;
+    if (sep != NULL) GEN_PRINT(sep, strlen(sep));
+    yajl_gen_flush_out(g);
+}
+
+void
+yajl_gen_continue(yajl_gen g, yajl_gen from, int sibling)
+{
+    g->flags = from->flags;
+    g->maxDepth = from->maxDepth;
+    if (g->indentString != from->indentString)
+        yajl_gen_set_indent(g, from->indentString);
+    if (!yajl_gen_grow(g, from->depth + 1)) {
+        g->depth = 0;
+        g->state[0] = yajl_gen_error;
+        return;
+    }
+    g->depth = from->depth;
+    memcpy((void *) g->state, (void *) from->state,
+           (from->depth + 1) * sizeof(yajl_gen_state));
+
+    if (sibling) {
+        switch (g->state[g->depth]) {
+            case yajl_gen_map_start:
+                g->state[g->depth] = yajl_gen_map_key;
+                break;
+            case yajl_gen_array_start:
+                g->state[g->depth] = yajl_gen_in_array;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void
+yajl_gen_raw(yajl_gen g, const char * text, size_t len)
+{
+    GEN_PRINT(text, len);
 }
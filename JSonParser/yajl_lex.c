@@ -16,6 +16,7 @@
 
 #include "yajl_lex.h"
 #include "yajl_buf.h"
+#include "yajl_scan.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -92,6 +93,9 @@ struct yajl_lexer_t {
     unsigned int validateUTF8;
 
     yajl_alloc_funcs * alloc;
+
+    /* the value of the last number token */
+    yajl_lex_number_value number;
 };
 
 #define readChar(lxr, txt, off)                      \
@@ -250,19 +254,12 @@ if (*offset >= jsonTextLen) { \
 
 /** scan a string for interesting characters that might need further
  *  review.  return the number of chars that are uninteresting and can
- *  be skipped.
- * (lth) hi world, any thoughts on how to make this routine faster? */
+ *  be skipped.  these are exactly the IJC|NFP (and NUC) chars of
+ *  charLookupTable, which yajl_scan_plain() tests a vector at a time. */
 static size_t
 yajl_string_scan(const unsigned char * buf, size_t len, int utf8check)
 {
-    unsigned char mask = IJC|NFP|(utf8check ? NUC : 0);
-    size_t skip = 0;
-    while (skip < len && !(charLookupTable[*buf] & mask))
-    {
-        skip++;
-        buf++;
-    }
-    return skip;
+    return yajl_scan_plain(buf, len, utf8check ? YAJL_SCAN_STOP_HIGH : 0);
 }
 
 static yajl_tok
@@ -368,6 +365,70 @@ yajl_lex_string(yajl_lexer lexer, const unsigned char * jsonText,
 
 #define RETURN_IF_EOF if (*offset >= jsonTextLen) return yajl_tok_eof;
 
+/* Digits kept in yajl_lex_number_value.mantissa, 10^19 < 2^64. */
+#define MAX_MANTISSA_DIGITS 19
+
+/* the exponent saturates well beyond anything a double can reach */
+#define MAX_EXPONENT 100000
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LOAD_LE64(v) (__builtin_bswap64(v))
+#else
+#define LOAD_LE64(v) (v)
+#endif
+
+/* If the 8 bytes at p are all digits, stores their value and returns 1 */
+static int
+yajl_lex_eight_digits(const unsigned char * p, unsigned long long int * value)
+{
+    unsigned long long int v;
+
+    memcpy(&v, p, sizeof(v));
+    v = LOAD_LE64(v);
+    /* both the bytes and the bytes + 6 must read 0x3?, that's '0' to '9' */
+    if ((((v & 0xF0F0F0F0F0F0F0F0ULL) |
+          (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4))) !=
+        0x3333333333333333ULL)
+    {
+        return 0;
+    }
+
+    /* pairs, then quads, then all eight */
+    v = ((v & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+    v = ((v & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    *value = ((v & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+    return 1;
+}
+
+/* Adds a digit to the mantissa, or notes that it didn't fit.  Integer
+ * digits that don't fit still scale the value. */
+#define ACCUMULATE_DIGIT(num, c, scale)                                 \
+    if ((num)->significant < MAX_MANTISSA_DIGITS) {                     \
+        (num)->mantissa = (num)->mantissa * 10 + (unsigned) ((c) - '0');\
+        if ((num)->mantissa) (num)->significant++;                      \
+        (num)->exponent -= !(scale);                                    \
+    } else {                                                            \
+        (num)->truncated = 1;                                           \
+        (num)->exponent += (scale);                                     \
+    }
+
+/* Takes the digits 8 at a time straight from the input text while they
+ * all fit the mantissa.  The leading zeros of a fraction count as
+ * significant here, that only ever truncates sooner. */
+#define ACCUMULATE_EIGHT_DIGITS(num, scale)                             \
+    if (!lexer->bufInUse) {                                             \
+        unsigned long long int eight;                                   \
+        while ((num)->significant + 8 <= MAX_MANTISSA_DIGITS &&         \
+               *offset + 8 <= jsonTextLen &&                            \
+               yajl_lex_eight_digits(jsonText + *offset, &eight))       \
+        {                                                               \
+            if ((num)->mantissa || eight) (num)->significant += 8;      \
+            (num)->mantissa = (num)->mantissa * 100000000ULL + eight;   \
+            (num)->exponent -= 8 * !(scale);                            \
+            *offset += 8;                                               \
+        }                                                               \
+    }
+
 static yajl_tok
 yajl_lex_number(yajl_lexer lexer, const unsigned char * jsonText,
                 size_t jsonTextLen, size_t * offset)
@@ -377,14 +438,19 @@ yajl_lex_number(yajl_lexer lexer, const unsigned char * jsonText,
      *       is an ambiguous case for integers at EOF. */
 
     unsigned char c;
+    yajl_lex_number_value * num = &lexer->number;
 
     yajl_tok tok = yajl_tok_integer;
 
+    /* a number split over chunks is lexed again from its start */
+    memset(num, 0, sizeof(*num));
+
     RETURN_IF_EOF;    
     c = readChar(lexer, jsonText, offset);
 
     /* optional leading minus */
     if (c == '-') {
+        num->negative = 1;
         RETURN_IF_EOF;    
         c = readChar(lexer, jsonText, offset); 
     }
@@ -394,10 +460,15 @@ yajl_lex_number(yajl_lexer lexer, const unsigned char * jsonText,
         RETURN_IF_EOF;    
         c = readChar(lexer, jsonText, offset); 
     } else if (c >= '1' && c <= '9') {
-        do {
+        num->mantissa = (unsigned) (c - '0');
+        num->significant = 1;
+        ACCUMULATE_EIGHT_DIGITS(num, 1);
+        for (;;) {
             RETURN_IF_EOF;    
             c = readChar(lexer, jsonText, offset); 
-        } while (c >= '0' && c <= '9');
+            if (c < '0' || c > '9') break;
+            ACCUMULATE_DIGIT(num, c, 1);
+        }
     } else {
         unreadChar(lexer, offset);
         lexer->error = yajl_lex_missing_integer_after_minus;
@@ -406,13 +477,16 @@ yajl_lex_number(yajl_lexer lexer, const unsigned char * jsonText,
 
     /* optional fraction (indicates this is floating point) */
     if (c == '.') {
-        int numRd = 0;
+        int numRd = num->exponent;
         
+        ACCUMULATE_EIGHT_DIGITS(num, 0);
+        numRd -= num->exponent;
         RETURN_IF_EOF;
         c = readChar(lexer, jsonText, offset); 
 
         while (c >= '0' && c <= '9') {
             numRd++;
+            ACCUMULATE_DIGIT(num, c, 0);
             RETURN_IF_EOF;
             c = readChar(lexer, jsonText, offset); 
         } 
@@ -427,17 +501,22 @@ yajl_lex_number(yajl_lexer lexer, const unsigned char * jsonText,
 
     /* optional exponent (indicates this is floating point) */
     if (c == 'e' || c == 'E') {
+        int negative = 0;
+        int exponent = 0;
+
         RETURN_IF_EOF;
         c = readChar(lexer, jsonText, offset); 
 
         /* optional sign */
         if (c == '+' || c == '-') {
+            negative = (c == '-');
             RETURN_IF_EOF;
             c = readChar(lexer, jsonText, offset); 
         }
 
         if (c >= '0' && c <= '9') {
             do {
+                if (exponent < MAX_EXPONENT) exponent = exponent * 10 + (c - '0');
                 RETURN_IF_EOF;
                 c = readChar(lexer, jsonText, offset); 
             } while (c >= '0' && c <= '9');
@@ -446,6 +525,7 @@ yajl_lex_number(yajl_lexer lexer, const unsigned char * jsonText,
             lexer->error = yajl_lex_missing_integer_after_exponent;
             return yajl_tok_error;
         }
+        num->exponent += negative ? -exponent : exponent;
         tok = yajl_tok_double;
     }
     
@@ -743,6 +823,11 @@ size_t yajl_lex_current_char(yajl_lexer lexer)
     return lexer->charOff;
 }
 
+const yajl_lex_number_value * yajl_lex_last_number(yajl_lexer lexer)
+{
+    return &lexer->number;
+}
+
 yajl_tok yajl_lex_peek(yajl_lexer lexer, const unsigned char * jsonText,
                        size_t jsonTextLen, size_t offset)
 {
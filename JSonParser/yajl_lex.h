@@ -83,6 +83,20 @@ yajl_tok yajl_lex_lex(yajl_lexer lexer, const unsigned char * jsonText,
 yajl_tok yajl_lex_peek(yajl_lexer lexer, const unsigned char * jsonText,
                        size_t jsonTextLen, size_t offset);
 
+/** the value of the last integer or double token, accumulated while it was
+ *  lexed: mantissa * 10^exponent, negated when negative is set.  mantissa
+ *  holds at most the first 19 significant digits, truncated is set when
+ *  there were more. */
+typedef struct {
+    unsigned long long int mantissa;
+    int exponent;
+    unsigned int significant;
+    unsigned int negative;
+    unsigned int truncated;
+} yajl_lex_number_value;
+
+const yajl_lex_number_value * yajl_lex_last_number(yajl_lexer lexer);
+
 
 typedef enum {
     yajl_lex_e_ok = 0,
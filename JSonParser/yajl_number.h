@@ -0,0 +1,26 @@
+#ifndef __YAJL_NUMBER_H__
+#define __YAJL_NUMBER_H__
+
+/* Longest output of either formatter including the terminating NUL. */
+#define YAJL_NUMBER_BUFSIZE 32
+
+/* Locale independent number formatting used by yajl_gen when
+ * yajl_gen_fast_numbers is set.  Both write NUL terminated text into buf,
+ * which must hold YAJL_NUMBER_BUFSIZE bytes, and return its length. */
+
+unsigned int yajl_format_integer(char * buf, long long int number);
+
+/* number must be finite.  The output always reads back as the same double
+ * and is the shortest such digit string in all but rare cases (Grisu2), laid
+ * out like JavaScript's Number.prototype.toString: plain notation for
+ * magnitudes in [1e-6, 1e21), exponent notation otherwise. */
+unsigned int yajl_format_double(char * buf, double number);
+
+/* Locale independent conversion of mantissa * 10^exponent, negated when
+ * negative is set, to the nearest double.  Overflow gives an infinity.
+ * Returns 0 in the rare cases where that needs more than 128 bits of
+ * precision, strtod has to decide those. */
+int yajl_parse_double(unsigned long long int mantissa, int exponent,
+                      int negative, double * out);
+
+#endif
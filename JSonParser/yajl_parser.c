@@ -22,6 +22,7 @@
 #include "api/yajl_parse.h"
 #include "yajl_lex.h"
 #include "yajl_parser.h"
+#include "yajl_number.h"
 #include "yajl_encode.h"
 #include "yajl_bytestack.h"
 
@@ -105,8 +106,9 @@ yajl_render_error_string(yajl_handle hand, const unsigned char * jsonText,
     }
 
     /* now we append as many spaces as needed to make sure the error
-     * falls at char 41, if verbose was specified */
-    if (verbose) {
+     * falls at char 41, if verbose was specified.  binary input makes no
+     * sense to quote. */
+    if (verbose && !hand->bj.used && !hand->msgpack.used) {
         size_t start, end, i;
         size_t spacesNeeded;
 
@@ -267,27 +269,41 @@ yajl_do_parse(yajl_handle hand, const unsigned char * jsonText,
                     }
                     break;
                 case yajl_tok_left_bracket:
+                case yajl_tok_left_brace:
+                    /* the bottom of the stack is the top level */
+                    if (hand->stateStack.used > hand->maxDepth) {
+                        yajl_bs_set(hand->stateStack, yajl_state_parse_error);
+                        hand->parseError = "JSON nesting too deep";
+                        if (*offset >= bufLen) *offset -= bufLen;
+                        goto around_again;
+                    }
+                    if (tok == yajl_tok_left_brace) {
+                        if (hand->callbacks &&
+                            hand->callbacks->yajl_start_array)
+                        {
+                            _CC_CHK(hand->callbacks->yajl_start_array(
+                                        hand->ctx,-1));
+                        }
+                        stateToPush = yajl_state_array_start;
+                        break;
+                    }
                     if (hand->callbacks && hand->callbacks->yajl_start_map) {
                         _CC_CHK(hand->callbacks->yajl_start_map(hand->ctx,-1));
                     }
                     stateToPush = yajl_state_map_start;
                     break;
-                case yajl_tok_left_brace:
-                    if (hand->callbacks && hand->callbacks->yajl_start_array) {
-                        _CC_CHK(hand->callbacks->yajl_start_array(hand->ctx,-1));
-                    }
-                    stateToPush = yajl_state_array_start;
-                    break;
                 case yajl_tok_integer:
                     if (hand->callbacks) {
                         if (hand->callbacks->yajl_number) {
                             _CC_CHK(hand->callbacks->yajl_number(
                                         hand->ctx,(const char *) buf, bufLen));
                         } else if (hand->callbacks->yajl_integer) {
+                            /* the lexer already took in the digits */
+                            const yajl_lex_number_value * num =
+                                yajl_lex_last_number(hand->lexer);
                             long long int i = 0;
-                            i = yajl_parse_integer(buf, (unsigned int)bufLen);
-                            if ((i == LLONG_MIN || i == LLONG_MAX) &&
-                                errno == ERANGE)
+                            if (num->truncated ||
+                                num->mantissa > (unsigned long long) LLONG_MAX)
                             {
                                 yajl_bs_set(hand->stateStack,
                                             yajl_state_parse_error);
@@ -297,6 +313,8 @@ yajl_do_parse(yajl_handle hand, const unsigned char * jsonText,
                                 else *offset = 0;
                                 goto around_again;
                             }
+                            i = (long long int) num->mantissa;
+                            if (num->negative) i = -i;
                             _CC_CHK(hand->callbacks->yajl_integer(hand->ctx,
                                                                   i));
                         }
@@ -308,13 +326,19 @@ yajl_do_parse(yajl_handle hand, const unsigned char * jsonText,
                             _CC_CHK(hand->callbacks->yajl_number(
                                         hand->ctx, (const char *) buf, bufLen));
                         } else if (hand->callbacks->yajl_double) {
+                            const yajl_lex_number_value * num =
+                                yajl_lex_last_number(hand->lexer);
                             double d = 0.0;
-                            yajl_buf_clear(hand->decodeBuf);
-                            yajl_buf_append(hand->decodeBuf, buf, bufLen);
-                            buf = yajl_buf_data(hand->decodeBuf);
-                            d = strtod((char *) buf, NULL);
-                            if ((d == HUGE_VAL || d == -HUGE_VAL) &&
-                                errno == ERANGE)
+                            if (num->truncated ||
+                                !yajl_parse_double(num->mantissa, num->exponent,
+                                                   num->negative, &d))
+                            {
+                                yajl_buf_clear(hand->decodeBuf);
+                                yajl_buf_append(hand->decodeBuf, buf, bufLen);
+                                buf = yajl_buf_data(hand->decodeBuf);
+                                d = strtod((char *) buf, NULL);
+                            }
+                            if (d == HUGE_VAL || d == -HUGE_VAL)
                             {
                                 yajl_bs_set(hand->stateStack,
                                             yajl_state_parse_error);
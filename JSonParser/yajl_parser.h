@@ -26,6 +26,57 @@
 #include "yajl_buf.h"
 #include "yajl_lex.h"
 
+#include <string.h>
+
+// Big-endian field loads for the binary parsers: a single unaligned load,
+// byte swapped on little-endian hosts.
+#if defined(_MSC_VER)
+#include <stdlib.h>
+#define BJSON_BSWAP16(x)	_byteswap_ushort(x)
+#define BJSON_BSWAP32(x)	_byteswap_ulong(x)
+#define BJSON_BSWAP64(x)	_byteswap_uint64(x)
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define BJSON_BSWAP16(x)	(x)
+#define BJSON_BSWAP32(x)	(x)
+#define BJSON_BSWAP64(x)	(x)
+#elif defined(__GNUC__)
+#define BJSON_BSWAP16(x)	__builtin_bswap16(x)
+#define BJSON_BSWAP32(x)	__builtin_bswap32(x)
+#define BJSON_BSWAP64(x)	__builtin_bswap64(x)
+#endif
+
+#ifdef BJSON_BSWAP32
+static __inline unsigned int bjson_rd16(const unsigned char* p) {
+	unsigned short v;
+	memcpy(&v, p, sizeof(v));
+	return BJSON_BSWAP16(v);
+}
+
+static __inline unsigned int bjson_rd32(const unsigned char* p) {
+	unsigned int v;
+	memcpy(&v, p, sizeof(v));
+	return BJSON_BSWAP32(v);
+}
+
+static __inline unsigned long long int bjson_rd64(const unsigned char* p) {
+	unsigned long long int v;
+	memcpy(&v, p, sizeof(v));
+	return BJSON_BSWAP64(v);
+}
+#else
+static __inline unsigned int bjson_rd16(const unsigned char* p) {
+	return ((unsigned int)p[0] << 8) | p[1];
+}
+
+static __inline unsigned int bjson_rd32(const unsigned char* p) {
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+static __inline unsigned long long int bjson_rd64(const unsigned char* p) {
+	return ((unsigned long long int)bjson_rd32(p) << 32) | bjson_rd32(p + 4);
+}
+#endif
+
 
 typedef enum {
     yajl_state_start = 0,
@@ -49,6 +100,22 @@ typedef struct {
 	int						memberCache;
 } cp_entry;
 
+// Decoding progress of the binary parsers, kept across yajl_parse calls.
+typedef enum {
+	bjson_state_header = 0,
+	bjson_state_pool,
+	bjson_state_stream,
+	bjson_state_done
+} bjson_state;
+
+// Open MessagePack or binary JSON container.
+typedef struct {
+	// MessagePack: elements still to come, maps counting keys and values
+	// separately. Binary JSON: 1 between a key and its value.
+	unsigned long long		remaining;
+	int						isMap;
+} msgpack_frame;
+
 typedef struct {
 	int						used;
 	int						cp_count;
@@ -58,6 +125,28 @@ typedef struct {
     const char *			parseError;
 	cp_entry*				cp;
 	unsigned char*			strs;
+
+	bjson_state				state;
+	// Pool entries read so far, and allocated in cp.
+	int						cp_read;
+	int						cp_size;
+	// Pool strings copied into strs when the input can't be referenced.
+	size_t					strs_len;
+	size_t					strs_size;
+	// Open containers.
+	size_t					depth;
+	// When non-zero, the depth of a container whose contents are skipped,
+	// see YAJL_SKIP_CONTAINER.
+	size_t					skipDepth;
+	// Start of a record cut by the end of the previous chunk.
+	yajl_buf				partial;
+
+	// Container stack, depth entries deep.
+	msgpack_frame*			stack;
+	size_t					stack_size;
+	// MessagePack as specified instead of the dialect, see
+	// yajl_input_msgpack.
+	int						standard;
 } bjson_handle;
 
 typedef struct yajl_handle_t {
@@ -77,6 +166,10 @@ typedef struct yajl_handle_t {
     yajl_alloc_funcs alloc;
     /* bitfield */
     unsigned int flags;
+    /* deepest nesting accepted, see yajl_max_depth */
+    size_t maxDepth;
+    /* a yajl_input_format */
+    int inputFormat;
 
 	// Binary JSon parser.
 	bjson_handle bj;
@@ -99,14 +192,41 @@ yajl_render_error_string(yajl_handle hand, const unsigned char * jsonText,
 long long
 yajl_parse_integer(const unsigned char *number, unsigned int length);
 
+/* Both binary parsers accept the input in chunks of any size, like
+ * yajl_do_parse.  A record cut by the end of a chunk is kept in
+ * bjson_handle::partial until the next chunk completes it. */
 int bjson_parse(	yajl_handle hand, 
 					const unsigned char*	jsonText,
-					int						jsonTextLength
+					size_t					jsonTextLength
 				);
 
+int bjson_complete(	yajl_handle hand );
+
+void bjson_reset(	yajl_handle hand );
+
+// Passes a run of count equal values to the run callback, or to the single
+// value callback count times when there is none.
+int bjson_integer_run(	const yajl_callbacks*	callbacks,
+						void*					ctx,
+						long long int			value,
+						unsigned int			count );
+
+int bjson_boolean_run(	const yajl_callbacks*	callbacks,
+						void*					ctx,
+						int						value,
+						unsigned int			count );
+
+// Callbacks that drop every event, for the values of skipped containers.
+extern const yajl_callbacks bjson_skip_callbacks;
+
 int msgpack_parse(	yajl_handle hand, 
 					const unsigned char*	jsonText,
-					int						jsonTextLength
+					size_t					jsonTextLength
 				);
 
+int msgpack_complete( yajl_handle hand );
+
+/* Releases what the binary parsers allocated. */
+void bjson_free(	yajl_handle hand );
+
 #endif
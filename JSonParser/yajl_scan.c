@@ -0,0 +1,236 @@
+#include "yajl_scan.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define YAJL_SCAN_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define YAJL_SCAN_AVX2
+#include <immintrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64) || \
+    (defined(__ARM_NEON) && defined(__ARM_ARCH) && __ARM_ARCH >= 7)
+#define YAJL_SCAN_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+static unsigned int
+first_bit(unsigned int bits)
+{
+#if defined(__GNUC__)
+    return (unsigned int) __builtin_ctz(bits);
+#elif defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, bits);
+    return (unsigned int) index;
+#else
+    unsigned int n = 0;
+    while (!(bits & 1)) { bits >>= 1; n++; }
+    return n;
+#endif
+}
+
+static size_t
+scan_scalar(const unsigned char * buf, size_t len, unsigned int flags)
+{
+    size_t skip = 0;
+    for (; skip < len; skip++) {
+        unsigned char c = buf[skip];
+        if (c < 0x20 || c == '"' || c == '\\') break;
+        if (c >= 0x80 && (flags & YAJL_SCAN_STOP_HIGH)) break;
+        if (c == '/' && (flags & YAJL_SCAN_STOP_SOLIDUS)) break;
+    }
+    return skip;
+}
+
+#ifdef YAJL_SCAN_SSE2
+static size_t
+scan_sse2(const unsigned char * buf, size_t len, unsigned int flags)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    /* a second quote compare is as good as none */
+    const __m128i slash = _mm_set1_epi8(
+        (flags & YAJL_SCAN_STOP_SOLIDUS) ? '/' : '"');
+    const __m128i ctrl = _mm_set1_epi8(0x1F);
+    const unsigned int high = (flags & YAJL_SCAN_STOP_HIGH) ? 0xFFFFu : 0;
+    size_t skip = 0;
+
+    for (; skip + 16 <= len; skip += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + skip));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, slash),
+                         _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v)));
+        unsigned int bits = (unsigned int) _mm_movemask_epi8(m) |
+                            ((unsigned int) _mm_movemask_epi8(v) & high);
+        if (bits) return skip + first_bit(bits);
+    }
+
+    return skip + scan_scalar(buf + skip, len - skip, flags);
+}
+#endif
+
+#ifdef YAJL_SCAN_AVX2
+#if defined(__GNUC__)
+__attribute__((target("avx2")))
+#endif
+static size_t
+scan_avx2(const unsigned char * buf, size_t len, unsigned int flags)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i slash = _mm256_set1_epi8(
+        (flags & YAJL_SCAN_STOP_SOLIDUS) ? '/' : '"');
+    const __m256i ctrl = _mm256_set1_epi8(0x1F);
+    const unsigned int high = (flags & YAJL_SCAN_STOP_HIGH) ? 0xFFFFFFFFu : 0;
+    size_t skip = 0;
+
+    for (; skip + 32 <= len; skip += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + skip));
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                            _mm256_cmpeq_epi8(v, bslash)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, slash),
+                            _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctrl), v)));
+        unsigned int bits = (unsigned int) _mm256_movemask_epi8(m) |
+                            ((unsigned int) _mm256_movemask_epi8(v) & high);
+        if (bits) return skip + first_bit(bits);
+    }
+
+    /* the compiler doesn't clear the upper halves before this call, and
+     * SSE code running with them dirty is many times slower */
+    _mm256_zeroupper();
+    return skip + scan_sse2(buf + skip, len - skip, flags);
+}
+
+static int
+cpu_has_avx2(void)
+{
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return 0;
+    __cpuid(info, 1);
+    /* OSXSAVE and AVX, then the OS must save the YMM state */
+    if ((info[2] & 0x18000000) != 0x18000000) return 0;
+    if ((_xgetbv(0) & 6) != 6) return 0;
+    __cpuidex(info, 7, 0);
+    return (info[1] & 0x20) != 0;
+#endif
+}
+#endif
+
+#ifdef YAJL_SCAN_NEON
+static size_t
+scan_neon(const unsigned char * buf, size_t len, unsigned int flags)
+{
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t bslash = vdupq_n_u8('\\');
+    const uint8x16_t slash = vdupq_n_u8(
+        (flags & YAJL_SCAN_STOP_SOLIDUS) ? '/' : '"');
+    const uint8x16_t ctrl = vdupq_n_u8(0x20);
+    const uint8x16_t high = vdupq_n_u8(0x80);
+    size_t skip = 0;
+
+    for (; skip + 16 <= len; skip += 16) {
+        uint8x16_t v = vld1q_u8(buf + skip);
+        uint8x16_t m = vorrq_u8(
+            vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, bslash)),
+            vorrq_u8(vceqq_u8(v, slash), vcltq_u8(v, ctrl)));
+        uint64_t bits;
+
+        if (flags & YAJL_SCAN_STOP_HIGH) m = vorrq_u8(m, vcgeq_u8(v, high));
+
+        /* 4 bits per byte */
+        bits = vget_lane_u64(vreinterpret_u64_u8(
+                   vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        if (bits) {
+            unsigned int lo = (unsigned int) bits;
+            if (lo) return skip + (first_bit(lo) >> 2);
+            return skip + 8 + (first_bit((unsigned int) (bits >> 32)) >> 2);
+        }
+    }
+
+    return skip + scan_scalar(buf + skip, len - skip, flags);
+}
+#endif
+
+typedef size_t (*scan_func)(const unsigned char *, size_t, unsigned int);
+
+static size_t scan_resolve(const unsigned char * buf, size_t len,
+                           unsigned int flags);
+
+/* Every thread that races through scan_resolve stores the same pointer, but
+ * the accesses still have to be atomic. */
+#if defined(__GNUC__)
+#define SCAN_LOAD(p) __atomic_load_n(&(p), __ATOMIC_RELAXED)
+#define SCAN_STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELAXED)
+static scan_func scanImpl = scan_resolve;
+#else
+/* aligned pointer sized volatile accesses are atomic with MSVC */
+#define SCAN_LOAD(p) (p)
+#define SCAN_STORE(p, v) ((p) = (v))
+static scan_func volatile scanImpl = scan_resolve;
+#endif
+
+static size_t
+scan_resolve(const unsigned char * buf, size_t len, unsigned int flags)
+{
+    scan_func impl = scan_scalar;
+#if defined(YAJL_SCAN_AVX2)
+    impl = cpu_has_avx2() ? scan_avx2 : scan_sse2;
+#elif defined(YAJL_SCAN_SSE2)
+    impl = scan_sse2;
+#elif defined(YAJL_SCAN_NEON)
+    impl = scan_neon;
+#endif
+    SCAN_STORE(scanImpl, impl);
+    return impl(buf, len, flags);
+}
+
+size_t
+yajl_scan_plain(const unsigned char * buf, size_t len, unsigned int flags)
+{
+    scan_func impl = SCAN_LOAD(scanImpl);
+    return impl(buf, len, flags);
+}
+
+size_t
+yajl_scan_ascii(const unsigned char * buf, size_t len)
+{
+    size_t skip = 0;
+
+#if defined(YAJL_SCAN_SSE2)
+    for (; skip + 16 <= len; skip += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + skip));
+        unsigned int bits = (unsigned int) _mm_movemask_epi8(v);
+        if (bits) return skip + first_bit(bits);
+    }
+#elif defined(YAJL_SCAN_NEON)
+    for (; skip + 16 <= len; skip += 16) {
+        uint8x16_t m = vcgeq_u8(vld1q_u8(buf + skip), vdupq_n_u8(0x80));
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(
+                            vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        if (bits) break;
+    }
+#else
+    for (; skip + 8 <= len; skip += 8) {
+        unsigned long long int w;
+        memcpy(&w, buf + skip, sizeof(w));
+        if (w & 0x8080808080808080ULL) break;
+    }
+#endif
+
+    while (skip < len && buf[skip] < 0x80) skip++;
+    return skip;
+}
@@ -0,0 +1,21 @@
+#ifndef __YAJL_SCAN_H__
+#define __YAJL_SCAN_H__
+
+#include <stddef.h>
+
+/* also stop at bytes >= 0x80 */
+#define YAJL_SCAN_STOP_HIGH    0x01
+/* also stop at '/' */
+#define YAJL_SCAN_STOP_SOLIDUS 0x02
+
+/* Returns the length of the leading run of buf that contains no '"', '\\'
+ * or control characters (< 0x20), plus whatever the YAJL_SCAN_* flags add.
+ * Uses SSE2/AVX2 or NEON where available, picked once at runtime. */
+size_t yajl_scan_plain(const unsigned char * buf, size_t len,
+                       unsigned int flags);
+
+/* Returns the length of the leading run of buf that is plain ASCII (no byte
+ * >= 0x80), 16 bytes at a time with SSE2 or NEON, 8 otherwise. */
+size_t yajl_scan_ascii(const unsigned char * buf, size_t len);
+
+#endif
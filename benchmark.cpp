@@ -0,0 +1,960 @@
+// Copyright (c) 2023 Dark Energy Processor
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Generates a synthetic corpus for every input kind rjson understands, then
+// times each conversion stage on it and writes the numbers as JSON.
+
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_DEPRECATE
+#endif
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#define PSAPI_VERSION 2
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "rjson.h"
+
+// Every operator new and yajl allocation goes through these, so a stage's
+// allocation count is the difference before and after it.
+static std::atomic<size_t> allocationCount(0);
+
+void *operator new(size_t size)
+{
+	allocationCount++;
+	void *result = malloc(size ? size : 1);
+	if (result == nullptr)
+		throw std::bad_alloc();
+
+	return result;
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+static void *count_malloc(void *, size_t size)
+{
+	allocationCount++;
+	return malloc(size);
+}
+
+static void *count_realloc(void *, void *ptr, size_t size)
+{
+	allocationCount++;
+	return realloc(ptr, size);
+}
+
+static void count_free(void *, void *ptr)
+{
+	free(ptr);
+}
+
+static yajl_alloc_funcs counting_alloc = {count_malloc, count_realloc, count_free, nullptr};
+
+// Small deterministic PRNG so every run benchmarks the same bytes.
+class random_source
+{
+public:
+	random_source(uint64_t seed)
+	: state(seed)
+	{ }
+
+	uint32_t next()
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return (uint32_t) (state >> 16);
+	}
+
+	uint32_t below(uint32_t n)
+	{
+		return next() % n;
+	}
+
+private:
+	uint64_t state;
+};
+
+static const char *const WORDS[] = {
+	"live", "unit", "card", "skill", "score", "rank", "event", "member",
+	"album", "song", "stage", "center", "smile", "pure", "cool", "bonus"
+};
+
+static std::string make_text(random_source &rng, size_t words)
+{
+	std::string result;
+	for (size_t i = 0; i < words; i++)
+	{
+		if (i)
+			result += ' ';
+		result += WORDS[rng.below(sizeof(WORDS) / sizeof(WORDS[0]))];
+	}
+
+	return result;
+}
+
+// Logical content shared by all corpora: an array of records, each a map of
+// RECORD_MEMBERS distinct keys to mixed scalars plus one array with long runs
+// of equal values, which is what the binary formats compress with RLE.
+static constexpr unsigned int RECORD_MEMBERS = 10;
+static constexpr unsigned int KEY_COUNT = 64;
+static constexpr unsigned int POOL_VALUES = 192;
+
+class bjson_writer
+{
+public:
+	std::vector<unsigned char> out;
+
+	void u8(unsigned int v)
+	{
+		out.push_back((unsigned char) v);
+	}
+
+	void u16(unsigned int v)
+	{
+		u8(v >> 8);
+		u8(v);
+	}
+
+	void u32(uint32_t v)
+	{
+		u16(v >> 16);
+		u16(v & 0xFFFF);
+	}
+
+	void u64(uint64_t v)
+	{
+		u32((uint32_t) (v >> 32));
+		u32((uint32_t) v);
+	}
+
+	void bytes(const std::string &s)
+	{
+		out.insert(out.end(), s.begin(), s.end());
+	}
+};
+
+static std::string key_name(unsigned int i)
+{
+	return "key_" + std::to_string(i);
+}
+
+static std::string pool_value(unsigned int i)
+{
+	return "value_" + std::to_string(i);
+}
+
+// Binary JSON with a constant pool for keys and common strings.
+static std::vector<unsigned char> make_bjson(size_t targetSize)
+{
+	random_source rng(1);
+	bjson_writer doc;
+	size_t records = 0;
+
+	doc.u8(BJSN_OPEN_ARR);
+	size_t countAt = doc.out.size();
+	doc.u32(0);
+	doc.u32(0);
+
+	while (doc.out.size() < targetSize)
+	{
+		unsigned int keyBase = rng.below(KEY_COUNT);
+		doc.u8(BJSN_OPEN_OBJ);
+		doc.u32(RECORD_MEMBERS);
+
+		for (unsigned int m = 0; m < RECORD_MEMBERS; m++)
+		{
+			doc.u8(BJSN_MEMBER);
+			doc.u32((keyBase + m) % KEY_COUNT);
+
+			switch (m)
+			{
+				case 0:
+					doc.u8(BJSN_STRING);
+					doc.u32(KEY_COUNT + rng.below(POOL_VALUES));
+					break;
+				case 1:
+				{
+					std::string text = make_text(rng, 1 + rng.below(12));
+					doc.u8(BJSN_STRING_DIRECT);
+					doc.u32((uint32_t) text.size());
+					doc.bytes(text);
+					break;
+				}
+				case 2:
+					doc.u8(BJSN_NUMBER_I8);
+					doc.u8(rng.below(256));
+					break;
+				case 3:
+					doc.u8(BJSN_NUMBER_I16);
+					doc.u16(rng.below(65536));
+					break;
+				case 4:
+					doc.u8(BJSN_NUMBER_I32);
+					doc.u32(rng.next());
+					break;
+				case 5:
+					doc.u8(BJSN_NUMBER_I64);
+					doc.u64(((uint64_t) rng.next() << 32) | rng.next());
+					break;
+				case 6:
+				{
+					double d = rng.next() / 1000.0;
+					uint64_t bits;
+					memcpy(&bits, &d, sizeof(bits));
+					doc.u8(BJSN_NUMBER_DBL);
+					doc.u64(bits);
+					break;
+				}
+				case 7:
+				{
+					float f = rng.below(100000) / 8.0f;
+					uint32_t bits;
+					memcpy(&bits, &f, sizeof(bits));
+					doc.u8(BJSN_NUMBER_FLT);
+					doc.u32(bits);
+					break;
+				}
+				case 8:
+					doc.u8(rng.below(3) + BJSN_CTE_TRUE);
+					break;
+				default:
+				{
+					// Runs of equal values.
+					unsigned int runs[3] = {1 + rng.below(64), 1 + rng.below(64), 1 + rng.below(16)};
+					doc.u8(BJSN_OPEN_ARR);
+					doc.u32(runs[0] + runs[1] + runs[2]);
+					doc.u32(0);
+					doc.u8(BJSN_NUMBER_I8_RLE);
+					doc.u8(rng.below(128));
+					doc.u16(runs[0]);
+					doc.u8(BJSN_NUMBER_I32_RLE);
+					doc.u32(rng.next());
+					doc.u16(runs[1]);
+					doc.u8(BJSN_CTE_TRUE_RLE);
+					doc.u16(runs[2]);
+					doc.u8(BJSN_CLOSE_ARR);
+					break;
+				}
+			}
+		}
+
+		doc.u8(BJSN_CLOSE_OBJ);
+		records++;
+	}
+
+	doc.u8(BJSN_CLOSE_ARR);
+	doc.u8(BJSN_END);
+
+	for (int i = 0; i < 4; i++)
+		doc.out[countAt + i] = (unsigned char) (records >> (24 - i * 8));
+
+	bjson_writer file;
+	std::vector<std::string> pool;
+	size_t poolSize = 0;
+	for (unsigned int i = 0; i < KEY_COUNT; i++)
+		pool.push_back(key_name(i));
+	for (unsigned int i = 0; i < POOL_VALUES; i++)
+		pool.push_back(pool_value(i));
+	for (const std::string &s: pool)
+		poolSize += s.size();
+
+	file.u16(0xFFFF);
+	file.u32((uint32_t) pool.size());
+	file.u32((uint32_t) poolSize);
+	for (const std::string &s: pool)
+	{
+		file.u32((uint32_t) s.size());
+		file.bytes(s);
+	}
+
+	file.out.insert(file.out.end(), doc.out.begin(), doc.out.end());
+	return file.out;
+}
+
+// The dialect has no str8, which the specification uses 0xD9 for.
+static void msgpack_raw(bjson_writer &w, const std::string &s, bool standard)
+{
+	if (s.size() < 32)
+		w.u8(0xA0 + (unsigned int) s.size());
+	else if (standard && s.size() < 256)
+	{
+		w.u8(0xD9);
+		w.u8((unsigned int) s.size());
+	}
+	else if (s.size() < 65536)
+	{
+		w.u8(0xDA);
+		w.u16((unsigned int) s.size());
+	}
+	else
+	{
+		w.u8(0xDB);
+		w.u32((uint32_t) s.size());
+	}
+
+	w.bytes(s);
+}
+
+// The MessagePack dialect rjson reads: an array16/32 root and 0xC1 followed
+// by a 16-bit count as run-length prefix. With `standard` the same records
+// are written as specified instead, with the runs spelled out.
+static std::vector<unsigned char> write_msgpack(size_t targetSize, bool standard)
+{
+	random_source rng(2);
+	bjson_writer w;
+	size_t records = 0;
+
+	w.u8(0xDD);
+	w.u32(0);
+
+	while (w.out.size() < targetSize)
+	{
+		unsigned int keyBase = rng.below(KEY_COUNT);
+		w.u8(0x80 + RECORD_MEMBERS);
+
+		for (unsigned int m = 0; m < RECORD_MEMBERS; m++)
+		{
+			msgpack_raw(w, key_name((keyBase + m) % KEY_COUNT), standard);
+
+			switch (m)
+			{
+				case 0:
+					msgpack_raw(w, pool_value(rng.below(POOL_VALUES)), standard);
+					break;
+				case 1:
+					msgpack_raw(w, make_text(rng, 1 + rng.below(12)), standard);
+					break;
+				case 2:
+					w.u8(rng.below(128));
+					break;
+				case 3:
+					w.u8(0xD1);
+					w.u16(rng.below(65536));
+					break;
+				case 4:
+					w.u8(0xD2);
+					w.u32(rng.next());
+					break;
+				case 5:
+					w.u8(0xD3);
+					w.u64(((uint64_t) rng.next() << 32) | rng.next());
+					break;
+				case 6:
+				{
+					double d = rng.next() / 1000.0;
+					uint64_t bits;
+					memcpy(&bits, &d, sizeof(bits));
+					w.u8(0xCB);
+					w.u64(bits);
+					break;
+				}
+				case 7:
+				{
+					float f = rng.below(100000) / 8.0f;
+					uint32_t bits;
+					memcpy(&bits, &f, sizeof(bits));
+					w.u8(0xCA);
+					w.u32(bits);
+					break;
+				}
+				case 8:
+				{
+					static const unsigned char CONSTANTS[] = {0xC0, 0xC2, 0xC3};
+					w.u8(CONSTANTS[rng.below(3)]);
+					break;
+				}
+				default:
+				{
+					unsigned int runs[3] = {1 + rng.below(64), 1 + rng.below(64), 1 + rng.below(16)};
+					w.u8(0xDC);
+					w.u16(runs[0] + runs[1] + runs[2]);
+					if (standard)
+					{
+						unsigned int small = rng.below(128), large = rng.next();
+						for (unsigned int i = 0; i < runs[0]; i++)
+							w.u8(small);
+						for (unsigned int i = 0; i < runs[1]; i++)
+						{
+							w.u8(0xD2);
+							w.u32(large);
+						}
+						for (unsigned int i = 0; i < runs[2]; i++)
+							w.u8(0xC3);
+						break;
+					}
+
+					w.u8(0xC1);
+					w.u16(runs[0]);
+					w.u8(rng.below(128));
+					w.u8(0xC1);
+					w.u16(runs[1]);
+					w.u8(0xD2);
+					w.u32(rng.next());
+					w.u8(0xC1);
+					w.u16(runs[2]);
+					w.u8(0xC3);
+					break;
+				}
+			}
+		}
+
+		records++;
+	}
+
+	for (int i = 0; i < 4; i++)
+		w.out[1 + i] = (unsigned char) (records >> (24 - i * 8));
+
+	return w.out;
+}
+
+static std::vector<unsigned char> make_msgpack(size_t targetSize)
+{
+	return write_msgpack(targetSize, false);
+}
+
+static std::vector<unsigned char> make_msgpack_std(size_t targetSize)
+{
+	return write_msgpack(targetSize, true);
+}
+
+static void json_escaped(std::string &out, const std::string &s, random_source &rng)
+{
+	static const char *const ESCAPES[] = {"\\n", "\\t", "\\\"", "\\\\", "\\/", "\\u00e9", "\\ud83c\\udfb5"};
+
+	out += '"';
+	for (char c: s)
+	{
+		if (c == ' ' && rng.below(4) == 0)
+			out += ESCAPES[rng.below(sizeof(ESCAPES) / sizeof(ESCAPES[0]))];
+		else
+			out += c;
+	}
+	out += '"';
+}
+
+// Text JSON with comments, escapes and non-ASCII text.
+static std::vector<unsigned char> make_json(size_t targetSize)
+{
+	random_source rng(3);
+	std::string out = "// rjson benchmark corpus\n[\n";
+	bool first = true;
+
+	while (out.size() < targetSize)
+	{
+		if (!first)
+			out += ",\n";
+		first = false;
+
+		if (rng.below(8) == 0)
+			out += "/* record " + std::to_string(rng.next()) + " */ ";
+
+		unsigned int keyBase = rng.below(KEY_COUNT);
+		out += "{";
+		for (unsigned int m = 0; m < RECORD_MEMBERS; m++)
+		{
+			if (m)
+				out += ", ";
+
+			out += '"' + key_name((keyBase + m) % KEY_COUNT) + "\": ";
+			switch (m)
+			{
+				case 0:
+					out += '"' + pool_value(rng.below(POOL_VALUES)) + "\\u00fc\"";
+					break;
+				case 1:
+					json_escaped(out, make_text(rng, 1 + rng.below(12)), rng);
+					break;
+				case 2:
+				case 3:
+				case 4:
+					out += std::to_string((int32_t) rng.next() >> (m * 6));
+					break;
+				case 5:
+					out += std::to_string((int64_t) (((uint64_t) rng.next() << 32) | rng.next()));
+					break;
+				case 6:
+				case 7:
+				{
+					char buf[32];
+					snprintf(buf, sizeof(buf), "%.17g", rng.next() / 1000.0);
+					out += buf;
+					break;
+				}
+				case 8:
+					out += rng.below(2) ? "true" : "null";
+					break;
+				default:
+				{
+					unsigned int run = 1 + rng.below(64);
+					std::string value = std::to_string(rng.below(128));
+					out += "[";
+					for (unsigned int i = 0; i < run; i++)
+					{
+						if (i)
+							out += ",";
+						out += value;
+					}
+					out += "] // run\n";
+					break;
+				}
+			}
+		}
+		out += "}";
+	}
+
+	out += "\n]\n";
+	return std::vector<unsigned char>(out.begin(), out.end());
+}
+
+// Lets peak_rss_kb() report the peak of the next stage only, where the
+// platform supports it.
+static void reset_peak_rss()
+{
+#ifdef __linux__
+	FILE *f = fopen("/proc/self/clear_refs", "w");
+	if (f)
+	{
+		fputs("5", f);
+		fclose(f);
+	}
+#endif
+}
+
+// Peak resident set size in KiB since reset_peak_rss(), or since the process
+// started where that can't be reset.
+static size_t peak_rss_kb()
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.PeakWorkingSetSize / 1024;
+
+	return 0;
+#else
+#ifdef __linux__
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f)
+	{
+		char line[256];
+		size_t result = 0;
+		while (fgets(line, sizeof(line), f))
+		{
+			if (strncmp(line, "VmHWM:", 6) == 0)
+				result = strtoul(line + 6, nullptr, 10);
+		}
+
+		fclose(f);
+		if (result)
+			return result;
+	}
+#endif
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return (size_t) usage.ru_maxrss / 1024;
+#else
+	return (size_t) usage.ru_maxrss;
+#endif
+#endif
+}
+
+struct stage_result
+{
+	const char *name;
+	double seconds;
+	size_t bytes;
+	size_t allocations;
+	size_t peakRss;
+};
+
+// Runs `fn` `iterations` times and keeps the fastest run.
+template<class F>
+static stage_result measure(const char *name, size_t bytes, int iterations, F fn)
+{
+	stage_result result = {name, 1e300, bytes, 0, 0};
+
+	for (int i = 0; i < iterations; i++)
+	{
+		reset_peak_rss();
+		size_t allocations = allocationCount;
+		auto start = std::chrono::steady_clock::now();
+
+		if (!fn())
+		{
+			result.seconds = -1;
+			return result;
+		}
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		if (elapsed.count() < result.seconds)
+			result.seconds = elapsed.count();
+
+		result.allocations = allocationCount - allocations;
+		result.peakRss = std::max(result.peakRss, peak_rss_kb());
+	}
+
+	return result;
+}
+
+// Counts parser events and does nothing else.
+static const yajl_callbacks count_cb = {
+	[](void *ctx) { ++*(size_t *) ctx; return 1; },
+	[](void *ctx, int) { ++*(size_t *) ctx; return 1; },
+	[](void *ctx, long long) { ++*(size_t *) ctx; return 1; },
+	[](void *ctx, double) { ++*(size_t *) ctx; return 1; },
+	nullptr,
+	[](void *ctx, const unsigned char *, size_t, int) { ++*(size_t *) ctx; return 1; },
+	[](void *ctx, unsigned int) { ++*(size_t *) ctx; return 1; },
+	[](void *ctx, const unsigned char *, size_t, int) { ++*(size_t *) ctx; return 1; },
+	[](void *ctx) { ++*(size_t *) ctx; return 1; },
+	[](void *ctx, unsigned int) { ++*(size_t *) ctx; return 1; },
+	[](void *ctx) { ++*(size_t *) ctx; return 1; },
+	[](void *ctx, long long, unsigned int count) { *(size_t *) ctx += count; return 1; },
+	[](void *ctx, int, unsigned int count) { *(size_t *) ctx += count; return 1; }
+};
+
+static bool write_file(const std::string &path, const unsigned char *data, size_t size)
+{
+	FILE *f = fopen(path.c_str(), "wb");
+	if (f == nullptr)
+		return false;
+
+	bool result = fwrite(data, 1, size, f) == size;
+	return fclose(f) == 0 && result;
+}
+
+static void gen_number(yajl_gen gen, const char *key, double value)
+{
+	yajl_gen_string(gen, (const unsigned char *) key, strlen(key));
+	yajl_gen_double(gen, value);
+}
+
+static void gen_integer(yajl_gen gen, const char *key, size_t value)
+{
+	yajl_gen_string(gen, (const unsigned char *) key, strlen(key));
+	yajl_gen_integer(gen, (long long) value);
+}
+
+static void gen_text(yajl_gen gen, const char *key, const char *value)
+{
+	yajl_gen_string(gen, (const unsigned char *) key, strlen(key));
+	yajl_gen_string(gen, (const unsigned char *) value, strlen(value));
+}
+
+// Benchmarks one corpus, read as `input`, and appends its results to
+// `results`.
+static bool run_corpus(yajl_gen results, const char *name, yajl_input_format input, const std::vector<unsigned char> &corpus, const std::string &dir, int iterations, bool keep)
+{
+	std::string path = dir + "/rjson_bench." + name;
+	std::string outPath = path + ".out.json";
+	std::string error;
+
+	if (!write_file(path, corpus.data(), corpus.size()))
+	{
+		perror(path.c_str());
+		return false;
+	}
+
+	size_t events = 0;
+	std::vector<stage_result> stages;
+
+	input_data in;
+	volatile unsigned char sink = 0;
+	stages.push_back(measure("read", corpus.size(), iterations, [&]()
+	{
+		if (!in.open(path.c_str()))
+			return false;
+
+		// Touch every page, as the parser would.
+		parser_input src = in.source();
+		for (size_t i = 0; i < src.size; i += 4096)
+			sink = sink + src.data[i];
+
+		in.close();
+		return true;
+	}));
+
+	if (!in.open(path.c_str()))
+	{
+		perror(path.c_str());
+		return false;
+	}
+
+	size_t counted = 0;
+	yajl_handle counter = yajl_alloc(&count_cb, &counting_alloc, &counted);
+	yajl_config(counter, yajl_input, (int) input);
+	stages.push_back(measure("parse", corpus.size(), iterations, [&]()
+	{
+		counted = 0;
+		bool result = run_parser(counter, in.source(), error);
+		events = counted;
+		return result;
+	}));
+	yajl_free(counter);
+
+	json_data_state state;
+	yajl_handle reader = yajl_alloc(&reader_cb, &counting_alloc, &state);
+	yajl_config(reader, yajl_input, (int) input);
+	size_t arenaBlocks = 0;
+	stages.push_back(measure("tree", corpus.size(), iterations, [&]()
+	{
+		state.reset();
+		size_t before = state.arena.allocations();
+		bool result = parse_json(state, reader, in.source(), error);
+		arenaBlocks = state.arena.allocations() - before;
+		return result;
+	}));
+	yajl_free(reader);
+	// The arena gets its blocks from malloc, which isn't counted directly.
+	if (stages.back().seconds >= 0)
+		stages.back().allocations += arenaBlocks;
+
+	json_tape tape;
+	yajl_handle recorder = yajl_alloc(&tape_cb, &counting_alloc, &tape);
+	yajl_config(recorder, yajl_input, (int) input);
+	stages.push_back(measure("tape", corpus.size(), iterations, [&]()
+	{
+		tape.reset();
+		return run_parser(recorder, in.source(), error);
+	}));
+	yajl_free(recorder);
+
+	// Replays the events in place of the parse stage, so compare with that.
+	stages.push_back(measure("replay", corpus.size(), iterations, [&]()
+	{
+		counted = 0;
+		return tape.replay(&count_cb, &counted);
+	}));
+
+	yajl_gen gen = yajl_gen_alloc(&counting_alloc);
+	yajl_gen_config(gen, yajl_gen_beautify, 1);
+	yajl_gen_config(gen, yajl_gen_fast_numbers, 1);
+	const unsigned char *output = nullptr;
+	size_t outputSize = 0;
+	stages.push_back(measure("generate", 0, iterations, [&]()
+	{
+		yajl_gen_reset(gen, nullptr);
+		yajl_gen_clear(gen);
+		yajl_gen_status status = generate_json(gen, &state.root);
+		yajl_gen_get_buf(gen, &output, &outputSize);
+		return status == yajl_gen_status_ok || status == yajl_gen_generation_complete;
+	}));
+	stages.back().bytes = outputSize;
+
+	yajl_gen compact = yajl_gen_alloc(&counting_alloc);
+	yajl_gen_config(compact, yajl_gen_fast_numbers, 1);
+	size_t compactSize = 0;
+	stages.push_back(measure("compact", 0, iterations, [&]()
+	{
+		yajl_gen_reset(compact, nullptr);
+		yajl_gen_clear(compact);
+		yajl_gen_status status = generate_json(compact, &state.root);
+		const unsigned char *buf;
+		yajl_gen_get_buf(compact, &buf, &compactSize);
+		return status == yajl_gen_status_ok || status == yajl_gen_generation_complete;
+	}));
+	stages.back().bytes = compactSize;
+	yajl_gen_free(compact);
+
+	stages.push_back(measure("write", outputSize, iterations, [&]()
+	{
+		return write_file(outPath, output, outputSize);
+	}));
+
+	yajl_gen_free(gen);
+	in.close();
+
+	if (!keep)
+	{
+		remove(path.c_str());
+		remove(outPath.c_str());
+	}
+
+	for (const stage_result &stage: stages)
+	{
+		if (stage.seconds < 0)
+		{
+			fprintf(stderr, "%s: %s failed: %s\n", name, stage.name, error.c_str());
+			return false;
+		}
+	}
+
+	yajl_gen_map_open(results);
+	gen_text(results, "corpus", name);
+	gen_integer(results, "bytes", corpus.size());
+	gen_integer(results, "output_bytes", outputSize);
+	gen_integer(results, "events", events);
+	yajl_gen_string(results, (const unsigned char *) "stages", 6);
+	yajl_gen_array_open(results);
+
+	fprintf(stderr, "%-8s %10zu bytes %10zu events\n", name, corpus.size(), events);
+	for (const stage_result &stage: stages)
+	{
+		double mbps = stage.bytes / stage.seconds / 1e6;
+		double eps = events / stage.seconds;
+
+		yajl_gen_map_open(results);
+		gen_text(results, "stage", stage.name);
+		gen_number(results, "seconds", stage.seconds);
+		gen_integer(results, "bytes", stage.bytes);
+		gen_number(results, "mb_per_s", mbps);
+		gen_number(results, "events_per_s", eps);
+		gen_integer(results, "allocations", stage.allocations);
+		gen_integer(results, "peak_rss_kb", stage.peakRss);
+		yajl_gen_map_close(results);
+
+		fprintf(stderr, "  %-8s %9.4f s %9.1f MB/s %12.0f events/s %8zu allocs %8zu KiB\n",
+			stage.name, stage.seconds, mbps, eps, stage.allocations, stage.peakRss);
+	}
+
+	yajl_gen_array_close(results);
+	yajl_gen_map_close(results);
+	return true;
+}
+
+static void usage(char *arg0)
+{
+	printf(
+		"Usage: %s [options]\n"
+		"\n"
+		"Options:\n"
+		"  -n <count>  Runs per stage; the fastest is reported (default 5).\n"
+		"  -m <MB>     Approximate size of each corpus (default 16).\n"
+		"  -d <dir>    Directory for the corpus and output files (default .).\n"
+		"  -o <file>   Write the results there instead of stdout.\n"
+		"  -k          Keep the corpus files.\n",
+		arg0
+	);
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = 5;
+	size_t megabytes = 16;
+	std::string dir = ".";
+	const char *resultPath = nullptr;
+	bool keep = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char *arg = argv[i];
+
+		if (strcmp(arg, "-k") == 0)
+			keep = true;
+		else if (arg[0] == '-' && arg[1] && strchr("nmdo", arg[1]) && arg[2] == 0 && i + 1 < argc)
+		{
+			const char *value = argv[++i];
+			switch (arg[1])
+			{
+				case 'n':
+					iterations = std::max(atoi(value), 1);
+					break;
+				case 'm':
+					megabytes = std::max(atoi(value), 1);
+					break;
+				case 'd':
+					dir = value;
+					break;
+				default:
+					resultPath = value;
+					break;
+			}
+		}
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	size_t target = megabytes * 1000 * 1000;
+	struct
+	{
+		const char *name;
+		yajl_input_format input;
+		std::vector<unsigned char> (*make)(size_t);
+	} corpora[] = {
+		{"bjson", yajl_input_auto, make_bjson},
+		{"msgpack", yajl_input_auto, make_msgpack},
+		{"msgpack-std", yajl_input_msgpack, make_msgpack_std},
+		{"json", yajl_input_auto, make_json}
+	};
+
+	yajl_gen results = yajl_gen_alloc(nullptr);
+	yajl_gen_config(results, yajl_gen_beautify, 1);
+	yajl_gen_config(results, yajl_gen_fast_numbers, 1);
+	yajl_gen_map_open(results);
+	gen_integer(results, "iterations", (size_t) iterations);
+	yajl_gen_string(results, (const unsigned char *) "corpora", 7);
+	yajl_gen_array_open(results);
+
+	bool ok = true;
+	for (const auto &corpus: corpora)
+		ok = run_corpus(results, corpus.name, corpus.input, corpus.make(target), dir, iterations, keep) && ok;
+
+	yajl_gen_array_close(results);
+	yajl_gen_map_close(results);
+
+	const unsigned char *buf;
+	size_t size;
+	yajl_gen_get_buf(results, &buf, &size);
+
+	FILE *f = resultPath ? fopen(resultPath, "wb") : stdout;
+	if (f == nullptr)
+	{
+		perror(resultPath);
+		ok = false;
+	}
+	else
+	{
+		fwrite(buf, 1, size, f);
+		if (f != stdout)
+			fclose(f);
+	}
+
+	yajl_gen_free(results);
+	return ok ? 0 : 1;
+}
@@ -23,358 +23,607 @@
 #define _CRT_SECURE_NO_DEPRECATE
 #endif
 
-#include <cstdint>
+#include <cerrno>
+#include <climits>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
-#include <list>
-#include <unordered_map>
-#include <stack>
+#include <algorithm>
+#include <atomic>
 #include <string>
+#include <thread>
 #include <vector>
 
 #ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
 #include <fcntl.h>
 #include <io.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
 #endif
 
-#include "JSonParser/api/yajl_gen.h"
-#include "JSonParser/api/yajl_parse.h"
-
-enum json_type {
-	json_type_null,
-	json_type_boolean,
-	json_type_integer,
-	json_type_real,
-	json_type_string,
-	json_type_map,
-	json_type_array
+#include "rjson.h"
+
+struct batch_job
+{
+	std::string input;
+	std::string output;
 };
 
-struct json_data
+static bool is_directory(const char *path)
 {
-	json_type type;
-
-	union {
-		bool boolean;
-		int64_t integer;
-		double real;
-		std::string string;
-		std::unordered_map<std::string, json_data> map;
-		std::list<json_data> array;
-	};
+#ifdef _WIN32
+	DWORD attr = GetFileAttributesA(path);
+	return attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
 
-	json_data(json_type t)
-	: type(t)
+// Adds every file below `dir` for in-place conversion. Symbolic links are
+// not followed.
+static bool list_directory(const std::string &dir, std::vector<batch_job> &jobs, std::string &error)
+{
+#ifdef _WIN32
+	WIN32_FIND_DATAA entry;
+	HANDLE find = FindFirstFileA((dir + "\\*").c_str(), &entry);
+	if (find == INVALID_HANDLE_VALUE)
 	{
-		switch (t)
-		{
-			default:
-			case json_type_null:
-				break;
-			case json_type_boolean:
-				boolean = false;
-				break;
-			case json_type_integer:
-				integer = 0;
-				break;
-			case json_type_real:
-				real = 0.0;
-				break;
-			case json_type_string:
-				new (&string) std::string();
-				break;
-			case json_type_map:
-				new (&map) std::unordered_map<std::string, json_data>();
-				break;
-			case json_type_array:
-				new (&array) std::list<json_data>();
-				break;
-		}
+		error = dir + ": cannot list directory";
+		return false;
 	}
-	json_data(bool b)
-	: type(json_type_boolean)
-	, boolean(b)
-	{ }
-	json_data(int64_t i)
-	: type(json_type_integer)
-	, integer(i)
-	{ }
-	json_data(double r)
-	: type(json_type_real)
-	, real(r)
-	{ }
-	json_data(const char *str, size_t size)
-	: type(json_type_string)
+
+	bool result = true;
+	do
+	{
+		if (strcmp(entry.cFileName, ".") == 0 || strcmp(entry.cFileName, "..") == 0)
+			continue;
+		if (entry.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+			continue;
+
+		std::string path = dir + "\\" + entry.cFileName;
+		if (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			result = list_directory(path, jobs, error);
+		else
+			jobs.push_back({path, path});
+	} while (result && FindNextFileA(find, &entry));
+
+	FindClose(find);
+	return result;
+#else
+	DIR *d = opendir(dir.c_str());
+	if (d == nullptr)
 	{
-		new (&string) std::string(str, size);
+		error = dir + ": " + strerror(errno);
+		return false;
 	}
-	~json_data() {
-		switch (type)
-		{
-			default:
-			case json_type_null:
-			case json_type_boolean:
-			case json_type_integer:
-			case json_type_real:
-				break;
-			case json_type_string:
-				string.~basic_string();
-				break;
-			case json_type_map:
-				map.~unordered_map();
-				break;
-			case json_type_array:
-				array.~list();
-				break;
-		}
+
+	bool result = true;
+	while (result)
+	{
+		struct dirent *entry = readdir(d);
+		if (entry == nullptr)
+			break;
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		std::string path = dir + "/" + entry->d_name;
+		struct stat st;
+		if (lstat(path.c_str(), &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode))
+			result = list_directory(path, jobs, error);
+		else if (S_ISREG(st.st_mode))
+			jobs.push_back({path, path});
 	}
-};
 
-struct json_data_state
+	closedir(d);
+	return result;
+#endif
+}
+
+// Reads one "input" or "input<TAB>output" pair per line.
+static bool read_batch_list(const char *path, std::vector<batch_job> &jobs, std::string &error)
 {
-	std::stack<json_data*> stack;
-	std::string tempKey;
-	json_data *root;
+	FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (f == nullptr)
+	{
+		error = std::string(path) + ": " + strerror(errno);
+		return false;
+	}
 
-	template<class... Args>
-	json_data *insert(Args&&... args)
+	std::string line;
+	bool result = true;
+	for (int c; result; )
 	{
-		if (root == nullptr)
+		c = fgetc(f);
+		if (c != '\n' && c != EOF)
 		{
-			root = new json_data(std::forward<Args>(args)...);
-			return root;
+			line += (char) c;
+			continue;
 		}
-		else if (stack.empty())
-			return nullptr;
-			
-		json_data *current = stack.top();
-		if (current->type == json_type_array)
-		{
-			current->array.emplace_back(std::forward<Args>(args)...);
-			return &current->array.back();
-		}
-		else if (current->type == json_type_map)
+
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+
+		if (!line.empty())
 		{
-			//current->map.emplace(tempKey, std::forward<Args>(args)...);
-			current->map.emplace(
-				std::piecewise_construct,
-				std::forward_as_tuple(tempKey),
-				std::forward_as_tuple(args...)
-			);
-			return &current->map.at(tempKey);
+			size_t tab = line.find('\t');
+			batch_job job;
+			job.input = line.substr(0, tab);
+			job.output = tab == std::string::npos ? job.input : line.substr(tab + 1);
+
+			if (job.input == "-" || job.output == "-")
+			{
+				error = std::string(path) + ": stdin and stdout can't be used in batch mode";
+				result = false;
+			}
+			else
+				jobs.push_back(job);
 		}
 
-		return nullptr;
+		line.clear();
+		if (c == EOF)
+			break;
 	}
+
+	if (result && ferror(f))
+	{
+		error = std::string(path) + ": " + strerror(errno);
+		result = false;
+	}
+
+	if (f != stdin)
+		fclose(f);
+
+	return result;
+}
+
+// How converters allocate, from the command line.
+struct memory_options
+{
+	bool pooled;
+	// In bytes, 0 for no limit.
+	size_t limit;
+	// Print the memory use of every conversion.
+	bool stats;
+	// Print a JSON line of statistics for every conversion.
+	bool conversionStats;
 };
 
-static yajl_gen_status generate_json(yajl_gen gen, const json_data *root)
+static void print_memory(const char *input, const converter &conv)
 {
-	yajl_gen_status status;
+	const json_allocator &memory = conv.allocator();
+	fprintf(stderr, "%s: %zu KiB peak, %zu allocations\n", input, (memory.peak() + 1023) / 1024, memory.allocations());
+}
 
-	switch (root->type)
-	{
-		default:
-		case json_type_null:
-			return yajl_gen_null(gen);
-		case json_type_boolean:
-			return yajl_gen_bool(gen, (int) root->boolean);
-		case json_type_integer:
-			return yajl_gen_integer(gen, root->integer);
-		case json_type_real:
-			return yajl_gen_double(gen, root->real);
-		case json_type_string:
-			return yajl_gen_string(gen, (const unsigned char *) root->string.data(), root->string.length());
-		case json_type_map:
-			status = yajl_gen_map_open(gen);
-			if (status != yajl_gen_status_ok)
-				return status;
-
-			for (const auto &item: root->map)
-			{
-				status = yajl_gen_string(gen, (const unsigned char *) item.first.data(), item.first.length());
-				if (status != yajl_gen_status_ok)
-					return status;
+static void gen_string(yajl_gen gen, const char *str)
+{
+	yajl_gen_string(gen, (const unsigned char *) str, strlen(str));
+}
 
-				status = generate_json(gen, &item.second);
-				if (status != yajl_gen_status_ok)
-					return status;
-			}
+static void gen_size(yajl_gen gen, const char *key, size_t value)
+{
+	gen_string(gen, key);
+	yajl_gen_integer(gen, (long long) value);
+}
 
-			return yajl_gen_map_close(gen);
-		case json_type_array:
-			status = yajl_gen_array_open(gen);
-			if (status != yajl_gen_status_ok)
-				return status;
+static void gen_real(yajl_gen gen, const char *key, double value)
+{
+	gen_string(gen, key);
+	yajl_gen_double(gen, value);
+}
 
-			for (const auto &item: root->array)
+// Prints the statistics of the last conversion as one line of JSON, in a
+// single write so that the lines of a --batch don't mix.
+static void print_stats(const char *input, const char *output, bool ok, const converter &conv)
+{
+	static const char *const eventNames[conversion_stats::event_count] = {
+		"null", "boolean", "integer", "double", "string", "key", "map", "array", "integer_run", "boolean_run"
+	};
+	const conversion_stats &stats = conv.statistics();
+	const json_allocator &memory = conv.allocator();
+
+	yajl_gen gen = yajl_gen_alloc(nullptr);
+	yajl_gen_config(gen, yajl_gen_fast_numbers, 1);
+	yajl_gen_map_open(gen);
+	gen_string(gen, "input");
+	gen_string(gen, input);
+	gen_string(gen, "output");
+	gen_string(gen, output);
+	gen_string(gen, "ok");
+	yajl_gen_bool(gen, ok);
+	gen_size(gen, "bytes_in", stats.bytesIn);
+	gen_size(gen, "bytes_out", stats.bytesOut);
+
+	gen_string(gen, "seconds");
+	yajl_gen_map_open(gen);
+	gen_real(gen, "read", stats.read);
+	gen_real(gen, "parse", stats.parse);
+	gen_real(gen, "encode", stats.encode);
+	gen_real(gen, "generate", stats.generate);
+	gen_real(gen, "write", stats.write);
+	gen_real(gen, "total", stats.total);
+	yajl_gen_map_close(gen);
+
+	gen_string(gen, "events");
+	yajl_gen_map_open(gen);
+	for (int i = 0; i < conversion_stats::event_count; i++)
+		gen_size(gen, eventNames[i], stats.events[i]);
+	yajl_gen_map_close(gen);
+	gen_size(gen, "run_values", stats.runValues);
+
+	gen_string(gen, "pool");
+	yajl_gen_map_open(gen);
+	gen_size(gen, "references", stats.poolReferences);
+	gen_size(gen, "hits", stats.poolHits);
+	gen_real(gen, "hit_rate", stats.poolReferences ? (double) stats.poolHits / stats.poolReferences : 0.0);
+	yajl_gen_map_close(gen);
+
+	gen_string(gen, "memory");
+	yajl_gen_map_open(gen);
+	gen_size(gen, "peak", memory.peak());
+	gen_size(gen, "allocations", memory.allocations());
+	yajl_gen_map_close(gen);
+	yajl_gen_map_close(gen);
+
+	const unsigned char *buf;
+	size_t len;
+	yajl_gen_get_buf(gen, &buf, &len);
+	std::string line((const char *) buf, len);
+	line += '\n';
+	fwrite(line.data(), 1, line.size(), stderr);
+	yajl_gen_free(gen);
+}
+
+// Converts all jobs with `workers` threads, each with its own converter.
+static bool run_batch(const std::vector<batch_job> &jobs, converter_options options, unsigned int workers, const memory_options &memory)
+{
+	std::atomic<size_t> next(0);
+	std::atomic<bool> ok(true);
+
+	auto work = [&]()
+	{
+		converter conv(options);
+		std::string error;
+
+		for (size_t i; (i = next++) < jobs.size();)
+		{
+			bool converted = conv.convert(jobs[i].input.c_str(), jobs[i].output.c_str(), error);
+			if (!converted)
 			{
-				status = generate_json(gen, &item);
-				if (status != yajl_gen_status_ok)
-					return status;
+				fprintf(stderr, "%s\n", error.c_str());
+				ok = false;
 			}
 
-			return yajl_gen_array_close(gen);
-	}
+			if (memory.stats)
+				print_memory(jobs[i].input.c_str(), conv);
+			if (memory.conversionStats)
+				print_stats(jobs[i].input.c_str(), jobs[i].output.c_str(), converted, conv);
+		}
+	};
+
+	options.threads = 1;
+	workers = (unsigned int) std::min<size_t>(workers, jobs.size());
+	std::vector<std::thread> threads;
+	for (unsigned int i = 1; i < workers; i++)
+		threads.emplace_back(work);
+
+	work();
+	for (std::thread &t: threads)
+		t.join();
+
+	return ok;
+}
+
+static bool is_option(const char *arg, const char *shortName, const char *longName)
+{
+	return strcmp(arg, shortName) == 0 || strcmp(arg, longName) == 0;
 }
 
 static void usage(char *arg0)
 {
-	printf("Usage: %s <input> [output=input]\nInput and output can be \"-\" for stdin and stdout respectively\n", arg0);
+	printf(
+		"Usage: %s [options] <input> [output=input]\n"
+		"       %s [options] -b <list|directory>\n"
+		"       %s [options] -g <pointer> <input> [output=-]\n"
+		"       %s [options] -r\n"
+		"Input and output can be \"-\" for stdin and stdout respectively\n"
+		"\n"
+		"Options:\n"
+		"  -s, --stream        Write the output while parsing instead of building\n"
+		"                      the whole document in memory first.\n"
+		"  -b, --batch <list>  Convert many files in one run. <list> has one\n"
+		"                      \"input[<TAB>output]\" pair per line (\"-\" reads it\n"
+		"                      from stdin), or is a directory whose files are all\n"
+		"                      converted in-place.\n"
+		"  -j, --jobs <n>      Threads used by --batch, or to generate the output of\n"
+		"                      a large document (default: CPU count).\n"
+		"  -e, --encode        Write binary JSON instead of JSON text. Implies\n"
+		"                      building the whole document in memory.\n"
+		"  -c, --compact       Write JSON text without any whitespace.\n"
+		"  -t, --tee <output>  Also write the document to <output>, as binary JSON\n"
+		"                      when prefixed with \"bjson:\" or as compact JSON\n"
+		"                      with \"compact:\". Can be repeated; the input is\n"
+		"                      parsed only once for all outputs.\n"
+		"  -g, --get <pointer> Only write the value at a JSON pointer such as\n"
+		"                      \"/key/0\". Binary JSON is searched without being\n"
+		"                      decoded, other formats are parsed first.\n"
+		"  -p, --project <pattern>\n"
+		"                      Only keep the values a JSONPath-like pattern such as\n"
+		"                      \"$.units[*].skill\" finds, and the objects and arrays\n"
+		"                      they are in. Without the \"$\" it is looked for at\n"
+		"                      any depth, so \"unit_id\" keeps every unit_id. Can be\n"
+		"                      repeated. Binary JSON and MessagePack skip the rest\n"
+		"                      without decoding it.\n"
+		"  -r, --serve         Convert length-prefixed requests from stdin until it\n"
+		"                      ends, writing a response for each to stdout. See\n"
+		"                      serve() in rjson.h for the format.\n"
+		"  -i, --input <format>\n"
+		"                      Read the input as \"json\", \"bjson\", \"msgpack\" (as\n"
+		"                      specified, with bin and ext) or \"msgpack-ext\" (the\n"
+		"                      dialect with RLE records). \"auto\" (default) tells\n"
+		"                      them apart by the first byte, and only finds the\n"
+		"                      dialect's array or map roots.\n"
+		"  -u, --utf8 <policy> Which input strings must be valid UTF-8: \"text\"\n"
+		"                      (default) checks JSON text, \"all\" binary JSON and\n"
+		"                      MessagePack as well, \"trusted\" none.\n"
+		"  -D, --max-depth <n> Deepest nesting of objects and arrays accepted\n"
+		"                      (default: 128).\n"
+		"  -a, --allocator <name>\n"
+		"                      \"malloc\" (default), or \"pool\" to keep freed memory\n"
+		"                      around for the next conversion of a --batch.\n"
+		"  -m, --memory-limit <MiB>\n"
+		"                      Fail conversions that need more memory than that.\n"
+		"  -M, --memory-stats  Print the peak memory use and allocation count of\n"
+		"                      every conversion to stderr.\n"
+		"  -S, --stats         Print a line of JSON to stderr for every conversion,\n"
+		"                      with the time spent in each stage, the parser events,\n"
+		"                      constant pool hits and memory use. Binary JSON input\n"
+		"                      is then always parsed on one thread.\n",
+		arg0, arg0, arg0, arg0
+	);
 }
 
 int main(int argc, char *argv[])
 {
-	if (argc < 2)
+	converter_options options;
+	bool compact = false;
+	bool serving = false;
+	const char *batch = nullptr;
+	const char *pointer = nullptr;
+	std::vector<converter_output> tees;
+	unsigned int jobs = std::thread::hardware_concurrency();
+	memory_options memory = {false, 0, false, false};
+	int argi = 1;
+
+	for (; argi < argc && argv[argi][0] == '-' && argv[argi][1] != 0; argi++)
 	{
-		usage(argv[0]);
-		return 1;
+		const char *arg = argv[argi];
+
+		if (is_option(arg, "-s", "--stream"))
+			options.streaming = true;
+		else if (is_option(arg, "-e", "--encode"))
+			options.format = output_bjson;
+		else if (is_option(arg, "-c", "--compact"))
+			compact = true;
+		else if (is_option(arg, "-r", "--serve"))
+			serving = true;
+		else if (is_option(arg, "-M", "--memory-stats"))
+			memory.stats = true;
+		else if (is_option(arg, "-S", "--stats"))
+			memory.conversionStats = true;
+		else if (is_option(arg, "-b", "--batch") || is_option(arg, "-j", "--jobs") || is_option(arg, "-g", "--get") || is_option(arg, "-p", "--project") || is_option(arg, "-t", "--tee") || is_option(arg, "-a", "--allocator") || is_option(arg, "-m", "--memory-limit") || is_option(arg, "-u", "--utf8") || is_option(arg, "-D", "--max-depth") || is_option(arg, "-i", "--input"))
+		{
+			if (argi + 1 >= argc)
+			{
+				fprintf(stderr, "%s: missing argument\n", arg);
+				usage(argv[0]);
+				return 1;
+			}
+
+			const char *value = argv[++argi];
+			if (is_option(arg, "-b", "--batch"))
+				batch = value;
+			else if (is_option(arg, "-g", "--get"))
+				pointer = value;
+			else if (is_option(arg, "-p", "--project"))
+			{
+				std::string error;
+				if (!options.project.add(value, error))
+				{
+					fprintf(stderr, "%s\n", error.c_str());
+					return 1;
+				}
+			}
+			else if (is_option(arg, "-t", "--tee"))
+			{
+				if (strncmp(value, "bjson:", 6) == 0)
+					tees.push_back({value + 6, output_bjson});
+				else if (strncmp(value, "compact:", 8) == 0)
+					tees.push_back({value + 8, output_compact_json});
+				else
+					tees.push_back({value, output_json});
+			}
+			else if (is_option(arg, "-a", "--allocator"))
+			{
+				if (strcmp(value, "pool") != 0 && strcmp(value, "malloc") != 0)
+				{
+					fprintf(stderr, "%s: unknown allocator\n", value);
+					return 1;
+				}
+
+				memory.pooled = strcmp(value, "pool") == 0;
+			}
+			else if (is_option(arg, "-u", "--utf8"))
+			{
+				if (strcmp(value, "text") == 0)
+					options.utf8 = utf8_text;
+				else if (strcmp(value, "all") == 0)
+					options.utf8 = utf8_all;
+				else if (strcmp(value, "trusted") == 0)
+					options.utf8 = utf8_trusted;
+				else
+				{
+					fprintf(stderr, "%s: unknown UTF-8 policy\n", value);
+					return 1;
+				}
+			}
+			else if (is_option(arg, "-i", "--input"))
+			{
+				if (strcmp(value, "auto") == 0)
+					options.input = yajl_input_auto;
+				else if (strcmp(value, "json") == 0)
+					options.input = yajl_input_json;
+				else if (strcmp(value, "bjson") == 0)
+					options.input = yajl_input_bjson;
+				else if (strcmp(value, "msgpack") == 0)
+					options.input = yajl_input_msgpack;
+				else if (strcmp(value, "msgpack-ext") == 0)
+					options.input = yajl_input_msgpack_ext;
+				else
+				{
+					fprintf(stderr, "%s: unknown input format\n", value);
+					return 1;
+				}
+			}
+			else if (is_option(arg, "-D", "--max-depth"))
+			{
+				char *end;
+				unsigned long n = strtoul(value, &end, 10);
+				if (*end != 0 || n == 0 || n > UINT_MAX - 1)
+				{
+					fprintf(stderr, "%s: invalid depth\n", value);
+					return 1;
+				}
+
+				options.maxDepth = (unsigned int) n;
+			}
+			else if (is_option(arg, "-m", "--memory-limit"))
+			{
+				char *end;
+				unsigned long long n = strtoull(value, &end, 10);
+				if (*end != 0 || n == 0 || n > SIZE_MAX / (1024 * 1024))
+				{
+					fprintf(stderr, "%s: invalid memory limit\n", value);
+					return 1;
+				}
+
+				memory.limit = (size_t) n * 1024 * 1024;
+			}
+			else
+			{
+				char *end;
+				unsigned long n = strtoul(value, &end, 10);
+				if (*end != 0 || n == 0 || n > 1024)
+				{
+					fprintf(stderr, "%s: invalid job count\n", value);
+					return 1;
+				}
+
+				jobs = (unsigned int) n;
+			}
+		}
+		else if (strcmp(arg, "--") == 0)
+		{
+			argi++;
+			break;
+		}
+		else
+		{
+			fprintf(stderr, "%s: unknown option\n", arg);
+			usage(argv[0]);
+			return 1;
+		}
 	}
 
-#ifdef _WIN32
-	_setmode(fileno(stdin), O_BINARY);
-#endif
+	if (compact && options.format == output_json)
+		options.format = output_compact_json;
 
-	FILE *f = strcmp(argv[1], "-") == 0 ? stdin : fopen(argv[1], "rb");
-	if (f == nullptr)
+	options.threads = std::max(jobs, 1U);
+	options.pooled = memory.pooled;
+	options.memoryLimit = memory.limit;
+	options.collectStats = memory.conversionStats;
+
+	bool invalid;
+	if (serving)
+		invalid = batch || argi < argc || pointer || !tees.empty();
+	else if (batch)
+		invalid = argi < argc || pointer || !tees.empty();
+	else
+		invalid = argi >= argc || (pointer && !tees.empty());
+
+	if (invalid)
 	{
-		perror(argv[1]);
+		usage(argv[0]);
 		return 1;
 	}
 
-	static yajl_callbacks reader_cb = {
-		// read null
-		[](void *ctx)
-		{
-			json_data_state *state = (json_data_state *) ctx;
-			return (int) (state->insert(json_type_null) != nullptr);
-		},
-		// read boolean
-		[](void *ctx, int boolean)
-		{
-			json_data_state *state = (json_data_state *) ctx;
-			return (int) (state->insert((bool) boolean) != nullptr);
-		},
-		// read integer
-		[](void *ctx, long long integer)
-		{
-			json_data_state *state = (json_data_state *) ctx;
-			return (int) (state->insert((int64_t) integer) != nullptr);
-		},
-		// read double
-        [](void *ctx, double real)
-		{
-			json_data_state *state = (json_data_state *) ctx;
-			return (int) (state->insert(real) != nullptr);
-		},
-        nullptr,
-		// read string
-        [](void *ctx, const unsigned char *stringVal, size_t stringLen, int cte_pool)
-		{
-			json_data_state *state = (json_data_state *) ctx;
-			return (int) (state->insert((const char *) stringVal, stringLen) != nullptr);
-		},
-		// start map
-        [](void *ctx, unsigned int size)
-		{
-			json_data_state *state = (json_data_state *) ctx;
-			json_data *jdata = state->insert(json_type_map);
+#ifdef _WIN32
+	_setmode(fileno(stdin), O_BINARY);
+	_setmode(fileno(stdout), O_BINARY);
+#endif
 
-			if (jdata == nullptr)
-				return 0;
-			
-			state->stack.push(jdata);
-			return 1;
-		},
-		// map key
-        [](void *ctx, const unsigned char * key, size_t stringLen, int cte_pool)
-		{
-			json_data_state *state = (json_data_state *) ctx;
-			state->tempKey = std::string((const char *) key, stringLen);
-			return 1;
-		},
-		// end map
-        [](void *ctx)
-		{
-			json_data_state *state = (json_data_state *) ctx;
-			state->stack.pop();
-			return 1;
-		},
-		// start array
-        [](void *ctx, unsigned int size)
-		{
-			json_data_state *state = (json_data_state *) ctx;
-			json_data *jdata = state->insert(json_type_array);
+	std::string error;
 
-			if (jdata == nullptr)
-				return 0;
-			
-			state->stack.push(jdata);
-			return 1;
-		},
-		// end array
-        [](void *ctx)
+	if (batch)
+	{
+		std::vector<batch_job> list;
+		bool listed;
+		if (is_directory(batch))
+			listed = list_directory(batch, list, error);
+		else
+			listed = read_batch_list(batch, list, error);
+
+		if (!listed)
 		{
-			json_data_state *state = (json_data_state *) ctx;
-			state->stack.pop();
+			fprintf(stderr, "%s\n", error.c_str());
 			return 1;
 		}
-	};
-
-	json_data_state state = {{}, "", nullptr};
-	yajl_handle hand = yajl_alloc(&reader_cb, nullptr, &state);
-	yajl_config(hand, yajl_allow_comments, 1); 
-
-	constexpr size_t READ_BUFSIZE = 4096;
-	std::vector<unsigned char> buf(READ_BUFSIZE);
-	size_t readed = READ_BUFSIZE;
-	size_t fullSize = 0;
-	yajl_status status = yajl_status_ok;
 
-	while (readed == READ_BUFSIZE)
-	{
-		readed = fread(buf.data() + fullSize, 1, READ_BUFSIZE, f);
-		fullSize += readed;
-		buf.resize(buf.capacity() + READ_BUFSIZE);
+		return run_batch(list, options, options.threads, memory) ? 0 : 1;
 	}
 
-	if (f != stdin)
-    	fclose(f);
-
-	yajl_parse(hand, buf.data(), fullSize);
-	status = yajl_complete_parse(hand);
-	if (status != yajl_status_ok)
+	if (serving)
 	{
-		unsigned char *str = yajl_get_error(hand, 1, buf.data(), readed);  
-        fprintf(stderr, "%s: %s\n", argv[1], (const char *) str);  
-        yajl_free_error(hand, str);  
-		yajl_free(hand);
-		return 1;
+		// Every request picks its own output format.
+		converter conv(options);
+		if (!serve(conv, stdin, stdout, error))
+		{
+			fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+
+		return 0;
 	}
 
-	yajl_free(hand);
+	const char *input = argv[argi];
+	const char *output = argi + 1 < argc ? argv[argi + 1] : pointer ? "-" : input;
 
-	const char *output = argc < 3 ? argv[1] : argv[2];
-	f = strcmp(output, "-") == 0 ? stdout : fopen(output, "wb");
-	if (f == NULL)
+	converter conv(options);
+	bool ok;
+	if (pointer)
+		ok = conv.extract(input, pointer, output, error);
+	else if (!tees.empty())
 	{
-		perror(argv[2]);
-		return 1;
+		tees.insert(tees.begin(), {output, options.format});
+		ok = conv.convert(input, tees, error);
 	}
+	else
+		ok = conv.convert(input, output, error);
+	if (!ok)
+		fprintf(stderr, "%s\n", error.c_str());
 
-	yajl_gen gen = yajl_gen_alloc(nullptr);
-	yajl_gen_config(gen, yajl_gen_beautify, 1);
-	generate_json(gen, state.root);
-
-	const unsigned char *genbuf;
-	size_t gensize;
-	yajl_gen_get_buf(gen, &genbuf, &gensize);
-	fwrite(genbuf, 1, gensize, f);
-	yajl_gen_free(gen);
-
-	if (f != stdout)
-		fclose(f);
+	if (memory.stats)
+		print_memory(input, conv);
+	if (memory.conversionStats)
+		print_stats(input, output, ok, conv);
 
-	return 0;
+	return ok ? 0 : 1;
 }
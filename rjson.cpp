@@ -0,0 +1,3253 @@
+// Copyright (c) 2023 Dark Energy Processor
+//
+// Permission is hereby granted, free of charge, to any person obtaining a 
+// copy of this software and associated documentation files (the "Software"), 
+// to deal in the Software without restriction, including without limitation 
+// the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+// and/or sell copies of the Software, and to permit persons to whom the 
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in 
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+// DEALINGS IN THE SOFTWARE.
+
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_DEPRECATE
+#endif
+
+#include <cerrno>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include "rjson.h"
+
+json_allocator::json_allocator(bool pooled, size_t limit)
+: pooled(pooled)
+, limit(limit)
+, current(0)
+, highest(0)
+, count(0)
+, over(false)
+{
+	yajlFuncs.malloc = [](void *ctx, size_t size)
+	{
+		return ((json_allocator *) ctx)->allocate(size);
+	};
+	yajlFuncs.realloc = [](void *ctx, void *ptr, size_t size)
+	{
+		return ((json_allocator *) ctx)->reallocate(ptr, size);
+	};
+	yajlFuncs.free = [](void *ctx, void *ptr)
+	{
+		((json_allocator *) ctx)->release(ptr);
+	};
+	yajlFuncs.ctx = this;
+
+	std::fill_n(freeLists, POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1, nullptr);
+}
+
+json_allocator::~json_allocator()
+{
+	for (header *list: freeLists)
+	{
+		while (list)
+		{
+			header *next = *(header **) (list + 1);
+			free(list);
+			list = next;
+		}
+	}
+}
+
+void *json_allocator::allocate(size_t size)
+{
+	size_t capacity = size;
+	header *h = nullptr;
+
+	if (pooled && is_pooled(size))
+	{
+		unsigned int c = size_class(size);
+		capacity = ((size_t) 1 << (c + POOL_MIN_SHIFT)) - sizeof(header);
+		std::lock_guard<std::mutex> guard(lock);
+		if ((h = freeLists[c]) != nullptr)
+			freeLists[c] = *(header **) (h + 1);
+	}
+
+	if (h == nullptr && (h = (header *) malloc(sizeof(header) + capacity)) == nullptr)
+		return nullptr;
+
+	h->size = capacity;
+	count.fetch_add(1, std::memory_order_relaxed);
+	account(capacity, 0);
+	return h + 1;
+}
+
+void *json_allocator::reallocate(void *ptr, size_t size)
+{
+	if (ptr == nullptr)
+		return allocate(size);
+
+	header *h = (header *) ptr - 1;
+	size_t old = h->size;
+
+	if (pooled && size <= old)
+		return ptr;
+
+	if (pooled && (is_pooled(old) || is_pooled(size)))
+	{
+		// Moves between size classes.
+		void *result = allocate(size);
+		if (result != nullptr)
+		{
+			memcpy(result, ptr, std::min(old, size));
+			release(ptr);
+		}
+
+		return result;
+	}
+
+	h = (header *) realloc(h, sizeof(header) + size);
+	if (h == nullptr)
+		return nullptr;
+
+	h->size = size;
+	count.fetch_add(1, std::memory_order_relaxed);
+	account(size, old);
+	return h + 1;
+}
+
+void json_allocator::release(void *ptr)
+{
+	if (ptr == nullptr)
+		return;
+
+	header *h = (header *) ptr - 1;
+	account(0, h->size);
+
+	if (pooled && is_pooled(h->size))
+	{
+		unsigned int c = size_class(h->size);
+		std::lock_guard<std::mutex> guard(lock);
+		*(header **) (h + 1) = freeLists[c];
+		freeLists[c] = h;
+	}
+	else
+		free(h);
+}
+
+void json_allocator::begin()
+{
+	size_t now = current.load(std::memory_order_relaxed);
+	highest.store(now, std::memory_order_relaxed);
+	count.store(0, std::memory_order_relaxed);
+	over.store(limit != 0 && now > limit, std::memory_order_relaxed);
+}
+
+void json_allocator::account(size_t added, size_t removed)
+{
+	size_t now = current.fetch_add(added - removed, std::memory_order_relaxed) + added - removed;
+	size_t top = highest.load(std::memory_order_relaxed);
+	while (now > top && !highest.compare_exchange_weak(top, now, std::memory_order_relaxed))
+		;
+
+	if (limit != 0 && now > limit)
+		over.store(true, std::memory_order_relaxed);
+}
+
+yajl_gen_status generate_json(yajl_gen gen, const json_data *root)
+{
+	// Open containers and their next child, instead of recursing, so that
+	// deep documents can't run out of stack.
+	struct frame
+	{
+		const json_data *node;
+		size_t next;
+	};
+	std::vector<frame> stack;
+	const json_data *node = root;
+	yajl_gen_status status;
+
+	for (;;)
+	{
+		switch (node->type)
+		{
+			default:
+			case json_type_null:
+				status = yajl_gen_null(gen);
+				break;
+			case json_type_boolean:
+				status = yajl_gen_bool(gen, (int) node->boolean);
+				break;
+			case json_type_integer:
+				status = yajl_gen_integer(gen, node->integer);
+				break;
+			case json_type_real:
+				status = yajl_gen_double(gen, node->real);
+				break;
+			case json_type_string:
+				status = yajl_gen_string(gen, (const unsigned char *) node->string.data, node->string.length);
+				break;
+			case json_type_map:
+				status = yajl_gen_map_open(gen);
+				stack.push_back({node, 0});
+				break;
+			case json_type_array:
+				status = yajl_gen_array_open(gen);
+				stack.push_back({node, 0});
+				break;
+		}
+
+		if (status != yajl_gen_status_ok)
+			return status;
+
+		// Close the containers that are done until one has another child.
+		for (node = nullptr; node == nullptr;)
+		{
+			if (stack.empty())
+				return yajl_gen_status_ok;
+
+			frame &top = stack.back();
+			if (top.node->type == json_type_map && top.next < top.node->map.count)
+			{
+				const json_member &item = top.node->map.items[top.next++];
+				status = yajl_gen_string(gen, (const unsigned char *) item.key.data, item.key.length);
+				node = &item.value;
+			}
+			else if (top.node->type == json_type_array && top.next < top.node->array.count)
+				node = &top.node->array.items[top.next++];
+			else
+			{
+				status = top.node->type == json_type_map ? yajl_gen_map_close(gen) : yajl_gen_array_close(gen);
+				stack.pop_back();
+			}
+
+			if (status != yajl_gen_status_ok)
+				return status;
+		}
+	}
+}
+
+yajl_gen_status generate_json_parallel(yajl_gen gen, const json_data *root, unsigned int threads, const yajl_alloc_funcs *alloc)
+{
+	bool isMap = root->type == json_type_map;
+	size_t count = isMap ? root->map.count : root->type == json_type_array ? root->array.count : 0;
+	if (threads < 2 || count < 2)
+		return generate_json(gen, root);
+
+	yajl_gen_status status = isMap ? yajl_gen_map_open(gen) : yajl_gen_array_open(gen);
+	if (status != yajl_gen_status_ok)
+		return status;
+
+	// The workers start from a copy of the state inside the root, as `gen`
+	// is written to while they run.
+	yajl_gen start = yajl_gen_alloc(alloc);
+	yajl_gen_continue(start, gen, 0);
+
+	// Several chunks per thread, so that one slow chunk doesn't leave the
+	// other threads idle for long.
+	struct chunk
+	{
+		yajl_gen gen;
+		yajl_gen_status status;
+		bool done;
+	};
+
+	size_t chunkCount = std::min<size_t>(count, (size_t) threads * 8);
+	std::vector<chunk> chunks(chunkCount, {nullptr, yajl_gen_status_ok, false});
+	std::mutex mutex;
+	std::condition_variable changed;
+	size_t next = 0, written = 0;
+	// Generated chunks wait in memory until written, but at most this many.
+	size_t window = (size_t) threads * 2;
+
+	auto work = [&]()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		for (;;)
+		{
+			changed.wait(lock, [&]() { return next >= chunkCount || next < written + window; });
+			if (next >= chunkCount)
+				return;
+
+			size_t i = next++;
+			lock.unlock();
+
+			// `start` is only read while the workers run.
+			yajl_gen g = yajl_gen_alloc(alloc);
+			yajl_gen_continue(g, start, i > 0);
+
+			yajl_gen_status s = yajl_gen_status_ok;
+			for (size_t c = count * i / chunkCount; c < count * (i + 1) / chunkCount && s == yajl_gen_status_ok; c++)
+			{
+				if (isMap)
+				{
+					const json_member &item = root->map.items[c];
+					s = yajl_gen_string(g, (const unsigned char *) item.key.data, item.key.length);
+					if (s == yajl_gen_status_ok)
+						s = generate_json(g, &item.value);
+				}
+				else
+					s = generate_json(g, &root->array.items[c]);
+			}
+
+			lock.lock();
+			chunks[i] = {g, s, true};
+			changed.notify_all();
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned int t = 0; t < threads; t++)
+		workers.emplace_back(work);
+
+	// Write the chunks in order as they complete.
+	yajl_gen last = nullptr;
+	std::unique_lock<std::mutex> lock(mutex);
+	while (written < chunkCount)
+	{
+		changed.wait(lock, [&]() { return chunks[written].done; });
+		chunk c = chunks[written];
+		lock.unlock();
+
+		if (status == yajl_gen_status_ok && (status = c.status) == yajl_gen_status_ok)
+		{
+			const unsigned char *buf;
+			size_t len;
+			yajl_gen_get_buf(c.gen, &buf, &len);
+			yajl_gen_raw(gen, (const char *) buf, len);
+		}
+
+		if (last != nullptr)
+			yajl_gen_free(last);
+		last = c.gen;
+
+		lock.lock();
+		written++;
+		changed.notify_all();
+	}
+
+	lock.unlock();
+	for (std::thread &t: workers)
+		t.join();
+	yajl_gen_free(start);
+
+	// Pick up after the last child, where the last chunk ended.
+	yajl_gen_continue(gen, last, 0);
+	yajl_gen_free(last);
+	if (status != yajl_gen_status_ok)
+		return status;
+
+	return isMap ? yajl_gen_map_close(gen) : yajl_gen_array_close(gen);
+}
+
+// Constant pool of an encoded document, keyed by the string contents.
+struct bjson_pool_entry
+{
+	size_t uses;
+	// Index in the pool, or NOT_POOLED to write the string directly.
+	uint32_t index;
+};
+
+class bjson_encoder
+{
+public:
+	bjson_encoder(std::vector<unsigned char> &out, std::string &error)
+	: out(out)
+	, error(error)
+	{ }
+
+	bool encode(const json_data *root)
+	{
+		count_strings(root);
+
+		// Strings go to the pool in order of first use.
+		uint32_t poolCount = 0;
+		uint64_t poolBytes = 0;
+		for (const json_string &str: order)
+		{
+			bjson_pool_entry &entry = pool[str];
+			if (entry.uses > 1)
+			{
+				if (str.length > MAX_LENGTH || poolCount == MAX_LENGTH)
+					return fail("string too long for binary JSON");
+
+				entry.index = poolCount++;
+				poolBytes += str.length;
+			}
+		}
+
+		u8(0xFF);
+		u8(0xFF);
+		u32(poolCount);
+		u32((uint32_t) std::min<uint64_t>(poolBytes, UINT32_MAX));
+		for (const json_string &str: order)
+		{
+			if (pool[str].index != NOT_POOLED)
+			{
+				u32((uint32_t) str.length);
+				bytes(str.data, str.length);
+			}
+		}
+
+		if (!value(root))
+			return false;
+
+		u8(BJSN_END);
+		return true;
+	}
+
+private:
+	static constexpr uint32_t NOT_POOLED = UINT32_MAX;
+	static constexpr size_t MAX_LENGTH = 0x7FFFFFFF;
+	static constexpr size_t MAX_RUN = 0xFFFF;
+
+	std::vector<unsigned char> &out;
+	std::string &error;
+	std::unordered_map<json_string, bjson_pool_entry, json_string_hash, json_string_equal> pool;
+	std::vector<json_string> order;
+
+	void use(const json_string &str)
+	{
+		bjson_pool_entry &entry = pool[str];
+		if (entry.uses++ == 0)
+		{
+			entry.index = NOT_POOLED;
+			order.push_back(str);
+		}
+	}
+
+	// Both walks over the tree keep the open containers here instead of
+	// recursing, so that deep documents can't run out of stack.
+	struct frame
+	{
+		const json_data *node;
+		size_t next;
+	};
+	std::vector<frame> stack;
+
+	// Counts the strings and keys below `root`, in document order.
+	void count_strings(const json_data *root)
+	{
+		const json_data *node = root;
+
+		for (;;)
+		{
+			if (node->type == json_type_string)
+				use(node->string);
+			else if (node->type == json_type_map || node->type == json_type_array)
+				stack.push_back({node, 0});
+
+			for (node = nullptr; node == nullptr && !stack.empty();)
+			{
+				frame &top = stack.back();
+				if (top.node->type == json_type_map && top.next < top.node->map.count)
+				{
+					const json_member &item = top.node->map.items[top.next++];
+					use(item.key);
+					node = &item.value;
+				}
+				else if (top.node->type == json_type_array && top.next < top.node->array.count)
+					node = &top.node->array.items[top.next++];
+				else
+					stack.pop_back();
+			}
+
+			if (node == nullptr)
+				return;
+		}
+	}
+
+	bool fail(const char *message)
+	{
+		error = message;
+		return false;
+	}
+
+	void u8(unsigned int v)
+	{
+		out.push_back((unsigned char) v);
+	}
+
+	void u16(unsigned int v)
+	{
+		unsigned char b[2] = {(unsigned char) (v >> 8), (unsigned char) v};
+		out.insert(out.end(), b, b + 2);
+	}
+
+	void u32(uint32_t v)
+	{
+		unsigned char b[4] = {(unsigned char) (v >> 24), (unsigned char) (v >> 16), (unsigned char) (v >> 8), (unsigned char) v};
+		out.insert(out.end(), b, b + 4);
+	}
+
+	void u64(uint64_t v)
+	{
+		u32((uint32_t) (v >> 32));
+		u32((uint32_t) v);
+	}
+
+	void bytes(const char *data, size_t len)
+	{
+		out.insert(out.end(), (const unsigned char *) data, (const unsigned char *) data + len);
+	}
+
+	// Writes a string or key, `op` being the pooled opcode and op + 1 the
+	// direct one.
+	bool string(unsigned int op, const json_string &str)
+	{
+		uint32_t index = pool[str].index;
+		if (index != NOT_POOLED)
+		{
+			u8(op);
+			u32(index);
+			return true;
+		}
+
+		if (str.length > MAX_LENGTH)
+			return fail("string too long for binary JSON");
+
+		u8(op + 1);
+		u32((uint32_t) str.length);
+		bytes(str.data, str.length);
+		return true;
+	}
+
+	// Size of the narrowest integer encoding of v: 1, 2, 4 or 8 bytes.
+	static size_t integer_size(int64_t v)
+	{
+		if (v >= INT8_MIN && v <= INT8_MAX)
+			return 1;
+		else if (v >= INT16_MIN && v <= INT16_MAX)
+			return 2;
+		else if (v >= INT32_MIN && v <= INT32_MAX)
+			return 4;
+		else
+			return 8;
+	}
+
+	void integer(int64_t v)
+	{
+		switch (integer_size(v))
+		{
+			case 1:
+				u8(BJSN_NUMBER_I8);
+				u8((unsigned int) v);
+				break;
+			case 2:
+				u8(BJSN_NUMBER_I16);
+				u16((unsigned int) v);
+				break;
+			case 4:
+				u8(BJSN_NUMBER_I32);
+				u32((uint32_t) v);
+				break;
+			default:
+				u8(BJSN_NUMBER_I64);
+				u64((uint64_t) v);
+				break;
+		}
+	}
+
+	void real(double v)
+	{
+		// Use the float form only when it converts back exactly.
+		if (std::fabs(v) <= FLT_MAX && (double) (float) v == v)
+		{
+			float flt = (float) v;
+			uint32_t bits;
+			memcpy(&bits, &flt, sizeof(bits));
+			u8(BJSN_NUMBER_FLT);
+			u32(bits);
+		}
+		else
+		{
+			uint64_t bits;
+			memcpy(&bits, &v, sizeof(bits));
+			u8(BJSN_NUMBER_DBL);
+			u64(bits);
+		}
+	}
+
+	// Writes `count` copies of the integer or boolean `item`, as RLE records
+	// where that's shorter than writing them one by one.
+	void run(const json_data &item, size_t count)
+	{
+		size_t size = item.type == json_type_integer ? integer_size(item.integer) : 0;
+
+		while (count > 0)
+		{
+			size_t n = std::min(count, MAX_RUN);
+			count -= n;
+
+			// Opcode plus value, and the same plus the 16-bit count.
+			if (n * (size + 1) <= size + 3)
+			{
+				while (n--)
+					scalar(&item);
+
+				continue;
+			}
+
+			if (item.type == json_type_boolean)
+				u8(item.boolean ? BJSN_CTE_TRUE_RLE : BJSN_CTE_FALSE_RLE);
+			else
+			{
+				switch (size)
+				{
+					case 1:
+						u8(BJSN_NUMBER_I8_RLE);
+						u8((unsigned int) item.integer);
+						break;
+					case 2:
+						u8(BJSN_NUMBER_I16_RLE);
+						u16((unsigned int) item.integer);
+						break;
+					case 4:
+						u8(BJSN_NUMBER_I32_RLE);
+						u32((uint32_t) item.integer);
+						break;
+					default:
+						u8(BJSN_NUMBER_I64_RLE);
+						u64((uint64_t) item.integer);
+						break;
+				}
+			}
+
+			u16((unsigned int) n);
+		}
+	}
+
+	static bool same_scalar(const json_data &a, const json_data &b)
+	{
+		if (a.type != b.type)
+			return false;
+		else if (a.type == json_type_integer)
+			return a.integer == b.integer;
+		else
+			return a.type == json_type_boolean && a.boolean == b.boolean;
+	}
+
+	// Writes anything but an object or array.
+	bool scalar(const json_data *node)
+	{
+		switch (node->type)
+		{
+			default:
+			case json_type_null:
+				u8(BJSN_CTE_NULL);
+				return true;
+			case json_type_boolean:
+				u8(node->boolean ? BJSN_CTE_TRUE : BJSN_CTE_FALSE);
+				return true;
+			case json_type_integer:
+				integer(node->integer);
+				return true;
+			case json_type_real:
+				real(node->real);
+				return true;
+			case json_type_string:
+				return string(BJSN_STRING, node->string);
+		}
+	}
+
+	bool value(const json_data *root)
+	{
+		const json_data *node = root;
+
+		for (;;)
+		{
+			if (node->type == json_type_map)
+			{
+				if (node->map.count > UINT32_MAX)
+					return fail("object too large for binary JSON");
+
+				u8(BJSN_OPEN_OBJ);
+				u32((uint32_t) node->map.count);
+				stack.push_back({node, 0});
+			}
+			else if (node->type == json_type_array)
+			{
+				if (node->array.count > UINT32_MAX)
+					return fail("array too large for binary JSON");
+
+				u8(BJSN_OPEN_ARR);
+				u32((uint32_t) node->array.count);
+				// Element type mask, which bjson_parse skips.
+				u32(0);
+				stack.push_back({node, 0});
+			}
+			else if (!scalar(node))
+				return false;
+
+			// Close the containers that are done until one has another
+			// child to write.
+			for (node = nullptr; node == nullptr;)
+			{
+				if (stack.empty())
+					return true;
+
+				frame &top = stack.back();
+				if (top.node->type == json_type_map)
+				{
+					if (top.next == top.node->map.count)
+					{
+						u8(BJSN_CLOSE_OBJ);
+						stack.pop_back();
+						continue;
+					}
+
+					const json_member &item = top.node->map.items[top.next++];
+					if (!string(BJSN_MEMBER, item.key))
+						return false;
+
+					node = &item.value;
+					continue;
+				}
+
+				const json_data *items = top.node->array.items;
+				size_t count = top.node->array.count;
+				if (top.next == count)
+				{
+					u8(BJSN_CLOSE_ARR);
+					stack.pop_back();
+					continue;
+				}
+
+				const json_data &item = items[top.next];
+				size_t j = top.next + 1;
+				if (item.type == json_type_integer || item.type == json_type_boolean)
+				{
+					while (j < count && same_scalar(item, items[j]))
+						j++;
+
+					run(item, j - top.next);
+				}
+				else
+					node = &item;
+
+				top.next = j;
+			}
+		}
+	}
+};
+
+bool encode_bjson(const json_data *root, std::vector<unsigned char> &out, std::string &error)
+{
+	bjson_encoder encoder(out, error);
+	return encoder.encode(root);
+}
+
+static uint32_t read_be32(const unsigned char *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static unsigned int read_be16(const unsigned char *p)
+{
+	return ((unsigned int) p[0] << 8) | p[1];
+}
+
+static uint64_t read_be64(const unsigned char *p)
+{
+	return ((uint64_t) read_be32(p) << 32) | read_be32(p + 4);
+}
+
+// Splits the next reference token off a JSON pointer, undoing the ~1 and ~0
+// escapes. Returns false at the end of the pointer.
+static bool pointer_token(const char *&pointer, std::string &token)
+{
+	if (*pointer != '/')
+		return false;
+
+	token.clear();
+	for (pointer++; *pointer != 0 && *pointer != '/'; pointer++)
+	{
+		if (pointer[0] == '~' && (pointer[1] == '0' || pointer[1] == '1'))
+			token += *++pointer == '0' ? '~' : '/';
+		else
+			token += *pointer;
+	}
+
+	return true;
+}
+
+static bool pointer_index(const std::string &token, size_t &index)
+{
+	if (token.empty() || (token.size() > 1 && token[0] == '0'))
+		return false;
+
+	index = 0;
+	for (char c: token)
+	{
+		if (c < '0' || c > '9' || index > (SIZE_MAX - 9) / 10)
+			return false;
+
+		index = index * 10 + (c - '0');
+	}
+
+	return true;
+}
+
+static bool pointer_valid(const char *pointer, std::string &error)
+{
+	if (*pointer != 0 && *pointer != '/')
+	{
+		error = std::string(pointer) + ": JSON pointer must start with '/'";
+		return false;
+	}
+
+	return true;
+}
+
+bool bjson_view::open(const unsigned char *data, size_t size, std::string &error, bool validateStrings, size_t maxDepth)
+{
+	this->data = data;
+	this->size = size;
+	validate = validateStrings;
+	depthLimit = maxDepth;
+	pool.clear();
+
+	if (size < 10 || data[0] != 0xFF || data[1] != 0xFF)
+	{
+		error = "invalid binary JSON header";
+		return false;
+	}
+
+	uint32_t count = read_be32(data + 2);
+	size_t offset = 10;
+	pool.reserve(std::min<size_t>(count, (size - offset) / 4));
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (size - offset < 4)
+		{
+			error = "premature EOF";
+			return false;
+		}
+
+		uint32_t length = read_be32(data + offset);
+		offset += 4;
+		if (length > size - offset)
+		{
+			error = "premature EOF";
+			return false;
+		}
+
+		if (validate && !yajl_string_validate_utf8(data + offset, length))
+		{
+			error = "invalid UTF-8 in binary JSON string";
+			return false;
+		}
+
+		pool.push_back({(const char *) data + offset, length});
+		offset += length;
+	}
+
+	start = offset;
+	return true;
+}
+
+size_t bjson_view::record_size(size_t offset) const
+{
+	if (offset >= size)
+		return 0;
+
+	unsigned char op = data[offset];
+	size_t length = bjson_record_size(op);
+	if (length == 0 || length > size - offset)
+		return 0;
+
+	if (op == BJSN_STRING_DIRECT || op == BJSN_MEMBER_DIRECT)
+	{
+		uint32_t strLen = read_be32(data + offset + 1);
+		if (strLen > 0x7FFFFFFF)
+			return 0;
+
+		length += strLen;
+	}
+
+	return length <= size - offset ? length : 0;
+}
+
+bool bjson_view::skip(size_t &offset) const
+{
+	size_t depth = 0;
+
+	do
+	{
+		size_t length = record_size(offset);
+		if (length == 0)
+			return false;
+
+		switch (data[offset])
+		{
+			case BJSN_OPEN_OBJ:
+			case BJSN_OPEN_ARR:
+				depth++;
+				break;
+			case BJSN_CLOSE_OBJ:
+			case BJSN_CLOSE_ARR:
+				if (depth == 0)
+					return false;
+
+				depth--;
+				break;
+			case BJSN_END:
+				return false;
+			default:
+				break;
+		}
+
+		offset += length;
+	} while (depth > 0);
+
+	return true;
+}
+
+bool bjson_view::key(size_t offset, json_string &result) const
+{
+	if (record_size(offset) == 0)
+		return false;
+
+	if (data[offset] == BJSN_MEMBER)
+	{
+		uint32_t idx = read_be32(data + offset + 1);
+		if (idx >= pool.size())
+			return false;
+
+		result = pool[idx];
+		return true;
+	}
+	else if (data[offset] == BJSN_MEMBER_DIRECT)
+	{
+		result = {(const char *) data + offset + 5, read_be32(data + offset + 1)};
+		return true;
+	}
+
+	return false;
+}
+
+bool bjson_view::member(node object, const std::string &name, node &result, std::string &error) const
+{
+	size_t offset = object + 5;
+
+	for (;;)
+	{
+		if (offset < size && data[offset] == BJSN_CLOSE_OBJ)
+		{
+			error = "not found";
+			return false;
+		}
+
+		json_string k;
+		if (!key(offset, k))
+			break;
+
+		offset += record_size(offset);
+		if (k.length == name.size() && memcmp(k.data, name.data(), k.length) == 0)
+		{
+			result = offset;
+			return true;
+		}
+
+		if (!skip(offset))
+			break;
+	}
+
+	error = "invalid binary JSON";
+	return false;
+}
+
+bool bjson_view::element(node array, size_t index, node &result, std::string &error) const
+{
+	size_t offset = array + 9;
+
+	for (;;)
+	{
+		size_t length = record_size(offset);
+		if (length == 0)
+			break;
+
+		unsigned int op = data[offset];
+		if (op == BJSN_CLOSE_ARR)
+		{
+			error = "not found";
+			return false;
+		}
+		else if (op >= BJSN_NUMBER_I8_RLE)
+		{
+			// The run count is the last field of every RLE record.
+			size_t count = read_be16(data + offset + length - 2);
+			if (index < count)
+			{
+				result = offset;
+				return true;
+			}
+
+			index -= count;
+			offset += length;
+		}
+		else if (index == 0)
+		{
+			result = offset;
+			return true;
+		}
+		else
+		{
+			index--;
+			if (!skip(offset))
+				break;
+		}
+	}
+
+	error = "invalid binary JSON";
+	return false;
+}
+
+bool bjson_view::find(node from, const char *pointer, node &result, std::string &error) const
+{
+	if (!pointer_valid(pointer, error))
+		return false;
+
+	const char *path = pointer;
+	std::string token;
+	node n = from;
+
+	while (pointer_token(pointer, token))
+	{
+		size_t index;
+		bool found;
+
+		if (n < size && data[n] == BJSN_OPEN_OBJ && record_size(n) != 0)
+			found = member(n, token, n, error);
+		else if (n < size && data[n] == BJSN_OPEN_ARR && record_size(n) != 0 && pointer_index(token, index))
+			found = element(n, index, n, error);
+		else
+		{
+			error = "not found";
+			found = false;
+		}
+
+		if (!found)
+		{
+			error = std::string(path, pointer) + ": " + error;
+			return false;
+		}
+	}
+
+	result = n;
+	return true;
+}
+
+// Passes `count` copies of a value to the run callback, or to the single value
+// callback when the client has no run callback.
+template<class T>
+static bool emit_run(int (*run)(void *, T, unsigned int), int (*single)(void *, T), void *ctx, T value, unsigned int count)
+{
+	if (run != nullptr && count > 1)
+		return run(ctx, value, count) != 0;
+
+	for (; count > 0; count--)
+	{
+		if (!single(ctx, value))
+			return false;
+	}
+
+	return true;
+}
+
+unsigned int bjson_view::run_count(size_t offset, size_t length) const
+{
+	// The count is the last field of every RLE record.
+	return data[offset] >= BJSN_NUMBER_I8_RLE ? read_be16(data + offset + length - 2) : 1;
+}
+
+bool bjson_view::emit(size_t offset, size_t length, unsigned int count, const yajl_callbacks *callbacks, void *ctx, size_t &depth, size_t maxDepth, std::string &error) const
+{
+	const unsigned char *p = data + offset;
+	bool ok;
+
+	if ((p[0] == BJSN_OPEN_OBJ || p[0] == BJSN_OPEN_ARR) && depth >= maxDepth)
+	{
+		error = "binary JSON nesting too deep";
+		return false;
+	}
+
+	switch (p[0])
+	{
+		case BJSN_OPEN_OBJ:
+			depth++;
+			ok = callbacks->yajl_start_map(ctx, read_be32(p + 1));
+			break;
+		case BJSN_OPEN_ARR:
+			depth++;
+			ok = callbacks->yajl_start_array(ctx, read_be32(p + 1));
+			break;
+		case BJSN_CLOSE_OBJ:
+		case BJSN_CLOSE_ARR:
+			if (depth == 0)
+			{
+				error = "invalid binary JSON";
+				return false;
+			}
+
+			depth--;
+			if (p[0] == BJSN_CLOSE_OBJ)
+				ok = callbacks->yajl_end_map(ctx);
+			else
+				ok = callbacks->yajl_end_array(ctx);
+			break;
+		case BJSN_STRING:
+		case BJSN_MEMBER:
+		{
+			uint32_t idx = read_be32(p + 1);
+			if (idx >= pool.size())
+			{
+				error = "invalid binary JSON constant pool index";
+				return false;
+			}
+
+			const unsigned char *str = (const unsigned char *) pool[idx].data;
+			if (p[0] == BJSN_STRING)
+				ok = callbacks->yajl_string(ctx, str, pool[idx].length, (int) idx);
+			else
+				ok = callbacks->yajl_map_key(ctx, str, pool[idx].length, (int) idx);
+			break;
+		}
+		case BJSN_STRING_DIRECT:
+		case BJSN_MEMBER_DIRECT:
+			if (validate && !yajl_string_validate_utf8(p + 5, length - 5))
+			{
+				error = "invalid UTF-8 in binary JSON string";
+				return false;
+			}
+
+			if (p[0] == BJSN_STRING_DIRECT)
+				ok = callbacks->yajl_string(ctx, p + 5, length - 5, -1);
+			else
+				ok = callbacks->yajl_map_key(ctx, p + 5, length - 5, -1);
+			break;
+		case BJSN_NUMBER_I64:
+			ok = callbacks->yajl_integer(ctx, (long long) read_be64(p + 1));
+			break;
+		case BJSN_NUMBER_DBL:
+		{
+			uint64_t bits = read_be64(p + 1);
+			double dbl;
+			memcpy(&dbl, &bits, sizeof(dbl));
+			ok = callbacks->yajl_double(ctx, dbl);
+			break;
+		}
+		case BJSN_NUMBER_I32:
+			ok = callbacks->yajl_integer(ctx, (int32_t) read_be32(p + 1));
+			break;
+		case BJSN_NUMBER_I16:
+			ok = callbacks->yajl_integer(ctx, (int16_t) read_be16(p + 1));
+			break;
+		case BJSN_NUMBER_I8:
+			ok = callbacks->yajl_integer(ctx, (int8_t) p[1]);
+			break;
+		case BJSN_NUMBER_FLT:
+		{
+			uint32_t bits = read_be32(p + 1);
+			float flt;
+			memcpy(&flt, &bits, sizeof(flt));
+			ok = callbacks->yajl_double(ctx, flt);
+			break;
+		}
+		case BJSN_CTE_TRUE:
+		case BJSN_CTE_FALSE:
+			ok = callbacks->yajl_boolean(ctx, p[0] == BJSN_CTE_TRUE);
+			break;
+		case BJSN_CTE_NULL:
+			ok = callbacks->yajl_null(ctx);
+			break;
+		case BJSN_NUMBER_I8_RLE:
+			ok = emit_run<long long>(callbacks->yajl_integer_run, callbacks->yajl_integer, ctx, (int8_t) p[1], count);
+			break;
+		case BJSN_NUMBER_I16_RLE:
+			ok = emit_run<long long>(callbacks->yajl_integer_run, callbacks->yajl_integer, ctx, (int16_t) read_be16(p + 1), count);
+			break;
+		case BJSN_NUMBER_I32_RLE:
+			ok = emit_run<long long>(callbacks->yajl_integer_run, callbacks->yajl_integer, ctx, (int32_t) read_be32(p + 1), count);
+			break;
+		case BJSN_NUMBER_I64_RLE:
+			ok = emit_run<long long>(callbacks->yajl_integer_run, callbacks->yajl_integer, ctx, (long long) read_be64(p + 1), count);
+			break;
+		case BJSN_CTE_TRUE_RLE:
+		case BJSN_CTE_FALSE_RLE:
+			ok = emit_run<int>(callbacks->yajl_boolean_run, callbacks->yajl_boolean, ctx, p[0] == BJSN_CTE_TRUE_RLE, count);
+			break;
+		default:
+			error = "invalid binary JSON";
+			return false;
+	}
+
+	if (!ok)
+	{
+		error = "client cancelled parse via callback return value";
+		return false;
+	}
+
+	return true;
+}
+
+bool bjson_view::decode(node n, const yajl_callbacks *callbacks, void *ctx, std::string &error) const
+{
+	size_t depth = 0;
+	size_t offset = n;
+
+	do
+	{
+		size_t length = record_size(offset);
+		if (length == 0)
+		{
+			error = "invalid binary JSON";
+			return false;
+		}
+
+		// A run the node points to stands for one element of it.
+		unsigned int count = offset == n ? 1 : run_count(offset, length);
+		if (!emit(offset, length, count, callbacks, ctx, depth, depthLimit, error))
+			return false;
+
+		offset += length;
+	} while (depth > 0);
+
+	return true;
+}
+
+bool bjson_view::decode_range(size_t begin, size_t end, const yajl_callbacks *callbacks, void *ctx, std::string &error, size_t outer) const
+{
+	size_t depth = 0;
+	size_t maxDepth = outer < depthLimit ? depthLimit - outer : 0;
+
+	for (size_t offset = begin; offset < end;)
+	{
+		size_t length = record_size(offset);
+		if (length == 0 || !emit(offset, length, run_count(offset, length), callbacks, ctx, depth, maxDepth, error))
+		{
+			if (length == 0)
+				error = "invalid binary JSON";
+			return false;
+		}
+
+		offset += length;
+	}
+
+	if (depth != 0)
+	{
+		error = "invalid binary JSON";
+		return false;
+	}
+
+	return true;
+}
+
+bool bjson_view::split(node container, size_t pieces, std::vector<size_t> &bounds, std::vector<size_t> &counts) const
+{
+	size_t length = record_size(container);
+	if (length == 0 || (data[container] != BJSN_OPEN_OBJ && data[container] != BJSN_OPEN_ARR))
+		return false;
+
+	bool isMap = data[container] == BJSN_OPEN_OBJ;
+	size_t offset = container + length;
+	// The root usually spans the rest of the buffer.
+	size_t target = std::max<size_t>((size - offset) / std::max<size_t>(pieces, 1), 1);
+
+	bounds.clear();
+	bounds.push_back(offset);
+	counts.clear();
+	counts.push_back(0);
+	while (offset >= size || data[offset] != (isMap ? BJSN_CLOSE_OBJ : BJSN_CLOSE_ARR))
+	{
+		json_string k;
+		if (isMap && !key(offset, k))
+			return false;
+		else if (isMap)
+			offset += record_size(offset);
+
+		size_t length = record_size(offset);
+		counts.back() += length ? run_count(offset, length) : 1;
+		if (!skip(offset))
+			return false;
+
+		if (offset - bounds.back() >= target)
+		{
+			bounds.push_back(offset);
+			counts.push_back(0);
+		}
+	}
+
+	if (bounds.back() != offset)
+		bounds.push_back(offset);
+	else
+		counts.pop_back();
+
+	return true;
+}
+
+
+const json_data *json_index::member(const json_data *object, json_string key)
+{
+	const json_member *items = object->map.items;
+	size_t count = object->map.count;
+
+	if (count > LINEAR_LIMIT)
+	{
+		table &t = objects[object];
+		if (++t.lookups == 2)
+		{
+			t.members.reserve(count);
+			for (size_t i = 0; i < count; i++)
+				t.members.emplace(items[i].key, i);
+		}
+
+		if (t.lookups >= 2)
+		{
+			auto it = t.members.find(key);
+			return it == t.members.end() ? nullptr : &items[it->second].value;
+		}
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (json_string_equal()(items[i].key, key))
+			return &items[i].value;
+	}
+
+	return nullptr;
+}
+
+const json_data *find_json(const json_data *root, const char *pointer, std::string &error, json_index *index)
+{
+	if (!pointer_valid(pointer, error))
+		return nullptr;
+
+	const char *path = pointer;
+	std::string token;
+
+	while (pointer_token(pointer, token))
+	{
+		const json_data *next = nullptr;
+		size_t element;
+
+		if (root->type == json_type_map)
+		{
+			json_string key = {token.data(), token.size()};
+			if (index != nullptr)
+				next = index->member(root, key);
+			else
+			{
+				for (size_t i = 0; i < root->map.count && next == nullptr; i++)
+				{
+					if (json_string_equal()(root->map.items[i].key, key))
+						next = &root->map.items[i].value;
+				}
+			}
+		}
+		else if (root->type == json_type_array && pointer_index(token, element) && element < root->array.count)
+			next = &root->array.items[element];
+
+		if (next == nullptr)
+		{
+			error = std::string(path, pointer) + ": not found";
+			return nullptr;
+		}
+
+		root = next;
+	}
+
+	return root;
+}
+
+const yajl_callbacks stream_cb = {
+	// read null
+	[](void *ctx)
+	{
+		return (int) (yajl_gen_null((yajl_gen) ctx) == yajl_gen_status_ok);
+	},
+	// read boolean
+	[](void *ctx, int boolean)
+	{
+		return (int) (yajl_gen_bool((yajl_gen) ctx, boolean) == yajl_gen_status_ok);
+	},
+	// read integer
+	[](void *ctx, long long integer)
+	{
+		return (int) (yajl_gen_integer((yajl_gen) ctx, integer) == yajl_gen_status_ok);
+	},
+	// read double
+	[](void *ctx, double real)
+	{
+		return (int) (yajl_gen_double((yajl_gen) ctx, real) == yajl_gen_status_ok);
+	},
+	nullptr,
+	// read string
+	[](void *ctx, const unsigned char *stringVal, size_t stringLen, int cte_pool)
+	{
+		return (int) (yajl_gen_string((yajl_gen) ctx, stringVal, stringLen) == yajl_gen_status_ok);
+	},
+	// start map
+	[](void *ctx, unsigned int size)
+	{
+		return (int) (yajl_gen_map_open((yajl_gen) ctx) == yajl_gen_status_ok);
+	},
+	// map key
+	[](void *ctx, const unsigned char *key, size_t stringLen, int cte_pool)
+	{
+		return (int) (yajl_gen_string((yajl_gen) ctx, key, stringLen) == yajl_gen_status_ok);
+	},
+	// end map
+	[](void *ctx)
+	{
+		return (int) (yajl_gen_map_close((yajl_gen) ctx) == yajl_gen_status_ok);
+	},
+	// start array
+	[](void *ctx, unsigned int size)
+	{
+		return (int) (yajl_gen_array_open((yajl_gen) ctx) == yajl_gen_status_ok);
+	},
+	// end array
+	[](void *ctx)
+	{
+		return (int) (yajl_gen_array_close((yajl_gen) ctx) == yajl_gen_status_ok);
+	},
+	// integer run
+	[](void *ctx, long long integer, unsigned int count)
+	{
+		yajl_gen gen = (yajl_gen) ctx;
+		for (; count > 0; count--)
+		{
+			if (yajl_gen_integer(gen, integer) != yajl_gen_status_ok)
+				return 0;
+		}
+
+		return 1;
+	},
+	// boolean run
+	[](void *ctx, int boolean, unsigned int count)
+	{
+		yajl_gen gen = (yajl_gen) ctx;
+		for (; count > 0; count--)
+		{
+			if (yajl_gen_bool(gen, boolean) != yajl_gen_status_ok)
+				return 0;
+		}
+
+		return 1;
+	}
+};
+
+bool run_parser(yajl_handle hand, const parser_input &in, std::string &error, size_t *bytesRead)
+{
+	constexpr size_t READ_BUFSIZE = 64 * 1024;
+
+	yajl_config(hand, yajl_allow_comments, 1);
+	yajl_config(hand, yajl_persistent_input, (int) (in.file == nullptr));
+
+	yajl_status status = yajl_status_ok;
+	const unsigned char *data = in.data;
+	size_t size = in.size;
+	std::vector<unsigned char> buf;
+
+	size_t total = size;
+
+	if (in.file == nullptr)
+		status = yajl_parse(hand, data, size);
+	else
+	{
+		buf.resize(READ_BUFSIZE);
+		data = buf.data();
+		total = 0;
+
+		while (status == yajl_status_ok && (size = fread(buf.data(), 1, READ_BUFSIZE, in.file)) > 0)
+		{
+			status = yajl_parse(hand, data, size);
+			total += size;
+		}
+
+		if (ferror(in.file))
+		{
+			error = strerror(errno);
+			yajl_reset(hand);
+			return false;
+		}
+	}
+
+	if (bytesRead != nullptr)
+		*bytesRead = total;
+
+	if (status == yajl_status_ok)
+		status = yajl_complete_parse(hand);
+
+	if (status != yajl_status_ok)
+	{
+		unsigned char *str = yajl_get_error(hand, 1, data, size);
+		error = (const char *) str;
+		yajl_free_error(hand, str);
+	}
+
+	yajl_reset(hand);
+	return status == yajl_status_ok;
+}
+
+const yajl_callbacks reader_cb = {
+	// read null
+	[](void *ctx)
+	{
+		json_data_state *state = (json_data_state *) ctx;
+		return (int) state->insert(json_data(json_type_null));
+	},
+	// read boolean
+	[](void *ctx, int boolean)
+	{
+		json_data_state *state = (json_data_state *) ctx;
+		return (int) state->insert(json_data((bool) boolean));
+	},
+	// read integer
+	[](void *ctx, long long integer)
+	{
+		json_data_state *state = (json_data_state *) ctx;
+		return (int) state->insert(json_data((int64_t) integer));
+	},
+	// read double
+	[](void *ctx, double real)
+	{
+		json_data_state *state = (json_data_state *) ctx;
+		return (int) state->insert(json_data(real));
+	},
+	nullptr,
+	// read string
+	[](void *ctx, const unsigned char *stringVal, size_t stringLen, int cte_pool)
+	{
+		json_data_state *state = (json_data_state *) ctx;
+		return (int) state->insert(state->intern((const char *) stringVal, stringLen, cte_pool));
+	},
+	// start map
+	[](void *ctx, unsigned int size)
+	{
+		json_data_state *state = (json_data_state *) ctx;
+		return (int) state->open(json_type_map, size);
+	},
+	// map key
+	[](void *ctx, const unsigned char * key, size_t stringLen, int cte_pool)
+	{
+		json_data_state *state = (json_data_state *) ctx;
+		state->key = state->intern_key((const char *) key, stringLen, cte_pool);
+		return 1;
+	},
+	// end map
+	[](void *ctx)
+	{
+		json_data_state *state = (json_data_state *) ctx;
+		return (int) state->close();
+	},
+	// start array
+	[](void *ctx, unsigned int size)
+	{
+		json_data_state *state = (json_data_state *) ctx;
+		return (int) state->open(json_type_array, size);
+	},
+	// end array
+	[](void *ctx)
+	{
+		json_data_state *state = (json_data_state *) ctx;
+		return (int) state->close();
+	},
+	// integer run
+	[](void *ctx, long long integer, unsigned int count)
+	{
+		json_data_state *state = (json_data_state *) ctx;
+		return (int) state->insert_run(json_data((int64_t) integer), count);
+	},
+	// boolean run
+	[](void *ctx, int boolean, unsigned int count)
+	{
+		json_data_state *state = (json_data_state *) ctx;
+		return (int) state->insert_run(json_data((bool) boolean), count);
+	}
+};
+
+const yajl_callbacks tape_cb = {
+	// read null
+	[](void *ctx)
+	{
+		return (int) ((json_tape *) ctx)->null();
+	},
+	// read boolean
+	[](void *ctx, int boolean)
+	{
+		return (int) ((json_tape *) ctx)->boolean(boolean != 0);
+	},
+	// read integer
+	[](void *ctx, long long integer)
+	{
+		return (int) ((json_tape *) ctx)->integer((int64_t) integer);
+	},
+	// read double
+	[](void *ctx, double real)
+	{
+		return (int) ((json_tape *) ctx)->real(real);
+	},
+	nullptr,
+	// read string
+	[](void *ctx, const unsigned char *stringVal, size_t stringLen, int cte_pool)
+	{
+		return (int) ((json_tape *) ctx)->string((const char *) stringVal, stringLen, cte_pool);
+	},
+	// start map
+	[](void *ctx, unsigned int)
+	{
+		return (int) ((json_tape *) ctx)->open(true);
+	},
+	// map key
+	[](void *ctx, const unsigned char *key, size_t stringLen, int cte_pool)
+	{
+		return (int) ((json_tape *) ctx)->key((const char *) key, stringLen, cte_pool);
+	},
+	// end map
+	[](void *ctx)
+	{
+		return (int) ((json_tape *) ctx)->close();
+	},
+	// start array
+	[](void *ctx, unsigned int)
+	{
+		return (int) ((json_tape *) ctx)->open(false);
+	},
+	// end array
+	[](void *ctx)
+	{
+		return (int) ((json_tape *) ctx)->close();
+	},
+	// integer run
+	[](void *ctx, long long integer, unsigned int count)
+	{
+		return (int) ((json_tape *) ctx)->integer_run((int64_t) integer, count);
+	},
+	// boolean run
+	[](void *ctx, int boolean, unsigned int count)
+	{
+		return (int) ((json_tape *) ctx)->boolean_run(boolean != 0, count);
+	}
+};
+
+// Counts a string or key that may refer to the constant pool.
+static void count_pool_reference(stats_hook *hook, int cte_pool)
+{
+	if (cte_pool < 0)
+		return;
+
+	hook->stats->poolReferences++;
+	if ((size_t) cte_pool >= hook->seen.size())
+		hook->seen.resize((size_t) cte_pool + 1);
+
+	if (hook->seen[cte_pool])
+		hook->stats->poolHits++;
+	else
+		hook->seen[cte_pool] = true;
+}
+
+const yajl_callbacks stats_cb = {
+	// read null
+	[](void *ctx)
+	{
+		stats_hook *hook = (stats_hook *) ctx;
+		hook->stats->events[conversion_stats::event_null]++;
+		return hook->callbacks->yajl_null(hook->ctx);
+	},
+	// read boolean
+	[](void *ctx, int boolean)
+	{
+		stats_hook *hook = (stats_hook *) ctx;
+		hook->stats->events[conversion_stats::event_boolean]++;
+		return hook->callbacks->yajl_boolean(hook->ctx, boolean);
+	},
+	// read integer
+	[](void *ctx, long long integer)
+	{
+		stats_hook *hook = (stats_hook *) ctx;
+		hook->stats->events[conversion_stats::event_integer]++;
+		return hook->callbacks->yajl_integer(hook->ctx, integer);
+	},
+	// read double
+	[](void *ctx, double real)
+	{
+		stats_hook *hook = (stats_hook *) ctx;
+		hook->stats->events[conversion_stats::event_double]++;
+		return hook->callbacks->yajl_double(hook->ctx, real);
+	},
+	nullptr,
+	// read string
+	[](void *ctx, const unsigned char *stringVal, size_t stringLen, int cte_pool)
+	{
+		stats_hook *hook = (stats_hook *) ctx;
+		hook->stats->events[conversion_stats::event_string]++;
+		count_pool_reference(hook, cte_pool);
+		return hook->callbacks->yajl_string(hook->ctx, stringVal, stringLen, cte_pool);
+	},
+	// start map
+	[](void *ctx, unsigned int size)
+	{
+		stats_hook *hook = (stats_hook *) ctx;
+		hook->stats->events[conversion_stats::event_map]++;
+		return hook->callbacks->yajl_start_map(hook->ctx, size);
+	},
+	// map key
+	[](void *ctx, const unsigned char *key, size_t stringLen, int cte_pool)
+	{
+		stats_hook *hook = (stats_hook *) ctx;
+		hook->stats->events[conversion_stats::event_key]++;
+		count_pool_reference(hook, cte_pool);
+		return hook->callbacks->yajl_map_key(hook->ctx, key, stringLen, cte_pool);
+	},
+	// end map
+	[](void *ctx)
+	{
+		stats_hook *hook = (stats_hook *) ctx;
+		return hook->callbacks->yajl_end_map(hook->ctx);
+	},
+	// start array
+	[](void *ctx, unsigned int size)
+	{
+		stats_hook *hook = (stats_hook *) ctx;
+		hook->stats->events[conversion_stats::event_array]++;
+		return hook->callbacks->yajl_start_array(hook->ctx, size);
+	},
+	// end array
+	[](void *ctx)
+	{
+		stats_hook *hook = (stats_hook *) ctx;
+		return hook->callbacks->yajl_end_array(hook->ctx);
+	},
+	// integer run
+	[](void *ctx, long long integer, unsigned int count)
+	{
+		stats_hook *hook = (stats_hook *) ctx;
+		hook->stats->events[conversion_stats::event_integer_run]++;
+		hook->stats->runValues += count;
+		return (int) emit_run(hook->callbacks->yajl_integer_run, hook->callbacks->yajl_integer, hook->ctx, integer, count);
+	},
+	// boolean run
+	[](void *ctx, int boolean, unsigned int count)
+	{
+		stats_hook *hook = (stats_hook *) ctx;
+		hook->stats->events[conversion_stats::event_boolean_run]++;
+		hook->stats->runValues += count;
+		return (int) emit_run(hook->callbacks->yajl_boolean_run, hook->callbacks->yajl_boolean, hook->ctx, boolean, count);
+	}
+};
+
+bool json_projection::add(const char *pattern, std::string &error)
+{
+	const char *p = pattern;
+	size_t begin = steps.size();
+	// Without the `$`, the first step may be anywhere.
+	bool anywhere = *p != '$';
+	if (!anywhere)
+		p++;
+
+	while (*p != '\0')
+	{
+		step s = {step::step_any, false, std::string(), 0};
+
+		if (anywhere && steps.size() == begin)
+			s.descendant = true;
+		else if (*p == '.')
+		{
+			p++;
+			if (*p == '.')
+			{
+				s.descendant = true;
+				p++;
+			}
+		}
+		else if (*p != '[')
+		{
+			steps.resize(begin);
+			error = std::string(pattern) + ": expected '.' or '['";
+			return false;
+		}
+
+		if (*p == '[')
+		{
+			p++;
+			if (*p == '\'' || *p == '"')
+			{
+				const char *end = strchr(p + 1, *p);
+				if (end == nullptr)
+				{
+					steps.resize(begin);
+					error = std::string(pattern) + ": unterminated name";
+					return false;
+				}
+
+				s.kind = step::step_name;
+				s.name.assign(p + 1, end);
+				p = end + 1;
+			}
+			else if (*p >= '0' && *p <= '9')
+			{
+				s.kind = step::step_index;
+				for (; *p >= '0' && *p <= '9'; p++)
+					s.index = s.index * 10 + (size_t) (*p - '0');
+			}
+			else if (*p == '*')
+				p++;
+
+			if (*p != ']')
+			{
+				steps.resize(begin);
+				error = std::string(pattern) + ": expected a name, an index or '*' in brackets";
+				return false;
+			}
+			p++;
+		}
+		else if (*p == '*')
+			p++;
+		else
+		{
+			const char *end = p + strcspn(p, ".[");
+			if (end == p)
+			{
+				steps.resize(begin);
+				error = std::string(pattern) + ": empty name";
+				return false;
+			}
+
+			s.kind = step::step_name;
+			s.name.assign(p, end);
+			p = end;
+		}
+
+		steps.push_back(std::move(s));
+	}
+
+	roots.push_back({begin, steps.size()});
+	return true;
+}
+
+bool json_projection::whole() const
+{
+	for (const state &s: roots)
+	{
+		if (s.step == s.end)
+			return true;
+	}
+
+	return false;
+}
+
+bool json_projection::advance(const state &from, const char *key, size_t len, size_t index, std::vector<state> &to, size_t first) const
+{
+	const step &s = steps[from.step];
+	bool match;
+	if (s.kind == step::step_any)
+		match = true;
+	else if (s.kind == step::step_index)
+		match = key == nullptr && s.index == index;
+	else
+		match = key != nullptr && s.name.size() == len && memcmp(s.name.data(), key, len) == 0;
+
+	if (match && from.step + 1 == from.end)
+		return true;
+
+	// A `..` step may still come further down.
+	state next[2];
+	size_t count = 0;
+	if (s.descendant)
+		next[count++] = from;
+	if (match)
+		next[count++] = {from.step + 1, from.end};
+
+	for (size_t i = 0; i < count; i++)
+	{
+		bool known = false;
+		for (size_t j = first; j < to.size(); j++)
+		{
+			if (to[j].step == next[i].step && to[j].end == next[i].end)
+			{
+				known = true;
+				break;
+			}
+		}
+
+		if (!known)
+			to.push_back(next[i]);
+	}
+
+	return false;
+}
+
+void json_filter::attach(const json_projection *projection, const yajl_callbacks *callbacks, void *ctx)
+{
+	this->projection = projection;
+	this->callbacks = callbacks;
+	this->ctx = ctx;
+	reset();
+}
+
+void json_filter::reset()
+{
+	frames.clear();
+	active.clear();
+	opened = 0;
+	pass = 0;
+	skip = 0;
+	pending = verdict_drop;
+	pendingPool = -1;
+}
+
+json_filter::verdict json_filter::select(const char *key, size_t len, size_t index)
+{
+	if (frames.empty())
+		return verdict_drop;
+
+	// The states of the previous member or element go.
+	size_t begin = frames.back().end;
+	active.resize(begin);
+
+	for (size_t i = frames.back().begin; i < begin; i++)
+	{
+		// Copied, as `active` may grow.
+		json_projection::state from = active[i];
+		if (projection->advance(from, key, len, index, active, begin))
+			return verdict_keep;
+	}
+
+	return active.size() > begin ? verdict_descend : verdict_drop;
+}
+
+json_filter::verdict json_filter::next()
+{
+	// A scalar root is kept as it is.
+	if (frames.empty())
+		return verdict_keep;
+
+	frame &top = frames.back();
+	if (top.object)
+		return pending;
+
+	return select(nullptr, 0, top.index++);
+}
+
+bool json_filter::flush()
+{
+	for (; opened < frames.size(); opened++)
+	{
+		const frame &f = frames[opened];
+		if (opened > 0 && frames[opened - 1].object && !callbacks->yajl_map_key(ctx, (const unsigned char *) f.key.data(), f.key.size(), f.keyPool))
+			return false;
+
+		// How much of it is kept isn't known yet.
+		if (!(f.object ? callbacks->yajl_start_map(ctx, JSON_SIZE_UNKNOWN) : callbacks->yajl_start_array(ctx, JSON_SIZE_UNKNOWN)))
+			return false;
+	}
+
+	return true;
+}
+
+int json_filter::null()
+{
+	if (skip == 0 && (pass > 0 || next() == verdict_keep))
+		return flush() && callbacks->yajl_null(ctx);
+
+	return 1;
+}
+
+int json_filter::boolean(bool value)
+{
+	if (skip == 0 && (pass > 0 || next() == verdict_keep))
+		return flush() && callbacks->yajl_boolean(ctx, value);
+
+	return 1;
+}
+
+int json_filter::integer(long long value)
+{
+	if (skip == 0 && (pass > 0 || next() == verdict_keep))
+		return flush() && callbacks->yajl_integer(ctx, value);
+
+	return 1;
+}
+
+int json_filter::real(double value)
+{
+	if (skip == 0 && (pass > 0 || next() == verdict_keep))
+		return flush() && callbacks->yajl_double(ctx, value);
+
+	return 1;
+}
+
+int json_filter::string(const char *str, size_t len, int cte_pool)
+{
+	if (skip == 0 && (pass > 0 || next() == verdict_keep))
+		return flush() && callbacks->yajl_string(ctx, (const unsigned char *) str, len, cte_pool);
+
+	return 1;
+}
+
+int json_filter::open(bool object, unsigned int size)
+{
+	// Only the JSON text parser passes the contents of skipped containers.
+	if (skip > 0)
+	{
+		skip++;
+		return 1;
+	}
+
+	verdict v;
+	if (pass > 0)
+		v = verdict_keep;
+	else if (frames.empty())
+		v = projection->whole() ? verdict_keep : verdict_descend;
+	else
+		v = next();
+
+	if (v == verdict_keep)
+	{
+		pass++;
+		return flush() && (object ? callbacks->yajl_start_map(ctx, size) : callbacks->yajl_start_array(ctx, size));
+	}
+	else if (v == verdict_drop)
+	{
+		skip = 1;
+		return YAJL_SKIP_CONTAINER;
+	}
+
+	size_t begin, end;
+	if (frames.empty())
+	{
+		active.assign(projection->start().begin(), projection->start().end());
+		begin = 0;
+		end = active.size();
+	}
+	else
+	{
+		begin = frames.back().end;
+		end = active.size();
+	}
+
+	frames.push_back({begin, end, object, 0, std::string(), -1});
+	if (frames.size() > 1 && frames[frames.size() - 2].object)
+	{
+		frames.back().key.swap(pendingKey);
+		frames.back().keyPool = pendingPool;
+	}
+
+	// The root is always kept.
+	return frames.size() > 1 || flush();
+}
+
+int json_filter::key(const char *str, size_t len, int cte_pool)
+{
+	if (skip > 0)
+		return 1;
+	else if (pass > 0)
+		return callbacks->yajl_map_key(ctx, (const unsigned char *) str, len, cte_pool);
+
+	// Broken input may have a key outside any object.
+	if (frames.empty() || !frames.back().object)
+		return 0;
+
+	pending = select(str, len, 0);
+	if (pending == verdict_keep)
+		return flush() && callbacks->yajl_map_key(ctx, (const unsigned char *) str, len, cte_pool);
+	else if (pending == verdict_descend)
+	{
+		pendingKey.assign(str, len);
+		pendingPool = cte_pool;
+	}
+
+	return 1;
+}
+
+int json_filter::close(bool object)
+{
+	if (skip > 0)
+	{
+		skip--;
+		return 1;
+	}
+	else if (pass > 0)
+	{
+		pass--;
+		return object ? callbacks->yajl_end_map(ctx) : callbacks->yajl_end_array(ctx);
+	}
+
+	bool wasOpen = opened == frames.size();
+	frames.pop_back();
+	if (!wasOpen)
+		return 1;
+
+	opened--;
+	return object ? callbacks->yajl_end_map(ctx) : callbacks->yajl_end_array(ctx);
+}
+
+int json_filter::integer_run(long long value, unsigned int count)
+{
+	if (skip > 0)
+		return 1;
+	else if (pass > 0)
+		return (int) emit_run(callbacks->yajl_integer_run, callbacks->yajl_integer, ctx, value, count);
+
+	// Each element is selected on its own, and the kept ones in a row are
+	// passed on together.
+	unsigned int kept = 0;
+	for (unsigned int n = 0; n < count; n++)
+	{
+		if (next() == verdict_keep)
+			kept++;
+		else if (kept > 0)
+		{
+			if (!flush() || !emit_run(callbacks->yajl_integer_run, callbacks->yajl_integer, ctx, value, kept))
+				return 0;
+			kept = 0;
+		}
+	}
+
+	return kept == 0 || (flush() && emit_run(callbacks->yajl_integer_run, callbacks->yajl_integer, ctx, value, kept));
+}
+
+int json_filter::boolean_run(bool value, unsigned int count)
+{
+	if (skip > 0)
+		return 1;
+	else if (pass > 0)
+		return (int) emit_run(callbacks->yajl_boolean_run, callbacks->yajl_boolean, ctx, (int) value, count);
+
+	unsigned int kept = 0;
+	for (unsigned int n = 0; n < count; n++)
+	{
+		if (next() == verdict_keep)
+			kept++;
+		else if (kept > 0)
+		{
+			if (!flush() || !emit_run(callbacks->yajl_boolean_run, callbacks->yajl_boolean, ctx, (int) value, kept))
+				return 0;
+			kept = 0;
+		}
+	}
+
+	return kept == 0 || (flush() && emit_run(callbacks->yajl_boolean_run, callbacks->yajl_boolean, ctx, (int) value, kept));
+}
+
+const yajl_callbacks project_cb = {
+	// read null
+	[](void *ctx)
+	{
+		return ((json_filter *) ctx)->null();
+	},
+	// read boolean
+	[](void *ctx, int boolean)
+	{
+		return ((json_filter *) ctx)->boolean(boolean != 0);
+	},
+	// read integer
+	[](void *ctx, long long integer)
+	{
+		return ((json_filter *) ctx)->integer(integer);
+	},
+	// read double
+	[](void *ctx, double real)
+	{
+		return ((json_filter *) ctx)->real(real);
+	},
+	nullptr,
+	// read string
+	[](void *ctx, const unsigned char *stringVal, size_t stringLen, int cte_pool)
+	{
+		return ((json_filter *) ctx)->string((const char *) stringVal, stringLen, cte_pool);
+	},
+	// start map
+	[](void *ctx, unsigned int size)
+	{
+		return ((json_filter *) ctx)->open(true, size);
+	},
+	// map key
+	[](void *ctx, const unsigned char *key, size_t stringLen, int cte_pool)
+	{
+		return ((json_filter *) ctx)->key((const char *) key, stringLen, cte_pool);
+	},
+	// end map
+	[](void *ctx)
+	{
+		return ((json_filter *) ctx)->close(true);
+	},
+	// start array
+	[](void *ctx, unsigned int size)
+	{
+		return ((json_filter *) ctx)->open(false, size);
+	},
+	// end array
+	[](void *ctx)
+	{
+		return ((json_filter *) ctx)->close(false);
+	},
+	// integer run
+	[](void *ctx, long long integer, unsigned int count)
+	{
+		return ((json_filter *) ctx)->integer_run(integer, count);
+	},
+	// boolean run
+	[](void *ctx, int boolean, unsigned int count)
+	{
+		return ((json_filter *) ctx)->boolean_run(boolean != 0, count);
+	}
+};
+
+bool json_tape::replay(const yajl_callbacks *callbacks, void *ctx) const
+{
+	const uint64_t *word = words.data();
+	const uint64_t *end = word + words.size();
+
+	for (; word < end; word++)
+	{
+		uint64_t payload = *word & PAYLOAD_MASK;
+		int result = 1;
+
+		switch (*word >> TAG_SHIFT)
+		{
+			case TAG_NULL:
+				result = callbacks->yajl_null(ctx);
+				break;
+			case TAG_FALSE:
+			case TAG_TRUE:
+				result = callbacks->yajl_boolean(ctx, (*word >> TAG_SHIFT) == TAG_TRUE);
+				break;
+			case TAG_INTEGER:
+				result = callbacks->yajl_integer(ctx, (long long) ((int64_t) (*word << (64 - TAG_SHIFT)) >> (64 - TAG_SHIFT)));
+				break;
+			case TAG_INTEGER64:
+				result = callbacks->yajl_integer(ctx, (long long) (int64_t) *++word);
+				break;
+			case TAG_REAL:
+			{
+				double real;
+				memcpy(&real, ++word, sizeof(real));
+				result = callbacks->yajl_double(ctx, real);
+				break;
+			}
+			case TAG_STRING:
+			case TAG_KEY:
+			{
+				uint32_t header[2];
+				const char *str = strings.data() + payload;
+				memcpy(header, str, STRING_HEADER);
+
+				int id = header[1] == UNSHARED ? -1 : (int) std::min<uint32_t>(header[1], INT_MAX);
+				if ((*word >> TAG_SHIFT) == TAG_KEY)
+					result = callbacks->yajl_map_key(ctx, (const unsigned char *) str + STRING_HEADER, header[0], id);
+				else
+					result = callbacks->yajl_string(ctx, (const unsigned char *) str + STRING_HEADER, header[0], id);
+				break;
+			}
+			case TAG_MAP:
+			case TAG_ARRAY:
+			{
+				uint64_t count = words[payload] & PAYLOAD_MASK;
+				unsigned int size = count < JSON_SIZE_UNKNOWN ? (unsigned int) count : JSON_SIZE_UNKNOWN;
+				if ((*word >> TAG_SHIFT) == TAG_MAP)
+					result = callbacks->yajl_start_map(ctx, size);
+				else
+					result = callbacks->yajl_start_array(ctx, size);
+				break;
+			}
+			case TAG_END_MAP:
+				result = callbacks->yajl_end_map(ctx);
+				break;
+			case TAG_END_ARRAY:
+				result = callbacks->yajl_end_array(ctx);
+				break;
+			case TAG_INTEGER_RUN:
+			{
+				long long integer = (long long) (int64_t) *++word;
+				result = emit_run(callbacks->yajl_integer_run, callbacks->yajl_integer, ctx, integer, (unsigned int) payload);
+				break;
+			}
+			case TAG_BOOLEAN_RUN:
+				result = emit_run(callbacks->yajl_boolean_run, callbacks->yajl_boolean, ctx, (int) (payload & 1), (unsigned int) (payload >> 1));
+				break;
+		}
+
+		if (!result)
+			return false;
+	}
+
+	return true;
+}
+
+bool parse_json(json_data_state &state, yajl_handle hand, const parser_input &in, std::string &error, size_t *bytesRead)
+{
+	// Without the total size, still don't trust hints beyond what's cheap.
+	state.hintLimit = in.file ? 65536 : in.size;
+	state.hand = hand;
+	bool result = run_parser(hand, in, error, bytesRead);
+	state.hand = nullptr;
+	return result;
+}
+
+bool stream_json(yajl_handle hand, const parser_input &in, std::string &error, size_t *bytesRead)
+{
+	return run_parser(hand, in, error, bytesRead);
+}
+
+bool parse_bjson_parallel(json_data_state &state, const unsigned char *data, size_t size, unsigned int threads, bool validateStrings, size_t maxDepth)
+{
+	bjson_view view;
+	std::vector<size_t> bounds, counts;
+	std::string error;
+
+	// A few ranges per thread even out differences in decoding speed.
+	if (threads < 2 || !view.open(data, size, error, validateStrings, maxDepth) || !view.split(view.root(), (size_t) threads * 4, bounds, counts) || bounds.size() < 3)
+		return false;
+
+	// bjson_parse stops at BJSN_END but rejects anything else after the root.
+	size_t after = bounds.back() + 1;
+	if (after < size && data[after] != BJSN_END)
+		return false;
+
+	json_type type = data[view.root()] == BJSN_OPEN_OBJ ? json_type_map : json_type_array;
+	size_t pieces = bounds.size() - 1;
+	std::vector<std::unique_ptr<json_data_state>> parts(pieces);
+	std::atomic<size_t> next(0);
+	std::atomic<bool> ok(true);
+
+	auto work = [&]()
+	{
+		std::string message;
+
+		for (size_t i; ok && (i = next++) < pieces;)
+		{
+			parts[i].reset(new json_data_state(state.arena.allocator()));
+			json_data_state &part = *parts[i];
+			part.hintLimit = size;
+
+			if (!part.open(type, (unsigned int) std::min<size_t>(counts[i], UINT_MAX - 1)) || !view.decode_range(bounds[i], bounds[i + 1], &reader_cb, &part, message, 1) || !part.close())
+				ok = false;
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned int t = 1; t < std::min<size_t>(threads, pieces); t++)
+		workers.emplace_back(work);
+
+	work();
+	for (std::thread &t: workers)
+		t.join();
+
+	if (!ok)
+		return false;
+
+	// Put the children of all parts together under one root.
+	size_t count = 0;
+	for (const auto &part: parts)
+		count += type == json_type_map ? part->root.map.count : part->root.array.count;
+
+	state.root = json_data(type);
+	state.hasRoot = true;
+	if (type == json_type_map)
+	{
+		json_member *items = state.arena.allocate_array<json_member>(count);
+		state.root.map = {items, count};
+		for (const auto &part: parts)
+			items = std::copy(part->root.map.items, part->root.map.items + part->root.map.count, items);
+	}
+	else
+	{
+		json_data *items = state.arena.allocate_array<json_data>(count);
+		state.root.array = {items, count};
+		for (const auto &part: parts)
+			items = std::copy(part->root.array.items, part->root.array.items + part->root.array.count, items);
+	}
+
+	for (const auto &part: parts)
+		state.arena.adopt(part->arena);
+
+	return true;
+}
+
+bool input_data::open(const char *path)
+{
+	close();
+
+	if (strcmp(path, "-") == 0)
+	{
+		file = stdin;
+		return true;
+	}
+
+	if (map(path))
+		return true;
+
+	file = fopen(path, "rb");
+	return file != nullptr;
+}
+
+void input_data::close()
+{
+	if (ptr != nullptr)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(ptr);
+		CloseHandle(mapping);
+		mapping = nullptr;
+#else
+		munmap((void *) ptr, length);
+#endif
+	}
+
+	if (file != nullptr && file != stdin)
+		fclose(file);
+
+	ptr = nullptr;
+	length = 0;
+	file = nullptr;
+}
+
+bool input_data::map(const char *path)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (GetFileType(file) != FILE_TYPE_DISK || !GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0 || (uint64_t) fileSize.QuadPart > SIZE_MAX)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (mapping == nullptr)
+		return false;
+
+	ptr = (const unsigned char *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (ptr == nullptr)
+	{
+		CloseHandle(mapping);
+		mapping = nullptr;
+		return false;
+	}
+
+	length = (size_t) fileSize.QuadPart;
+	return true;
+#else
+	int fd = ::open(path, O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || (uint64_t) st.st_size > SIZE_MAX)
+	{
+		::close(fd);
+		return false;
+	}
+
+	void *result = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (result == MAP_FAILED)
+		return false;
+
+#ifdef MADV_SEQUENTIAL
+	madvise(result, (size_t) st.st_size, MADV_SEQUENTIAL);
+#endif
+
+	ptr = (const unsigned char *) result;
+	length = (size_t) st.st_size;
+	return true;
+#endif
+}
+
+#ifdef _WIN32
+static bool write_fully(int fd, const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		int n = _write(fd, data, (unsigned int) std::min<size_t>(len, 1 << 30));
+		if (n < 0)
+			return false;
+
+		data += n;
+		len -= (size_t) n;
+	}
+
+	return true;
+}
+#else
+static bool write_fully(int fd, struct iovec *iov, int count)
+{
+	while (count > 0)
+	{
+		ssize_t n = writev(fd, iov, count);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		// Skip what got written, which may end in the middle of an entry.
+		size_t written = (size_t) n;
+		while (count > 0 && written >= iov->iov_len)
+		{
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count > 0)
+		{
+			iov->iov_base = (char *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return true;
+}
+#endif
+
+bool output_sink::open(const char *path)
+{
+	close();
+
+	owned = strcmp(path, "-") != 0;
+#ifdef _WIN32
+	fd = owned ? _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE) : _fileno(stdout);
+#else
+	fd = owned ? ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666) : STDOUT_FILENO;
+#endif
+	if (fd == -1)
+		return false;
+
+	// Anything already printed to stdout has to come first.
+	if (!owned)
+		fflush(stdout);
+
+	if (!buffer)
+		buffer.reset(new char[BUFFER_SIZE]);
+
+	used = 0;
+	error = 0;
+	return true;
+}
+
+void output_sink::write(const void *data, size_t len)
+{
+	// Empty vectors may pass nullptr, which memcpy mustn't get.
+	if (len == 0)
+		return;
+
+	const char *str = (const char *) data;
+	size_t space = BUFFER_SIZE - used;
+
+	if (len <= space)
+	{
+		memcpy(buffer.get() + used, str, len);
+		used += len;
+	}
+	else if (len < BUFFER_SIZE)
+	{
+		// Top up the buffer so that every write is a full one.
+		memcpy(buffer.get() + used, str, space);
+		used = BUFFER_SIZE;
+		flush(nullptr, 0);
+		memcpy(buffer.get(), str + space, len - space);
+		used = len - space;
+	}
+	else
+		flush(str, len);
+}
+
+bool output_sink::close()
+{
+	if (fd == -1)
+		return true;
+
+	flush(nullptr, 0);
+	int result = error;
+#ifdef _WIN32
+	if (owned && _close(fd) != 0 && result == 0)
+#else
+	if (owned && ::close(fd) != 0 && result == 0)
+#endif
+		result = errno;
+
+	fd = -1;
+	if (result != 0)
+		errno = result;
+
+	return result == 0;
+}
+
+void output_sink::flush(const void *extra, size_t len)
+{
+	if (error == 0 && used + len > 0)
+	{
+		auto start = std::chrono::steady_clock::now();
+
+#ifdef _WIN32
+		bool ok = write_fully(fd, buffer.get(), used) && write_fully(fd, (const char *) extra, len);
+#else
+		struct iovec iov[2] = {{buffer.get(), used}, {(void *) extra, len}};
+		bool ok = write_fully(fd, iov, 2);
+#endif
+		if (ok)
+			bytes += used + len;
+		else
+			error = errno;
+
+		seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	used = 0;
+}
+
+// Seconds since `mark` not spent writing to `sink`, moving both marks on.
+static double lap(std::chrono::steady_clock::time_point &mark, double &writing, const output_sink &sink)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration<double>(now - mark).count() - (sink.write_time() - writing);
+
+	mark = now;
+	writing = sink.write_time();
+	return seconds > 0 ? seconds : 0;
+}
+
+// Whether generating succeeded, with `message` saying why not otherwise.
+static bool generated(yajl_gen_status status, std::string &message)
+{
+	if (status == yajl_gen_status_ok)
+		return true;
+	else if (status == yajl_gen_invalid_number)
+		message = "cannot write NaN or infinity as JSON";
+	else if (status == yajl_max_depth_exceeded)
+		message = "nesting too deep to generate";
+	else
+		message = "cannot generate JSON text for the document";
+
+	return false;
+}
+
+converter::converter(const converter_options &options)
+: streaming(options.streaming && options.format != output_bjson)
+, format(options.format)
+, threads(options.threads)
+, memory(options.pooled, options.memoryLimit)
+, state(&memory)
+, tape(&memory)
+, tapeHand(nullptr)
+, treeHand(nullptr)
+, collectStats(options.collectStats)
+, utf8(options.utf8)
+, maxDepth(options.maxDepth)
+, input(options.input)
+, stats()
+, projection(options.project)
+{
+	gen = yajl_gen_alloc(memory.funcs());
+	yajl_gen_config(gen, yajl_gen_max_depth, maxDepth);
+	yajl_gen_config(gen, yajl_gen_beautify, format != output_compact_json);
+	yajl_gen_config(gen, yajl_gen_fast_numbers, 1);
+	yajl_gen_config(gen, yajl_gen_print_callback, print, this);
+
+	if (streaming)
+		hand = alloc_handle(&stream_cb, gen, hook, filter);
+	else
+		hand = alloc_handle(&reader_cb, &state, hook, filter);
+}
+
+converter::~converter()
+{
+	if (tapeHand)
+		yajl_free(tapeHand);
+	if (treeHand)
+		yajl_free(treeHand);
+	yajl_free(hand);
+	yajl_gen_free(gen);
+}
+
+bool converter::convert(const char *input, const char *output, std::string &error)
+{
+	stats_scope scope(*this);
+	std::chrono::steady_clock::time_point mark = std::chrono::steady_clock::now();
+	double writing = sink.write_time();
+
+	std::string message;
+	input_data in;
+	if (!in.open(input))
+		return fail(error, input, strerror(errno));
+	stats.read = lap(mark, writing, sink);
+
+	// Converting in-place must not truncate the input before we know it
+	// converts, so only write directly when the output is somewhere else.
+	bool inPlace = strcmp(output, input) == 0;
+	bool direct = streaming && !inPlace;
+	if (direct && !sink.open(output))
+		return fail(error, output, strerror(errno));
+
+	buffer.clear();
+	memory.begin();
+
+	// Threads don't pay off for small documents.
+	parser_input src = in.source();
+	unsigned int threadCount = src.file == nullptr && src.size < PARALLEL_MIN_SIZE ? 1 : threads;
+
+	// The parallel binary JSON parser doesn't go through the callbacks, so
+	// it can't count the events or leave anything out.
+	bool parsed;
+	if (streaming)
+		parsed = stream_json(hand, src, message, &stats.bytesIn);
+	else if (threadCount > 1 && !collectStats && projection.empty() && src.file == nullptr && is_bjson(src.data, src.size) && parse_bjson_parallel(state, src.data, src.size, threadCount, utf8 == utf8_all, maxDepth))
+	{
+		parsed = true;
+		stats.bytesIn = src.size;
+	}
+	else
+		parsed = parse_json(state, hand, src, message, &stats.bytesIn);
+
+	in.close();
+	stats.parse = lap(mark, writing, sink);
+
+	if (parsed && format == output_bjson)
+	{
+		binary.clear();
+		parsed = encode_bjson(&state.root, binary, message);
+		stats.encode = lap(mark, writing, sink);
+	}
+	else if (parsed && !streaming && inPlace)
+	{
+		// The sink isn't open, so this goes to `buffer`.
+		parsed = generated(generate_json_parallel(gen, &state.root, threadCount, memory.funcs()), message);
+		stats.generate = lap(mark, writing, sink);
+	}
+
+	if (memory.exceeded())
+	{
+		parsed = false;
+		message = "memory limit exceeded";
+	}
+
+	if (!parsed)
+	{
+		// Keep what was streamed, as far as the error.
+		yajl_gen_flush(gen);
+		sink.close();
+		finish();
+		return fail(error, input, message.c_str());
+	}
+
+	if (!direct && !sink.open(output))
+	{
+		finish();
+		return fail(error, output, strerror(errno));
+	}
+
+	if (format == output_bjson)
+		sink.write(binary.data(), binary.size());
+	else if (!direct && (streaming || inPlace))
+		sink.write(buffer.data(), buffer.size());
+	else if (!direct)
+	{
+		// Streamed output is already in the sink.
+		parsed = generated(generate_json_parallel(gen, &state.root, threadCount, memory.funcs()), message);
+		stats.generate = lap(mark, writing, sink);
+	}
+
+	finish();
+	if (!sink.close())
+		return fail(error, output, strerror(errno));
+	else if (!parsed)
+		return fail(error, input, message.c_str());
+
+	return true;
+}
+
+bool converter::convert(const char *input, const std::vector<converter_output> &outputs, std::string &error)
+{
+	stats_scope scope(*this);
+	std::chrono::steady_clock::time_point mark = std::chrono::steady_clock::now();
+	double writing = sink.write_time();
+
+	std::string message;
+	input_data in;
+	if (!in.open(input))
+		return fail(error, input, strerror(errno));
+	stats.read = lap(mark, writing, sink);
+
+	if (tapeHand == nullptr)
+		tapeHand = alloc_handle(&tape_cb, &tape, tapeHook, tapeFilter);
+
+	memory.begin();
+	bool parsed = run_parser(tapeHand, in.source(), message, &stats.bytesIn);
+	in.close();
+	stats.parse = lap(mark, writing, sink);
+
+	if (memory.exceeded())
+	{
+		parsed = false;
+		message = "memory limit exceeded";
+	}
+
+	if (!parsed)
+	{
+		tape.reset();
+		return fail(error, input, message.c_str());
+	}
+
+	// The input is closed by now, so any output can replace it.
+	bool ok = true;
+	for (const converter_output &output: outputs)
+	{
+		if (output.format == output_bjson)
+		{
+			binary.clear();
+			state.hintLimit = (size_t) -1;
+			if (!tape.replay(&reader_cb, &state))
+			{
+				ok = fail(error, input, "memory limit exceeded");
+				break;
+			}
+			else if (!encode_bjson(&state.root, binary, message))
+			{
+				ok = fail(error, input, message.c_str());
+				break;
+			}
+			stats.encode += lap(mark, writing, sink);
+		}
+
+		if (!sink.open(output.path))
+		{
+			ok = fail(error, output.path, strerror(errno));
+			break;
+		}
+
+		if (output.format != output_bjson)
+			yajl_gen_config(gen, yajl_gen_beautify, output.format != output_compact_json);
+
+		if (output.format == output_bjson)
+			sink.write(binary.data(), binary.size());
+		else if (!tape.replay(&stream_cb, gen))
+		{
+			sink.close();
+			ok = fail(error, output.path, "cannot generate JSON text for the document");
+			break;
+		}
+		else
+			stats.generate += lap(mark, writing, sink);
+
+		finish();
+		if (!sink.close())
+		{
+			ok = fail(error, output.path, strerror(errno));
+			break;
+		}
+	}
+
+	finish();
+	tape.reset();
+	yajl_gen_config(gen, yajl_gen_beautify, format != output_compact_json);
+	return ok;
+}
+
+bool converter::convert(const unsigned char *data, size_t size, output_format format, std::vector<char> &output, std::string &error)
+{
+	stats_scope scope(*this);
+	std::chrono::steady_clock::time_point mark = std::chrono::steady_clock::now();
+	double writing = sink.write_time();
+
+	std::string message;
+	buffer.clear();
+	binary.clear();
+	memory.begin();
+
+	// The sink is closed, so the generator writes into `buffer`.
+	bool direct = streaming && format != output_bjson;
+	if (format != output_bjson)
+		yajl_gen_config(gen, yajl_gen_beautify, format != output_compact_json);
+
+	parser_input src = {data, size, nullptr};
+	unsigned int threadCount = size < PARALLEL_MIN_SIZE ? 1 : threads;
+
+	bool parsed;
+	if (direct)
+		parsed = stream_json(hand, src, message, &stats.bytesIn);
+	else if (threadCount > 1 && !collectStats && projection.empty() && is_bjson(data, size) && parse_bjson_parallel(state, data, size, threadCount, utf8 == utf8_all, maxDepth))
+	{
+		parsed = true;
+		stats.bytesIn = size;
+	}
+	else
+		parsed = parse_json(state, tree_handle(), src, message, &stats.bytesIn);
+	stats.parse = lap(mark, writing, sink);
+
+	if (parsed && format == output_bjson)
+	{
+		parsed = encode_bjson(&state.root, binary, message);
+		stats.encode = lap(mark, writing, sink);
+	}
+	else if (parsed && !direct)
+	{
+		parsed = generated(generate_json_parallel(gen, &state.root, threadCount, memory.funcs()), message);
+		stats.generate = lap(mark, writing, sink);
+	}
+
+	if (memory.exceeded())
+	{
+		parsed = false;
+		message = "memory limit exceeded";
+	}
+
+	finish();
+	yajl_gen_config(gen, yajl_gen_beautify, this->format != output_compact_json);
+	if (!parsed)
+		return fail(error, "input", message.c_str());
+
+	// Swapping hands the caller's old storage to `buffer`, so that neither
+	// side allocates again for documents of a similar size.
+	if (format == output_bjson)
+		output.assign(binary.begin(), binary.end());
+	else
+		output.swap(buffer);
+
+	stats.bytesOut = output.size();
+	return true;
+}
+
+bool converter::extract(const char *input, const char *pointer, const char *output, std::string &error)
+{
+	stats_scope scope(*this);
+	std::chrono::steady_clock::time_point mark = std::chrono::steady_clock::now();
+	double writing = sink.write_time();
+
+	std::string message;
+	input_data in;
+	if (!in.open(input))
+		return fail(error, input, strerror(errno));
+
+	// The view needs the whole document in memory.
+	parser_input src = in.source();
+	std::vector<unsigned char> whole;
+	if (src.file != nullptr)
+	{
+		unsigned char chunk[64 * 1024];
+		size_t size;
+		while ((size = fread(chunk, 1, sizeof(chunk), src.file)) > 0)
+			whole.insert(whole.end(), chunk, chunk + size);
+
+		if (ferror(src.file))
+			return fail(error, input, strerror(errno));
+
+		src = {whole.data(), whole.size(), nullptr};
+	}
+	stats.read = lap(mark, writing, sink);
+	stats.bytesIn = src.size;
+
+	// Collect the output in `buffer` so that it can't clobber the input.
+	buffer.clear();
+	binary.clear();
+	memory.begin();
+
+	// The view can't leave anything out, so projections parse too.
+	bool found;
+	if (projection.empty() && is_bjson(src.data, src.size))
+	{
+		bjson_view view;
+		bjson_view::node n;
+		found = view.open(src.data, src.size, message, utf8 == utf8_all, maxDepth) && view.find(view.root(), pointer, n, message);
+
+		if (found && format != output_bjson)
+			found = view.decode(n, &stream_cb, gen, message);
+		else if (found)
+		{
+			state.hintLimit = src.size;
+			found = view.decode(n, &reader_cb, &state, message) && encode_bjson(&state.root, binary, message);
+		}
+		// The view decodes straight into the output.
+		stats.parse = lap(mark, writing, sink);
+	}
+	else
+	{
+		// Other formats need the tree.
+		found = parse_json(state, tree_handle(), src, message);
+
+		const json_data *value = found ? find_json(&state.root, pointer, message) : nullptr;
+		found = value != nullptr;
+		stats.parse = lap(mark, writing, sink);
+
+		if (found && format != output_bjson)
+		{
+			found = generated(generate_json(gen, value), message);
+			stats.generate = lap(mark, writing, sink);
+		}
+		else if (found)
+		{
+			found = encode_bjson(value, binary, message);
+			stats.encode = lap(mark, writing, sink);
+		}
+	}
+
+	in.close();
+	if (memory.exceeded())
+	{
+		found = false;
+		message = "memory limit exceeded";
+	}
+
+	if (!found)
+	{
+		finish();
+		return fail(error, input, message.c_str());
+	}
+
+	if (!sink.open(output))
+	{
+		finish();
+		return fail(error, output, strerror(errno));
+	}
+
+	if (format == output_bjson)
+		sink.write(binary.data(), binary.size());
+	else
+		sink.write(buffer.data(), buffer.size());
+
+	finish();
+	if (!sink.close())
+		return fail(error, output, strerror(errno));
+
+	return true;
+}
+
+void converter::print(void *ctx, const char *str, size_t len)
+{
+	converter *self = (converter *) ctx;
+
+	if (self->sink.is_open())
+		self->sink.write(str, len);
+	else
+		self->buffer.insert(self->buffer.end(), str, str + len);
+}
+
+bool converter::fail(std::string &error, const char *name, const char *message)
+{
+	error = name;
+	error += ": ";
+	error += message;
+	return false;
+}
+
+void converter::finish()
+{
+	state.reset();
+	yajl_gen_reset(gen, nullptr);
+}
+
+yajl_handle converter::alloc_handle(const yajl_callbacks *callbacks, void *ctx, stats_hook &through, json_filter &filter)
+{
+	if (!projection.empty())
+	{
+		filter.attach(&projection, callbacks, ctx);
+		callbacks = &project_cb;
+		ctx = &filter;
+	}
+
+	yajl_handle h;
+	if (!collectStats)
+		h = yajl_alloc(callbacks, memory.funcs(), ctx);
+	else
+	{
+		through = {callbacks, ctx, &stats, {}};
+		h = yajl_alloc(&stats_cb, memory.funcs(), &through);
+	}
+
+	yajl_config(h, yajl_dont_validate_strings, (int) (utf8 == utf8_trusted));
+	yajl_config(h, yajl_validate_binary_strings, (int) (utf8 == utf8_all));
+	yajl_config(h, yajl_max_depth, maxDepth);
+	yajl_config(h, yajl_input, (int) input);
+	return h;
+}
+
+yajl_handle converter::tree_handle()
+{
+	if (!streaming)
+		return hand;
+
+	if (treeHand == nullptr)
+		treeHand = alloc_handle(&reader_cb, &state, treeHook, treeFilter);
+
+	return treeHand;
+}
+
+bool converter::is_bjson(const unsigned char *data, size_t size) const
+{
+	if (input == yajl_input_auto)
+		return size > 0 && data[0] == 0xFF;
+
+	return input == yajl_input_bjson;
+}
+
+converter::stats_scope::stats_scope(converter &owner)
+: owner(owner)
+, start(std::chrono::steady_clock::now())
+, written(owner.sink.written())
+, writing(owner.sink.write_time())
+{
+	owner.stats = conversion_stats();
+	owner.hook.seen.clear();
+	owner.tapeHook.seen.clear();
+	owner.treeHook.seen.clear();
+	// A failed conversion may have left a filter inside the document.
+	owner.filter.reset();
+	owner.tapeFilter.reset();
+	owner.treeFilter.reset();
+}
+
+converter::stats_scope::~stats_scope()
+{
+	conversion_stats &stats = owner.stats;
+	stats.total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	stats.write = owner.sink.write_time() - writing;
+	// In-memory conversions have counted their output already.
+	stats.bytesOut += owner.sink.written() - written;
+}
+
+// Writes one response of serve().
+static bool write_response(FILE *out, bool ok, const char *data, size_t len)
+{
+	unsigned char header[5] = {
+		(unsigned char) (ok ? 0 : 1),
+		(unsigned char) (len >> 24), (unsigned char) (len >> 16), (unsigned char) (len >> 8), (unsigned char) len
+	};
+
+	return fwrite(header, 1, sizeof(header), out) == sizeof(header) && fwrite(data, 1, len, out) == len && fflush(out) == 0;
+}
+
+// Most of a request read into memory at once.
+static constexpr size_t SERVE_PIECE = 1024 * 1024;
+
+bool serve(converter &conv, FILE *in, FILE *out, std::string &error)
+{
+	// Kept from one request to the next, like the converter's own memory.
+	std::vector<unsigned char> request;
+	std::vector<char> response;
+	std::string message;
+
+	for (;;)
+	{
+		unsigned char header[5];
+		size_t got = fread(header, 1, sizeof(header), in);
+		if (got == 0 && feof(in))
+			return true;
+		else if (got != sizeof(header))
+		{
+			error = ferror(in) ? strerror(errno) : "truncated request";
+			return false;
+		}
+
+		// The size comes from the client, so the buffer only grows as the
+		// document actually arrives.
+		size_t size = read_be32(header + 1);
+		size_t limit = conv.allocator().memory_limit();
+		bool tooLarge = limit != 0 && size > limit;
+		request.clear();
+		for (size_t done = 0; done < size;)
+		{
+			unsigned char discard[64 * 1024];
+			unsigned char *to = discard;
+			size_t piece = std::min<size_t>(size - done, tooLarge ? sizeof(discard) : SERVE_PIECE);
+			if (!tooLarge)
+			{
+				request.resize(done + piece);
+				to = request.data() + done;
+			}
+
+			if (fread(to, 1, piece, in) != piece)
+			{
+				error = ferror(in) ? strerror(errno) : "truncated request";
+				return false;
+			}
+			done += piece;
+		}
+
+		output_format format;
+		bool ok = true;
+		switch (header[0])
+		{
+			case 'j':
+				format = output_json;
+				break;
+			case 'c':
+				format = output_compact_json;
+				break;
+			case 'b':
+				format = output_bjson;
+				break;
+			default:
+				ok = false;
+				message = "unknown output format";
+				break;
+		}
+
+		if (ok && tooLarge)
+		{
+			ok = false;
+			message = "request larger than the memory limit";
+		}
+
+		if (ok)
+			ok = conv.convert(request.data(), request.size(), format, response, message);
+		if (ok && response.size() > UINT32_MAX)
+		{
+			ok = false;
+			message = "output too large";
+		}
+
+		bool written;
+		if (ok)
+			written = write_response(out, true, response.data(), response.size());
+		else
+			written = write_response(out, false, message.data(), message.size());
+
+		if (!written)
+		{
+			error = strerror(errno);
+			return false;
+		}
+	}
+}
@@ -0,0 +1,1685 @@
+// Copyright (c) 2023 Dark Energy Processor
+//
+// Permission is hereby granted, free of charge, to any person obtaining a 
+// copy of this software and associated documentation files (the "Software"), 
+// to deal in the Software without restriction, including without limitation 
+// the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+// and/or sell copies of the Software, and to permit persons to whom the 
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in 
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+// DEALINGS IN THE SOFTWARE.
+
+#ifndef RJSON_H
+#define RJSON_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "JSonParser/api/yajl_gen.h"
+#include "JSonParser/api/yajl_parse.h"
+
+enum json_type {
+	json_type_null,
+	json_type_boolean,
+	json_type_integer,
+	json_type_real,
+	json_type_string,
+	json_type_map,
+	json_type_array
+};
+
+// Where a converter's memory comes from. Its yajl handles, generators and
+// tree arena all allocate here, so that the memory of each conversion can be
+// measured and capped. Pooled allocators keep freed blocks in power of two
+// size classes for the next conversion instead of handing them back to
+// malloc. Thread-safe, as parallel parsing and generation share one.
+class json_allocator
+{
+public:
+	// `limit` is in bytes, 0 for none.
+	json_allocator(bool pooled = false, size_t limit = 0);
+	json_allocator(const json_allocator &) = delete;
+	json_allocator &operator=(const json_allocator &) = delete;
+	~json_allocator();
+
+	// These return nullptr only when malloc does. Going over the limit just
+	// sets exceeded(), since yajl can't deal with failed allocations.
+	void *allocate(size_t size);
+	void *reallocate(void *ptr, size_t size);
+	void release(void *ptr);
+
+	// Starts measuring the next conversion.
+	void begin();
+
+	// Bytes allocated and not released yet, counting whole size classes
+	// for pooled allocators.
+	size_t used() const
+	{
+		return current.load(std::memory_order_relaxed);
+	}
+
+	// Highest used() since begin().
+	size_t peak() const
+	{
+		return highest.load(std::memory_order_relaxed);
+	}
+
+	// allocate() and reallocate() calls since begin().
+	size_t allocations() const
+	{
+		return count.load(std::memory_order_relaxed);
+	}
+
+	// The limit in bytes, 0 for none.
+	size_t memory_limit() const
+	{
+		return limit;
+	}
+
+	// Whether used() went over the limit since begin().
+	bool exceeded() const
+	{
+		return over.load(std::memory_order_relaxed);
+	}
+
+	// For yajl_alloc() and yajl_gen_alloc().
+	yajl_alloc_funcs *funcs()
+	{
+		return &yajlFuncs;
+	}
+
+private:
+	// Smallest and largest pooled blocks, header included.
+	static constexpr unsigned int POOL_MIN_SHIFT = 5;
+	static constexpr unsigned int POOL_MAX_SHIFT = 20;
+
+	// Keeps the blocks aligned like malloc's.
+	union header
+	{
+		size_t size;
+		std::max_align_t align;
+	};
+
+	static bool is_pooled(size_t size)
+	{
+		return size <= ((size_t) 1 << POOL_MAX_SHIFT) - sizeof(header);
+	}
+
+	// Smallest class that fits `size` bytes plus the header.
+	static unsigned int size_class(size_t size)
+	{
+		unsigned int c = 0;
+		while (((size_t) 1 << (c + POOL_MIN_SHIFT)) < size + sizeof(header))
+			c++;
+
+		return c;
+	}
+
+	bool pooled;
+	size_t limit;
+	yajl_alloc_funcs yajlFuncs;
+	std::atomic<size_t> current, highest, count;
+	std::atomic<bool> over;
+	std::mutex lock;
+	// Freed blocks of each size class, linked through their first bytes.
+	header *freeLists[POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1];
+
+	void account(size_t added, size_t removed);
+};
+
+// Lets standard containers allocate from a json_allocator, or from malloc
+// when there is none.
+template<class T>
+struct json_std_allocator
+{
+	typedef T value_type;
+
+	json_allocator *source;
+
+	json_std_allocator(json_allocator *source = nullptr)
+	: source(source)
+	{ }
+
+	template<class U>
+	json_std_allocator(const json_std_allocator<U> &other)
+	: source(other.source)
+	{ }
+
+	T *allocate(size_t n)
+	{
+		void *result = source ? source->allocate(n * sizeof(T)) : malloc(n * sizeof(T));
+		if (result == nullptr)
+			throw std::bad_alloc();
+
+		return (T *) result;
+	}
+
+	void deallocate(T *ptr, size_t)
+	{
+		if (source)
+			source->release(ptr);
+		else
+			free(ptr);
+	}
+
+	template<class U>
+	bool operator==(const json_std_allocator<U> &other) const
+	{
+		return source == other.source;
+	}
+
+	template<class U>
+	bool operator!=(const json_std_allocator<U> &other) const
+	{
+		return source != other.source;
+	}
+};
+
+template<class T>
+using json_vector = std::vector<T, json_std_allocator<T>>;
+
+// Bump allocator backing the whole tree. Nodes and strings are never freed
+// individually; everything goes away at once when the arena is destroyed or
+// reset.
+class json_arena
+{
+public:
+	// Leaves room for the bookkeeping of the block and its allocator, so
+	// that a whole block takes no more than 64 KiB.
+	static constexpr size_t BLOCK_SIZE = 64 * 1024 - 64;
+
+	json_arena()
+	: head(nullptr)
+	, current(nullptr)
+	, end(nullptr)
+	, blockCount(0)
+	, source(nullptr)
+	{ }
+	json_arena(const json_arena &) = delete;
+	json_arena &operator=(const json_arena &) = delete;
+	~json_arena()
+	{
+		clear();
+	}
+
+	void *allocate(size_t size)
+	{
+		size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+		if (size > (size_t) (end - current))
+		{
+			// Big allocations get a block of their own so the rest of the
+			// current block is not wasted.
+			if (size > BLOCK_SIZE / 4)
+				return new_block(size, false);
+
+			current = (char *) new_block(BLOCK_SIZE, true);
+			end = current + BLOCK_SIZE;
+		}
+
+		void *result = current;
+		current += size;
+		return result;
+	}
+
+	template<class T>
+	T *allocate_array(size_t count)
+	{
+		return count == 0 ? nullptr : (T *) allocate(count * sizeof(T));
+	}
+
+	const char *copy_string(const char *str, size_t len)
+	{
+		if (len == 0)
+			return "";
+
+		char *result = (char *) allocate(len);
+		memcpy(result, str, len);
+		return result;
+	}
+
+	void clear()
+	{
+		while (head)
+		{
+			block *next = head->next;
+			release(head);
+			head = next;
+		}
+
+		current = end = nullptr;
+	}
+
+	// Gets the blocks from `allocator` instead of malloc. Only allowed while
+	// the arena holds no blocks, and not changed by reset().
+	void set_allocator(json_allocator *allocator)
+	{
+		source = allocator;
+	}
+
+	json_allocator *allocator() const
+	{
+		return source;
+	}
+
+	// Whether the allocator went over its limit.
+	bool exceeded() const
+	{
+		return source != nullptr && source->exceeded();
+	}
+
+	// Takes over all the memory of `other`, which is left empty. Both must
+	// use the same allocator.
+	void adopt(json_arena &other)
+	{
+		if (other.head == nullptr)
+			return;
+
+		block *tail = other.head;
+		while (tail->next)
+			tail = tail->next;
+
+		if (head == nullptr)
+		{
+			head = other.head;
+			current = other.current;
+			end = other.end;
+		}
+		else
+		{
+			// Keep allocating from the current block.
+			tail->next = head->next;
+			head->next = other.head;
+		}
+
+		blockCount += other.blockCount;
+		other.head = nullptr;
+		other.current = other.end = nullptr;
+		other.blockCount = 0;
+	}
+
+	// Number of blocks malloc'd over the arena's lifetime.
+	size_t allocations() const
+	{
+		return blockCount;
+	}
+
+	// Frees everything but keeps one block around for the next document.
+	void reset()
+	{
+		block *keep = nullptr;
+
+		while (head)
+		{
+			block *next = head->next;
+			if (keep == nullptr && head->size == BLOCK_SIZE)
+				keep = head;
+			else
+				release(head);
+			head = next;
+		}
+
+		head = keep;
+		if (keep)
+		{
+			keep->next = nullptr;
+			current = (char *) (keep + 1);
+			end = current + BLOCK_SIZE;
+		}
+		else
+			current = end = nullptr;
+	}
+
+private:
+	static constexpr size_t ALIGNMENT = 8;
+
+	struct block
+	{
+		block *next;
+		size_t size;
+	};
+
+	block *head;
+	char *current, *end;
+	size_t blockCount;
+	json_allocator *source;
+
+	void *new_block(size_t size, bool front)
+	{
+		size_t total = sizeof(block) + size;
+		block *b = (block *) (source ? source->allocate(total) : malloc(total));
+		if (b == nullptr)
+			throw std::bad_alloc();
+
+		b->size = size;
+		blockCount++;
+		if (front || head == nullptr)
+		{
+			b->next = head;
+			head = b;
+		}
+		else
+		{
+			b->next = head->next;
+			head->next = b;
+		}
+
+		return b + 1;
+	}
+
+	void release(block *b)
+	{
+		if (source)
+			source->release(b);
+		else
+			free(b);
+	}
+};
+
+struct json_string
+{
+	const char *data;
+	size_t length;
+};
+
+struct json_string_hash
+{
+	size_t operator()(const json_string &str) const
+	{
+		// FNV-1a
+		size_t hash = (size_t) 2166136261U;
+		for (size_t i = 0; i < str.length; i++)
+			hash = (hash ^ (unsigned char) str.data[i]) * (size_t) 16777619U;
+
+		return hash;
+	}
+};
+
+struct json_string_equal
+{
+	bool operator()(const json_string &a, const json_string &b) const
+	{
+		return a.length == b.length && memcmp(a.data, b.data, a.length) == 0;
+	}
+};
+
+struct json_member;
+
+// Tree node. Containers point to their children, which are stored
+// contiguously in the arena once the container is complete.
+struct json_data
+{
+	json_type type;
+
+	union {
+		bool boolean;
+		int64_t integer;
+		double real;
+		json_string string;
+		struct
+		{
+			json_member *items;
+			size_t count;
+		} map;
+		struct
+		{
+			json_data *items;
+			size_t count;
+		} array;
+	};
+
+	json_data(json_type t = json_type_null)
+	: type(t)
+	{
+		switch (t)
+		{
+			default:
+			case json_type_null:
+				break;
+			case json_type_boolean:
+				boolean = false;
+				break;
+			case json_type_integer:
+				integer = 0;
+				break;
+			case json_type_real:
+				real = 0.0;
+				break;
+			case json_type_string:
+				string = {"", 0};
+				break;
+			case json_type_map:
+				map = {nullptr, 0};
+				break;
+			case json_type_array:
+				array = {nullptr, 0};
+				break;
+		}
+	}
+	json_data(bool b)
+	: type(json_type_boolean)
+	, boolean(b)
+	{ }
+	json_data(int64_t i)
+	: type(json_type_integer)
+	, integer(i)
+	{ }
+	json_data(double r)
+	: type(json_type_real)
+	, real(r)
+	{ }
+	json_data(json_string str)
+	: type(json_type_string)
+	, string(str)
+	{ }
+};
+
+struct json_member
+{
+	json_string key;
+	json_data value;
+};
+
+// Key lookups into the objects of a tree. Objects keep their members in
+// document order and have no hash table of their own; one is built here for an
+// object the second time it is searched, when it is big enough for that to pay
+// off. The tree must stay unchanged while the index is used.
+class json_index
+{
+public:
+	// First member of `object` called `key`, or nullptr.
+	const json_data *member(const json_data *object, json_string key);
+
+	void clear()
+	{
+		objects.clear();
+	}
+
+private:
+	// Objects up to this size are always searched linearly.
+	static constexpr size_t LINEAR_LIMIT = 16;
+
+	struct table
+	{
+		size_t lookups;
+		std::unordered_map<json_string, size_t, json_string_hash, json_string_equal> members;
+	};
+
+	std::unordered_map<const json_data *, table> objects;
+};
+
+// Passed by the text parser as container size when it is not known upfront.
+constexpr unsigned int JSON_SIZE_UNKNOWN = (unsigned int) -1;
+
+struct json_data_state
+{
+	static constexpr size_t KEY_CACHE_SIZE = 256;
+	// Longer keys are rarely repeated, and cost more to hash.
+	static constexpr size_t KEY_CACHE_MAX_LENGTH = 64;
+
+	struct frame
+	{
+		json_type type;
+		// Child array allocated upfront from the size hint, or nullptr when
+		// the children are collected in `pending` instead.
+		void *items;
+		size_t count;
+		size_t capacity;
+		// Index in `pending` of the first child when not presized.
+		size_t first;
+	};
+
+	json_arena arena;
+	// Children of the open containers that had no usable size hint,
+	// innermost last. Arrays leave the key empty.
+	json_vector<json_member> pending;
+	json_vector<frame> frames;
+	// Constant pool strings copied so far, indexed by memberCache ID.
+	json_vector<json_string> interned;
+	// Same, by pool index, for events that don't come from a parser handle.
+	json_vector<json_string> pooled;
+	// Recent keys that have no constant pool entry, by hash, so that the
+	// keys repeated in every object in text JSON and MessagePack are mostly
+	// copied once.
+	json_string keyCache[KEY_CACHE_SIZE];
+	json_string key;
+	json_data root;
+	bool hasRoot;
+	// Parser handle while parsing, for the constant pool cache.
+	yajl_handle hand;
+	// Upper bound for trusted size hints. Every element takes at least one
+	// byte of input, so anything above the input size is bogus.
+	size_t hintLimit;
+
+	// Everything is allocated from `allocator`, or malloc if it's nullptr.
+	json_data_state(json_allocator *allocator = nullptr)
+	: pending(allocator)
+	, frames(allocator)
+	, interned(allocator)
+	, pooled(allocator)
+	, key({"", 0})
+	, hasRoot(false)
+	, hand(nullptr)
+	, hintLimit((size_t) -1)
+	{
+		arena.set_allocator(allocator);
+		std::fill_n(keyCache, KEY_CACHE_SIZE, json_string({"", 0}));
+	}
+
+	// Forgets the previous document, keeping the memory for the next one.
+	void reset()
+	{
+		arena.reset();
+		pending.clear();
+		frames.clear();
+		interned.clear();
+		pooled.clear();
+		std::fill_n(keyCache, KEY_CACHE_SIZE, json_string({"", 0}));
+		key = {"", 0};
+		root = json_data();
+		hasRoot = false;
+	}
+
+	bool insert(const json_data &value)
+	{
+		// Stops the parser once the allocator is over its limit.
+		if (arena.exceeded())
+			return false;
+
+		if (!hasRoot)
+		{
+			root = value;
+			hasRoot = true;
+			return true;
+		}
+		else if (frames.empty())
+			return false;
+
+		frame &top = frames.back();
+		if (top.items != nullptr)
+		{
+			if (top.count < top.capacity)
+			{
+				if (top.type == json_type_map)
+					((json_member *) top.items)[top.count++] = {key, value};
+				else
+					((json_data *) top.items)[top.count++] = value;
+
+				return true;
+			}
+
+			// The hint was wrong. Continue with the unsized path.
+			spill(top);
+		}
+
+		pending.push_back({key, value});
+		return true;
+	}
+
+	// Appends `count` copies of a scalar to the innermost array.
+	bool insert_run(const json_data &value, size_t count)
+	{
+		if (arena.exceeded())
+			return false;
+
+		if (frames.empty() || frames.back().type != json_type_array)
+		{
+			for (; count > 0; count--)
+			{
+				if (!insert(value))
+					return false;
+			}
+
+			return true;
+		}
+
+		frame &top = frames.back();
+		if (top.items != nullptr)
+		{
+			if (count <= top.capacity - top.count)
+			{
+				std::fill_n((json_data *) top.items + top.count, count, value);
+				top.count += count;
+				return true;
+			}
+
+			spill(top);
+		}
+
+		pending.insert(pending.end(), count, json_member{{"", 0}, value});
+		return true;
+	}
+
+	// Copies a string or key into the arena. Binary JSON constant pool
+	// entries are copied only on their first occurrence; the pool entry's
+	// memberCache then remembers where the copy is, or `pooled` does when
+	// the events come from a bjson_view instead of a parser.
+	json_string intern(const char *str, size_t len, int cte_pool)
+	{
+		if (cte_pool < 0)
+			return {arena.copy_string(str, len), len};
+		else if (hand == nullptr)
+		{
+			if ((size_t) cte_pool >= pooled.size())
+				pooled.resize((size_t) cte_pool + 1, {nullptr, 0});
+
+			if (pooled[cte_pool].data == nullptr)
+				pooled[cte_pool] = {arena.copy_string(str, len), len};
+
+			return pooled[cte_pool];
+		}
+
+		int id = bjson_getCPCacheID(hand, cte_pool);
+		if (id >= 0 && (size_t) id < interned.size())
+			return interned[id];
+
+		json_string result = {arena.copy_string(str, len), len};
+		bjson_setCPCacheID(hand, cte_pool, (int) interned.size());
+		interned.push_back(result);
+		return result;
+	}
+
+	// Same as intern, but keys without a constant pool entry also go
+	// through keyCache.
+	json_string intern_key(const char *str, size_t len, int cte_pool)
+	{
+		if (cte_pool >= 0 || len > KEY_CACHE_MAX_LENGTH)
+			return intern(str, len, cte_pool);
+
+		json_string &cached = keyCache[json_string_hash()({str, len}) & (KEY_CACHE_SIZE - 1)];
+		if (cached.length != len || memcmp(cached.data, str, len) != 0)
+			cached = {arena.copy_string(str, len), len};
+
+		return cached;
+	}
+
+	bool open(json_type type, unsigned int size = JSON_SIZE_UNKNOWN)
+	{
+		if (!insert(json_data(type)))
+			return false;
+
+		frame f = {type, nullptr, 0, 0, pending.size()};
+		if (size != JSON_SIZE_UNKNOWN && size <= hintLimit)
+		{
+			f.capacity = size;
+			if (type == json_type_map)
+				f.items = arena.allocate_array<json_member>(size);
+			else
+				f.items = arena.allocate_array<json_data>(size);
+
+			// Empty containers still need a non-null marker.
+			if (f.items == nullptr)
+				f.items = &root;
+		}
+
+		frames.push_back(f);
+		return true;
+	}
+
+	bool close()
+	{
+		if (frames.empty())
+			return false;
+
+		frame top = frames.back();
+		frames.pop_back();
+
+		json_data *node = &root;
+		if (!frames.empty())
+		{
+			// The container is always the latest child of its parent.
+			const frame &parent = frames.back();
+			if (parent.items == nullptr)
+				node = &pending[top.items == nullptr ? top.first - 1 : pending.size() - 1].value;
+			else if (parent.type == json_type_map)
+				node = &((json_member *) parent.items)[parent.count - 1].value;
+			else
+				node = &((json_data *) parent.items)[parent.count - 1];
+		}
+
+		if (top.items != nullptr)
+		{
+			if (top.type == json_type_map)
+				node->map = {top.count ? (json_member *) top.items : nullptr, top.count};
+			else
+				node->array = {top.count ? (json_data *) top.items : nullptr, top.count};
+
+			return true;
+		}
+
+		size_t count = pending.size() - top.first;
+		if (node->type == json_type_map)
+		{
+			node->map.items = arena.allocate_array<json_member>(count);
+			node->map.count = count;
+			std::copy(pending.begin() + top.first, pending.end(), node->map.items);
+		}
+		else
+		{
+			node->array.items = arena.allocate_array<json_data>(count);
+			node->array.count = count;
+			for (size_t i = 0; i < count; i++)
+				node->array.items[i] = pending[top.first + i].value;
+		}
+
+		pending.resize(top.first);
+		return true;
+	}
+
+private:
+	void spill(frame &f)
+	{
+		f.first = pending.size();
+
+		for (size_t i = 0; i < f.count; i++)
+		{
+			if (f.type == json_type_map)
+				pending.push_back(((json_member *) f.items)[i]);
+			else
+				pending.push_back({{"", 0}, ((json_data *) f.items)[i]});
+		}
+
+		f.items = nullptr;
+	}
+};
+
+// Flat record of the parser events of a document, to parse it once and then
+// replay the events into any number of consumers: a yajl_gen through
+// stream_cb, a tree through reader_cb, and so on. Each event is a 64-bit word
+// with a tag in the top byte and a payload below it. Integers too big for the
+// payload, doubles and runs take a second word for their value. Containers
+// are sized as they close, so that replays pass exact sizes. Strings go to a
+// separate buffer, and keys and constant pool strings are stored only once.
+class json_tape
+{
+public:
+	static constexpr size_t KEY_CACHE_SIZE = 256;
+	static constexpr size_t KEY_CACHE_MAX_LENGTH = 64;
+
+	// Everything is allocated from `allocator`, or malloc if it's nullptr.
+	json_tape(json_allocator *allocator = nullptr)
+	: words(allocator)
+	, strings(allocator)
+	, frames(allocator)
+	, pooled(allocator)
+	, source(allocator)
+	, sharedCount(0)
+	{
+		std::fill_n(keyCache, KEY_CACHE_SIZE, NO_STRING);
+	}
+
+	// Forgets the previous document, keeping the memory for the next one.
+	void reset()
+	{
+		words.clear();
+		strings.clear();
+		frames.clear();
+		pooled.clear();
+		std::fill_n(keyCache, KEY_CACHE_SIZE, NO_STRING);
+		sharedCount = 0;
+	}
+
+	// Whether a whole document was recorded.
+	bool complete() const
+	{
+		return !words.empty() && frames.empty();
+	}
+
+	// Bytes taken by the events and strings.
+	size_t size() const
+	{
+		return words.size() * sizeof(uint64_t) + strings.size();
+	}
+
+	// Passes the events to `callbacks` as the parser did, except that
+	// containers come with their exact size. Strings and keys stored once are
+	// passed with an ID unique within the tape as cte_pool, -1 otherwise.
+	// The run callbacks are optional. Returns false as soon as a callback
+	// returns 0.
+	bool replay(const yajl_callbacks *callbacks, void *ctx) const;
+
+	// Recording, as done by tape_cb. These return false once the allocator is
+	// over its limit, or for values the tape can't hold.
+
+	bool null()
+	{
+		return value(TAG_NULL, 0);
+	}
+
+	bool boolean(bool b)
+	{
+		return value(b ? TAG_TRUE : TAG_FALSE, 0);
+	}
+
+	bool integer(int64_t i)
+	{
+		// Sign-extends from the top of the payload.
+		if ((int64_t) ((uint64_t) i << (64 - TAG_SHIFT)) >> (64 - TAG_SHIFT) == i)
+			return value(TAG_INTEGER, (uint64_t) i & PAYLOAD_MASK);
+
+		return value(TAG_INTEGER64, 0, (uint64_t) i);
+	}
+
+	bool real(double r)
+	{
+		uint64_t bits;
+		memcpy(&bits, &r, sizeof(bits));
+		return value(TAG_REAL, 0, bits);
+	}
+
+	bool string(const char *str, size_t len, int cte_pool)
+	{
+		size_t offset = store(str, len, cte_pool, false);
+		return offset != NO_STRING && value(TAG_STRING, offset);
+	}
+
+	bool key(const char *str, size_t len, int cte_pool)
+	{
+		size_t offset = store(str, len, cte_pool, true);
+		if (offset == NO_STRING || frames.empty())
+			return false;
+
+		words.push_back(TAG_KEY << TAG_SHIFT | offset);
+		return true;
+	}
+
+	bool open(bool map)
+	{
+		if (!value(map ? TAG_MAP : TAG_ARRAY, 0))
+			return false;
+
+		frames.push_back({words.size() - 1, 0});
+		return true;
+	}
+
+	bool close()
+	{
+		if (frames.empty())
+			return false;
+
+		const frame &top = frames.back();
+		uint64_t tag = (words[top.open] >> TAG_SHIFT) == TAG_MAP ? TAG_END_MAP : TAG_END_ARRAY;
+		words[top.open] |= words.size();
+		words.push_back(tag << TAG_SHIFT | std::min<uint64_t>(top.count, PAYLOAD_MASK));
+		frames.pop_back();
+		return !exceeded();
+	}
+
+	bool integer_run(int64_t i, unsigned int count)
+	{
+		return value(TAG_INTEGER_RUN, count, (uint64_t) i, count);
+	}
+
+	bool boolean_run(bool b, unsigned int count)
+	{
+		return value(TAG_BOOLEAN_RUN, (uint64_t) count << 1 | b, 0, count);
+	}
+
+private:
+	enum : uint64_t
+	{
+		TAG_NULL,
+		TAG_FALSE,
+		TAG_TRUE,
+		// Payload is the value.
+		TAG_INTEGER,
+		// Value is in the next word, as for the two below.
+		TAG_INTEGER64,
+		TAG_REAL,
+		// Payload is the string offset.
+		TAG_STRING,
+		TAG_KEY,
+		// Payload is the index of the closing word.
+		TAG_MAP,
+		TAG_ARRAY,
+		// Payload is the number of members or elements.
+		TAG_END_MAP,
+		TAG_END_ARRAY,
+		// Payload is the count.
+		TAG_INTEGER_RUN,
+		// Payload is the count shifted left by one, with the value below.
+		TAG_BOOLEAN_RUN
+	};
+
+	static constexpr unsigned int TAG_SHIFT = 56;
+	static constexpr uint64_t PAYLOAD_MASK = ((uint64_t) 1 << TAG_SHIFT) - 1;
+	static constexpr size_t NO_STRING = (size_t) -1;
+	// String IDs of strings that aren't shared.
+	static constexpr uint32_t UNSHARED = (uint32_t) -1;
+	// Each string is preceded by its length and ID.
+	static constexpr size_t STRING_HEADER = 2 * sizeof(uint32_t);
+
+	struct frame
+	{
+		size_t open;
+		size_t count;
+	};
+
+	json_vector<uint64_t> words;
+	json_vector<char> strings;
+	json_vector<frame> frames;
+	// Offsets of the constant pool strings stored so far, by pool index.
+	json_vector<size_t> pooled;
+	// Offsets of recent keys that have no constant pool entry, by hash.
+	size_t keyCache[KEY_CACHE_SIZE];
+	json_allocator *source;
+	uint32_t sharedCount;
+
+	bool exceeded() const
+	{
+		return source != nullptr && source->exceeded();
+	}
+
+	// Records a value event, followed by `second` for the tags that take a
+	// second word. It stands for `count` values of the container.
+	bool value(uint64_t tag, uint64_t payload, uint64_t second = 0, size_t count = 1)
+	{
+		if (exceeded())
+			return false;
+		else if (frames.empty() && !words.empty())
+			return false;
+
+		if (!frames.empty())
+			frames.back().count += count;
+
+		words.push_back(tag << TAG_SHIFT | payload);
+		if (tag == TAG_INTEGER64 || tag == TAG_REAL || tag == TAG_INTEGER_RUN)
+			words.push_back(second);
+
+		return true;
+	}
+
+	bool same(size_t offset, const char *str, size_t len) const
+	{
+		uint32_t length;
+		memcpy(&length, strings.data() + offset, sizeof(length));
+		return length == len && memcmp(strings.data() + offset + STRING_HEADER, str, len) == 0;
+	}
+
+	// Offset of a copy of the string, reusing the earlier copy of constant
+	// pool strings and of recent keys. NO_STRING if it's too long.
+	size_t store(const char *str, size_t len, int cte_pool, bool isKey)
+	{
+		size_t *shared = nullptr;
+		if (cte_pool >= 0)
+		{
+			if ((size_t) cte_pool >= pooled.size())
+				pooled.resize((size_t) cte_pool + 1, NO_STRING);
+
+			shared = &pooled[cte_pool];
+		}
+		else if (isKey && len <= KEY_CACHE_MAX_LENGTH)
+		{
+			shared = &keyCache[json_string_hash()({str, len}) & (KEY_CACHE_SIZE - 1)];
+			if (*shared != NO_STRING && !same(*shared, str, len))
+				*shared = NO_STRING;
+		}
+
+		if (shared != nullptr && *shared != NO_STRING)
+			return *shared;
+		else if (len > UINT32_MAX || strings.size() + STRING_HEADER + len > PAYLOAD_MASK)
+			return NO_STRING;
+
+		uint32_t header[2] = {(uint32_t) len, shared && sharedCount < UNSHARED ? sharedCount++ : UNSHARED};
+		size_t offset = strings.size();
+		strings.insert(strings.end(), (const char *) header, (const char *) header + STRING_HEADER);
+		strings.insert(strings.end(), str, str + len);
+
+		if (shared != nullptr)
+			*shared = offset;
+
+		return offset;
+	}
+};
+
+// Where the parser reads from: either the whole document in memory, which
+// stays valid during the parse, or a file that is read in chunks.
+struct parser_input
+{
+	const unsigned char *data;
+	size_t size;
+	FILE *file;
+};
+
+// Generates the tree below `root` into `gen`.
+yajl_gen_status generate_json(yajl_gen gen, const json_data *root);
+
+// Same output as generate_json, with the children of a root array or object
+// generated on `threads` threads and written in order as they complete.
+// The generators of the threads use `alloc`, nullptr for malloc.
+yajl_gen_status generate_json_parallel(yajl_gen gen, const json_data *root, unsigned int threads, const yajl_alloc_funcs *alloc = nullptr);
+
+// Appends the tree below `root` to `out` in the binary JSON format read by
+// bjson_parse. Strings and keys used more than once go to the constant pool,
+// integers use the narrowest opcode and runs of equal integers or booleans in
+// arrays are run-length encoded. Fails only for strings or containers too
+// large for the format.
+bool encode_bjson(const json_data *root, std::vector<unsigned char> &out, std::string &error);
+
+// Forwards every parser event straight into the yajl_gen passed as context,
+// so the output is produced without building a json_data tree first.
+extern const yajl_callbacks stream_cb;
+
+// Builds the json_data tree of the json_data_state passed as context.
+extern const yajl_callbacks reader_cb;
+
+// Records the events into the json_tape passed as context.
+extern const yajl_callbacks tape_cb;
+
+// What a conversion did. Times are wall clock seconds; event counts are only
+// collected by converters created with stats on.
+struct conversion_stats
+{
+	enum event
+	{
+		event_null,
+		event_boolean,
+		event_integer,
+		event_double,
+		event_string,
+		event_key,
+		event_map,
+		event_array,
+		event_integer_run,
+		event_boolean_run,
+		event_count
+	};
+
+	// Parser events by callback. A run counts once.
+	size_t events[event_count];
+	// Values passed by runs.
+	size_t runValues;
+	// Strings and keys referring to a binary JSON constant pool entry, and
+	// how many of those refer to an entry used before.
+	size_t poolReferences;
+	size_t poolHits;
+	size_t bytesIn;
+	size_t bytesOut;
+	// Opening the input. Input that isn't mapped is read while parsing.
+	double read;
+	// Also covers building the tree, or generating when streaming.
+	double parse;
+	double encode;
+	double generate;
+	// Spent in the system calls writing the output.
+	double write;
+	double total;
+};
+
+// Context of stats_cb: the callbacks and context that handle the events.
+struct stats_hook
+{
+	const yajl_callbacks *callbacks;
+	void *ctx;
+	conversion_stats *stats;
+	// Constant pool entries referred to so far.
+	std::vector<bool> seen;
+};
+
+// Counts every event into the stats of a stats_hook and passes it on. A
+// handle allocated with it in front of other callbacks collects stats, and
+// handles allocated without it pay nothing for them.
+extern const yajl_callbacks stats_cb;
+
+// Which parts of a document to keep, as a list of JSONPath-like patterns.
+// A pattern is `$` followed by steps: `.name` or `['name']` for a member,
+// `[2]` for an array element, `.*` or `[*]` for any of them, and `..` before
+// a step to look for it at any depth below. A pattern without the leading
+// `$` is looked for at any depth, so "unit_id" means "$..unit_id".
+class json_projection
+{
+public:
+	// Progress through one pattern: its next step, and where it ends.
+	struct state
+	{
+		size_t step;
+		size_t end;
+	};
+
+	// Adds a pattern, or says in `error` why it's invalid.
+	bool add(const char *pattern, std::string &error);
+
+	bool empty() const
+	{
+		return roots.empty();
+	}
+
+	// Whether some pattern is just `$`.
+	bool whole() const;
+
+	const std::vector<state> &start() const
+	{
+		return roots;
+	}
+
+	// Adds the states that follow `from` for a member named [key, key + len)
+	// or, when `key` is nullptr, the array element `index` to `to`, unless
+	// already there from `first` on. True when a pattern ends there, which
+	// keeps the value whole.
+	bool advance(const state &from, const char *key, size_t len, size_t index, std::vector<state> &to, size_t first) const;
+
+private:
+	struct step
+	{
+		enum kind_t
+		{
+			step_name,
+			step_index,
+			step_any
+		} kind;
+		// Preceded by `..`.
+		bool descendant;
+		std::string name;
+		size_t index;
+	};
+
+	// All patterns back to back.
+	std::vector<step> steps;
+	std::vector<state> roots;
+};
+
+// Passes on the events of the parts of a document a json_projection keeps.
+// Objects and arrays on the way to a kept value are kept too, without the
+// rest of their contents, and so is the root. Containers no pattern can
+// reach into are skipped with YAJL_SKIP_CONTAINER, so binary input steps
+// over them without decoding them. A `..` step reaches into everything below
+// it, so patterns without one skip the most.
+class json_filter
+{
+public:
+	json_filter()
+	: projection(nullptr)
+	, callbacks(nullptr)
+	, ctx(nullptr)
+	{
+		reset();
+	}
+
+	// Passes what `projection` keeps to `callbacks`.
+	void attach(const json_projection *projection, const yajl_callbacks *callbacks, void *ctx);
+
+	// Gets ready for the next document.
+	void reset();
+
+	// Each of these handles the parser event of the same name.
+	int null();
+	int boolean(bool value);
+	int integer(long long value);
+	int real(double value);
+	int string(const char *str, size_t len, int cte_pool);
+	int open(bool object, unsigned int size);
+	int key(const char *str, size_t len, int cte_pool);
+	int close(bool object);
+	int integer_run(long long value, unsigned int count);
+	int boolean_run(bool value, unsigned int count);
+
+private:
+	// What happens to a value.
+	enum verdict
+	{
+		verdict_drop,
+		// Keeps what the patterns find inside a container.
+		verdict_descend,
+		verdict_keep
+	};
+
+	// A container being looked into. Its states are active[begin, end).
+	struct frame
+	{
+		size_t begin;
+		size_t end;
+		bool object;
+		// Of the next element, for arrays.
+		size_t index;
+		// Its key in the parent object, written once something is kept.
+		std::string key;
+		int keyPool;
+	};
+
+	const json_projection *projection;
+	const yajl_callbacks *callbacks;
+	void *ctx;
+	std::vector<frame> frames;
+	std::vector<json_projection::state> active;
+	// Frames whose start was passed on, always the outermost ones.
+	size_t opened;
+	// Depth inside a kept value, or inside a skipped container.
+	size_t pass;
+	size_t skip;
+	// The verdict of the last key, and the key when looking into its value.
+	verdict pending;
+	std::string pendingKey;
+	int pendingPool;
+
+	// Works out the verdict for a member or element of the innermost frame.
+	verdict select(const char *key, size_t len, size_t index);
+	// The verdict for the value starting now.
+	verdict next();
+	// Passes on the start of every frame not opened yet.
+	bool flush();
+};
+
+// Forwards the events of the json_filter passed as context to it.
+extern const yajl_callbacks project_cb;
+
+// Read-only view of a binary JSON document in memory. Only the header and the
+// constant pool are read upfront. Looking up a path skips over the records of
+// everything before it without decoding them, and only the value found is
+// decoded, so extracting a field doesn't cost a parse of the whole document.
+class bjson_view
+{
+public:
+	// A value in the document: the offset of its first record. Elements of an
+	// RLE run all point to the run record.
+	typedef size_t node;
+
+	bjson_view()
+	: data(nullptr)
+	, size(0)
+	, start(0)
+	, validate(false)
+	, depthLimit(BJSN_MAX_DEPTH)
+	{ }
+
+	// Reads the header and constant pool of [data, data + size), which must
+	// stay valid while the view is used. With `validateStrings` decoding
+	// fails on strings that aren't valid UTF-8, which for the constant pool
+	// is checked here, once. Decoding fails on containers nested deeper
+	// than `maxDepth`.
+	bool open(const unsigned char *data, size_t size, std::string &error, bool validateStrings = false, size_t maxDepth = BJSN_MAX_DEPTH);
+
+	node root() const
+	{
+		return start;
+	}
+
+	// Finds the value at a JSON pointer ("/key/0/key", "" for the root)
+	// below `from`.
+	bool find(node from, const char *pointer, node &result, std::string &error) const;
+
+	// Passes the value at `n` to `callbacks` as the events bjson_parse would
+	// produce for it.
+	bool decode(node n, const yajl_callbacks *callbacks, void *ctx, std::string &error) const;
+
+	// Same for all records in [begin, end), which must hold whole values
+	// (and keys), such as a range from split(). `outer` is the number of
+	// containers the range is in, which count towards the depth limit.
+	bool decode_range(size_t begin, size_t end, const yajl_callbacks *callbacks, void *ctx, std::string &error, size_t outer = 0) const;
+
+	// Splits the children of an object or array into about `pieces` ranges
+	// of similar byte size without decoding them. `bounds` gets the offset of
+	// the first child, of every child starting a new range and of the
+	// closing record, so range i is [bounds[i], bounds[i + 1]) and holds
+	// counts[i] children.
+	bool split(node container, size_t pieces, std::vector<size_t> &bounds, std::vector<size_t> &counts) const;
+
+private:
+	const unsigned char *data;
+	size_t size;
+	// Offset of the first record after the constant pool.
+	size_t start;
+	std::vector<json_string> pool;
+	bool validate;
+	size_t depthLimit;
+
+	// Size of the record at `offset`, or 0 if it is cut off or invalid.
+	size_t record_size(size_t offset) const;
+	// Moves `offset` from the start of a value to the record after it.
+	bool skip(size_t &offset) const;
+	bool key(size_t offset, json_string &result) const;
+	// Number of values the record at `offset` stands for.
+	unsigned int run_count(size_t offset, size_t length) const;
+	// Passes one record to the callbacks, `count` times for RLE records.
+	// Containers can be opened while `depth` is below `maxDepth`.
+	bool emit(size_t offset, size_t length, unsigned int count, const yajl_callbacks *callbacks, void *ctx, size_t &depth, size_t maxDepth, std::string &error) const;
+	bool member(node object, const std::string &name, node &result, std::string &error) const;
+	bool element(node array, size_t index, node &result, std::string &error) const;
+};
+
+// Parses binary JSON in memory into state.root like parse_json, with the
+// children of the root container decoded on `threads` threads. A bjson_view
+// first splits the root into ranges, each of which gets decoded into a
+// json_data_state of its own. Their arenas are handed over to state.arena
+// once the root is put together. Returns false, leaving `state` alone, for
+// documents that can't be split or don't decode; parse_json then gives the
+// proper error for those. `validateStrings` and `maxDepth` are as for
+// bjson_view::open.
+bool parse_bjson_parallel(json_data_state &state, const unsigned char *data, size_t size, unsigned int threads, bool validateStrings = false, size_t maxDepth = BJSN_MAX_DEPTH);
+
+// Same as bjson_view::find, for a parsed tree. Returns nullptr with `error`
+// set if there is nothing at the pointer. Pass an index to speed up repeated
+// lookups into the same objects.
+const json_data *find_json(const json_data *root, const char *pointer, std::string &error, json_index *index = nullptr);
+
+// Feeds the whole of `in` to `hand` and resets it afterwards, so the same
+// handle can parse the next document. The number of bytes fed goes to
+// `bytesRead` unless it's nullptr.
+bool run_parser(yajl_handle hand, const parser_input &in, std::string &error, size_t *bytesRead = nullptr);
+
+// Parses JSON, binary JSON or MessagePack from `in` into state.root with
+// `hand`, a handle allocated with reader_cb and &state (or with stats_cb in
+// front of those). The tree lives in state.arena until state.reset().
+bool parse_json(json_data_state &state, yajl_handle hand, const parser_input &in, std::string &error, size_t *bytesRead = nullptr);
+
+// Converts the document from `in` straight into a yajl_gen as the parser
+// events arrive, using `hand` allocated with stream_cb and that generator.
+// Memory use is bounded by the nesting depth instead of the document size, at
+// the cost of not being able to look at the document as a whole.
+bool stream_json(yajl_handle hand, const parser_input &in, std::string &error, size_t *bytesRead = nullptr);
+
+// Input document. Regular files are mapped so the parsers work on the page
+// cache directly. Anything else (stdin, pipes) is read in chunks while
+// parsing instead. Close it before the same file is opened for writing.
+class input_data
+{
+public:
+	input_data()
+	: ptr(nullptr)
+	, length(0)
+	, file(nullptr)
+#ifdef _WIN32
+	, mapping(nullptr)
+#endif
+	{ }
+	input_data(const input_data &) = delete;
+	input_data &operator=(const input_data &) = delete;
+	~input_data()
+	{
+		close();
+	}
+
+	// Returns false with errno set on failure.
+	bool open(const char *path);
+
+	void close();
+
+	parser_input source() const
+	{
+		return {ptr, length, file};
+	}
+
+private:
+	const unsigned char *ptr;
+	size_t length;
+	FILE *file;
+#ifdef _WIN32
+	// HANDLE of the file mapping.
+	void *mapping;
+#endif
+
+	// Only fails for reasons the read fallback may not have, e.g. the file
+	// being empty or not a regular file.
+	bool map(const char *path);
+};
+
+enum output_format {
+	output_json,
+	output_bjson,
+	// JSON without any whitespace.
+	output_compact_json
+};
+
+// Where converted documents are written. Output is collected in a fixed-size
+// buffer that goes to the file descriptor whenever it fills up, so memory use
+// doesn't grow with the document. Writes bigger than the buffer go out along
+// with what is buffered in a single system call.
+class output_sink
+{
+public:
+	static constexpr size_t BUFFER_SIZE = 256 * 1024;
+
+	output_sink()
+	: fd(-1)
+	, owned(false)
+	, used(0)
+	, error(0)
+	, bytes(0)
+	, seconds(0)
+	{ }
+	output_sink(const output_sink &) = delete;
+	output_sink &operator=(const output_sink &) = delete;
+	~output_sink()
+	{
+		close();
+	}
+
+	// Opens `path` for writing, "-" being stdout. Returns false with errno
+	// set on failure.
+	bool open(const char *path);
+
+	bool is_open() const
+	{
+		return fd != -1;
+	}
+
+	void write(const void *data, size_t len);
+
+	// Writes what's still buffered and closes the file. Returns false with
+	// errno set if any write failed.
+	bool close();
+
+	// Bytes written and seconds spent writing them, over the lifetime of the
+	// sink.
+	size_t written() const
+	{
+		return bytes;
+	}
+
+	double write_time() const
+	{
+		return seconds;
+	}
+
+	// yajl_print_t for generators writing into a sink.
+	static void print(void *ctx, const char *str, size_t len)
+	{
+		((output_sink *) ctx)->write(str, len);
+	}
+
+private:
+	int fd;
+	bool owned;
+	size_t used;
+	// First write error. Later output is dropped.
+	int error;
+	size_t bytes;
+	double seconds;
+	std::unique_ptr<char[]> buffer;
+
+	// Writes the buffer followed by `len` bytes of `extra`.
+	void flush(const void *extra, size_t len);
+};
+
+// Which input strings a converter checks for valid UTF-8. The output is
+// never checked again, as its strings all come from the input.
+enum utf8_policy {
+	// JSON text as it is lexed. Binary JSON and MessagePack are trusted.
+	utf8_text,
+	// Binary input too, each binary JSON constant pool entry once when the
+	// pool is read.
+	utf8_all,
+	// Nothing, for input that is known to be valid.
+	utf8_trusted
+};
+
+// One of the outputs of converter::convert.
+struct converter_output
+{
+	const char *path;
+	output_format format;
+};
+
+// How a converter works.
+struct converter_options
+{
+	// Detected from the first byte by default.
+	yajl_input_format input = yajl_input_auto;
+	output_format format = output_json;
+	// Write the output while parsing instead of building the tree first.
+	// Binary JSON output needs the whole document, so this only applies to
+	// JSON output.
+	bool streaming = false;
+	// Large documents are generated with up to this many threads.
+	unsigned int threads = 1;
+	// Keep freed memory for the next conversion, see json_allocator.
+	bool pooled = false;
+	// Conversions that need more bytes than this fail, 0 meaning no limit.
+	size_t memoryLimit = 0;
+	// Count the parser events into converter::statistics(), which makes
+	// binary JSON always parse on one thread.
+	bool collectStats = false;
+	// The input strings that must be valid UTF-8.
+	utf8_policy utf8 = utf8_text;
+	// Deepest nesting of objects and arrays accepted in the input and
+	// written to the output.
+	unsigned int maxDepth = YAJL_MAX_DEPTH;
+	// Converts only what these patterns keep, all of it when there are none.
+	// Binary JSON then always parses on one thread.
+	json_projection project;
+};
+
+// Converts documents one at a time. The parser, generator and tree memory
+// are kept from one document to the next, so a batch of small files doesn't
+// pay for setting them up again for every file.
+class converter
+{
+public:
+	explicit converter(const converter_options &options = converter_options());
+	converter(const converter &) = delete;
+	converter &operator=(const converter &) = delete;
+	~converter();
+
+	// Converts `input` to `output`, either of which can be "-" for stdin and
+	// stdout. On failure `error` says which file and why.
+	bool convert(const char *input, const char *output, std::string &error);
+
+	// Converts `input` to every one of `outputs`, each in its own format,
+	// instead of the converter's. The input is parsed only once, into a
+	// json_tape that is then replayed for each output.
+	bool convert(const char *input, const std::vector<converter_output> &outputs, std::string &error);
+
+	// Converts the document in [data, data + size) to `format` instead of
+	// the converter's, replacing the contents of `output`. No file is read
+	// or written, so this suits converting requests in a server.
+	bool convert(const unsigned char *data, size_t size, output_format format, std::vector<char> &output, std::string &error);
+
+	// Writes the value at a JSON pointer in `input` to `output`. Binary JSON
+	// is looked up with a bjson_view, other formats are parsed first. With a
+	// projection the pointer is looked up in what it keeps.
+	bool extract(const char *input, const char *pointer, const char *output, std::string &error);
+
+	// Memory use of the last conversion.
+	const json_allocator &allocator() const
+	{
+		return memory;
+	}
+
+	// What the last conversion did.
+	const conversion_stats &statistics() const
+	{
+		return stats;
+	}
+
+private:
+	bool streaming;
+	output_format format;
+	unsigned int threads;
+	// Declared first, as everything below allocates from it.
+	json_allocator memory;
+	json_data_state state;
+	yajl_gen gen;
+	yajl_handle hand;
+	// Where the generator writes. When it isn't open the output is collected
+	// in `buffer` instead.
+	output_sink sink;
+	std::vector<char> buffer;
+	std::vector<unsigned char> binary;
+	// For conversions to several outputs. The handle is allocated on first
+	// use.
+	json_tape tape;
+	yajl_handle tapeHand;
+	// Builds the tree for a streaming converter when one is needed anyway.
+	// Also allocated on first use.
+	yajl_handle treeHand;
+	bool collectStats;
+	utf8_policy utf8;
+	unsigned int maxDepth;
+	yajl_input_format input;
+	conversion_stats stats;
+	stats_hook hook;
+	stats_hook tapeHook;
+	stats_hook treeHook;
+	json_projection projection;
+	json_filter filter;
+	json_filter tapeFilter;
+	json_filter treeFilter;
+
+	static void print(void *ctx, const char *str, size_t len);
+	static bool fail(std::string &error, const char *name, const char *message);
+
+	// Input size from which the output is generated with several threads.
+	static constexpr size_t PARALLEL_MIN_SIZE = 1024 * 1024;
+	// Gets ready for the next document.
+	void finish();
+	// A handle for `callbacks`, with project_cb in front of them when
+	// projecting and stats_cb in front of those when collecting stats, set
+	// up for the input format, UTF-8 policy and depth limit.
+	yajl_handle alloc_handle(const yajl_callbacks *callbacks, void *ctx, stats_hook &through, json_filter &filter);
+	// `hand` unless streaming, the tree handle otherwise.
+	yajl_handle tree_handle();
+	// Whether the document in memory at `data` is binary JSON, which can
+	// then be looked at with a bjson_view.
+	bool is_bjson(const unsigned char *data, size_t size) const;
+
+	// Times a whole conversion into `stats`, from its construction until
+	// it goes out of scope.
+	class stats_scope
+	{
+	public:
+		stats_scope(converter &owner);
+		~stats_scope();
+
+	private:
+		converter &owner;
+		std::chrono::steady_clock::time_point start;
+		size_t written;
+		double writing;
+	};
+};
+
+// Converts requests read from `in` with `conv` and writes a response for
+// each to `out`, until `in` ends. Keeping one converter running like this,
+// behind a pipe or a socket, saves setting it up for every document.
+//
+// A request is a format byte ('j' for JSON, 'c' for compact JSON, 'b' for
+// binary JSON), the size of the document as a big-endian 32 bit integer and
+// the document. A response is a status byte (0 for success, 1 for failure),
+// the size of the rest as a big-endian 32 bit integer and either the
+// converted document or an error message. Requests larger than the
+// converter's memory limit are read but not converted. Only a broken stream
+// stops serving, and `error` then says why.
+bool serve(converter &conv, FILE *in, FILE *out, std::string &error);
+
+#endif
@@ -0,0 +1,243 @@
+// Copyright (c) 2023 Dark Energy Processor
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Checks of the projection filter and the binary JSON decoder against broken
+// input, and of converting files. Prints every failed check and exits with 1
+// if there was any.
+
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_DEPRECATE
+#endif
+
+#include <cstdio>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#include "rjson.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+	if (!ok)
+	{
+		fprintf(stderr, "FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+// A json_filter writing compact JSON into a generator's own buffer.
+struct filtered
+{
+	json_projection projection;
+	json_filter filter;
+	yajl_gen gen;
+
+	filtered(const char *pattern)
+	{
+		std::string error;
+		check(projection.add(pattern, error), "pattern parses");
+
+		gen = yajl_gen_alloc(nullptr);
+		filter.attach(&projection, &stream_cb, gen);
+	}
+
+	~filtered()
+	{
+		yajl_gen_free(gen);
+	}
+
+	std::string output() const
+	{
+		const unsigned char *buf;
+		size_t len;
+		yajl_gen_get_buf(gen, &buf, &len);
+		return std::string((const char *) buf, len);
+	}
+};
+
+static int key(json_filter &f, const char *str)
+{
+	return f.key(str, strlen(str), -1);
+}
+
+static void test_filter_selects()
+{
+	// {"a": 1, "b": [{"a": 2, "c": 3}], "c": {"d": 4}}
+	filtered f("a");
+	json_filter &j = f.filter;
+	bool ok = j.open(true, 3) && key(j, "a") && j.integer(1)
+		&& key(j, "b") && j.open(false, 1) && j.open(true, 2) && key(j, "a") && j.integer(2) && key(j, "c") && j.integer(3) && j.close(true) && j.close(false)
+		&& key(j, "c") && j.open(true, 1) && j.close(true)
+		&& j.close(true);
+
+	check(ok, "filter passes a document through");
+	check(f.output() == "{\"a\":1,\"b\":[{\"a\":2}]}", "filter keeps the matching members and their containers");
+}
+
+static void test_filter_key_outside_object()
+{
+	// Nothing open yet.
+	filtered atRoot("a");
+	check(key(atRoot.filter, "a") == 0, "filter rejects a key at the root");
+	check(atRoot.output().empty(), "filter passes nothing on for a key at the root");
+
+	// Directly inside an array.
+	filtered inArray("a");
+	check(inArray.filter.open(false, 1) != 0, "filter opens the root array");
+	check(key(inArray.filter, "a") == 0, "filter rejects a key inside an array");
+}
+
+static void test_bjson_structure()
+{
+	// Header without a constant pool, then a member record and an integer at
+	// the root, as found by fuzzing.
+	const unsigned char rootKey[] = {
+		0xFF, 0xFF, 0, 0, 0, 0, 0, 0, 0, 0,
+		BJSN_MEMBER_DIRECT, 0, 0, 0, 1, 'a',
+		BJSN_NUMBER_I8, 1,
+		BJSN_END
+	};
+	// An object closed as an array.
+	const unsigned char mismatched[] = {
+		0xFF, 0xFF, 0, 0, 0, 0, 0, 0, 0, 0,
+		BJSN_OPEN_OBJ, 0, 0, 0, 0,
+		BJSN_CLOSE_ARR,
+		BJSN_END
+	};
+	const unsigned char valid[] = {
+		0xFF, 0xFF, 0, 0, 0, 0, 0, 0, 0, 0,
+		BJSN_OPEN_OBJ, 0, 0, 0, 1,
+		BJSN_MEMBER_DIRECT, 0, 0, 0, 1, 'a',
+		BJSN_NUMBER_I8, 1,
+		BJSN_CLOSE_OBJ,
+		BJSN_END
+	};
+
+	converter_options options;
+	options.format = output_compact_json;
+	std::string error;
+	check(options.project.add("a", error), "pattern parses");
+
+	for (bool streaming: {false, true})
+	{
+		options.streaming = streaming;
+		converter conv(options);
+		std::vector<char> output;
+
+		check(!conv.convert(rootKey, sizeof(rootKey), output_compact_json, output, error), "binary JSON key at the root is rejected");
+		check(!conv.convert(mismatched, sizeof(mismatched), output_compact_json, output, error), "mismatched binary JSON close is rejected");
+		check(conv.convert(valid, sizeof(valid), output_compact_json, output, error) && std::string(output.begin(), output.end()) == "{\"a\":1}", "valid binary JSON converts after rejected input");
+	}
+}
+
+static void test_bjson_chunked_empty_string()
+{
+	// The encoder pools "" first, and read in chunks the pool is copied.
+	const char *json = "{\"\":\"\",\"x\":[\"\"]}";
+	converter conv;
+	std::vector<char> encoded;
+	std::string error;
+	check(conv.convert((const unsigned char *) json, strlen(json), output_bjson, encoded, error), "JSON with empty strings encodes");
+
+	FILE *f = tmpfile();
+	check(f != nullptr, "temporary file opens");
+	if (f == nullptr)
+		return;
+	fwrite(encoded.data(), 1, encoded.size(), f);
+	rewind(f);
+
+	yajl_gen gen = yajl_gen_alloc(nullptr);
+	yajl_handle hand = yajl_alloc(&stream_cb, nullptr, gen);
+	parser_input in = {nullptr, 0, f};
+	std::string message;
+	check(run_parser(hand, in, message), "binary JSON with an empty pooled string parses from a file");
+
+	const unsigned char *buf;
+	size_t len;
+	yajl_gen_get_buf(gen, &buf, &len);
+	check(std::string((const char *) buf, len) == json, "empty pooled strings read from a file stay empty");
+
+	yajl_free(hand);
+	yajl_gen_free(gen);
+	fclose(f);
+}
+
+static std::string read_file(const char *path)
+{
+	std::string data;
+	FILE *f = fopen(path, "rb");
+	if (f == nullptr)
+		return data;
+
+	char buf[4096];
+	size_t len;
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+		data.append(buf, len);
+	fclose(f);
+	return data;
+}
+
+static void test_file_convert()
+{
+	const char *input = "rjson_test_in.json";
+	const char *output = "rjson_test_out.json";
+
+	FILE *f = fopen(input, "wb");
+	check(f != nullptr, "test input can be written");
+	if (f == nullptr)
+		return;
+	fputs("{\"a\": [1, true, \"x\"], \"b\": null}", f);
+	fclose(f);
+
+	converter_options options;
+	options.format = output_compact_json;
+
+	for (bool streaming: {false, true})
+	{
+		options.streaming = streaming;
+		converter conv(options);
+		std::string error;
+
+		check(conv.convert(input, output, error), "file converts to another file");
+		check(read_file(output) == "{\"a\":[1,true,\"x\"],\"b\":null}", "file conversion writes the document");
+		check(conv.convert(input, input, error) && read_file(input) == "{\"a\":[1,true,\"x\"],\"b\":null}", "file converts in-place");
+	}
+
+	remove(input);
+	remove(output);
+}
+
+int main()
+{
+	test_filter_selects();
+	test_filter_key_outside_object();
+	test_bjson_structure();
+	test_bjson_chunked_empty_string();
+	test_file_convert();
+
+	if (failures == 0)
+		printf("all tests passed\n");
+
+	return failures == 0 ? 0 : 1;
+}